@@ -0,0 +1,99 @@
+// Hashes buffers of a few sizes with every kernel this CPU runs and prints
+// the throughput next to the scalar one. Exits with 1 when a kernel gives a
+// different digest than scalar, on the timed sizes or on odd tail lengths.
+//
+// usage: weld_bench_hash [seconds per measurement]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../src/content_hash.hpp"
+
+static std::string random_bytes(size_t size) {
+    std::string bytes(size, '\0');
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    for (auto &byte : bytes) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        byte = char(state);
+    }
+    return bytes;
+}
+
+// Bytes per second of hashing `size` bytes over at least `seconds`
+static double measure(const std::string &data, size_t size, double seconds, ContentHash &digest) {
+    using Clock = std::chrono::steady_clock;
+
+    size_t rounds = 0;
+    auto start = Clock::now();
+    std::chrono::duration<double> elapsed {};
+    do {
+        digest = hash_content(data.data(), size);
+        ++rounds;
+        elapsed = Clock::now() - start;
+    } while (elapsed.count() < seconds);
+
+    return double(size) * rounds / elapsed.count();
+}
+
+int main(int argc, char **argv) {
+    double seconds = argc > 1 ? std::atof(argv[1]) : 0.5;
+
+    const std::vector<size_t> sizes = { 4 << 10, 64 << 10, 1 << 20, 16 << 20 };
+    const std::string data = random_bytes(sizes.back() + 4096);
+
+    std::vector<std::string> kernels = hash_content_kernels();
+    std::map<size_t, ContentHash> expected;
+    std::map<size_t, double> scalar_speed;
+    int status = 0;
+
+    // Scalar goes first, everything else is compared against it
+    if (!use_hash_content_kernel("scalar")) {
+        std::cerr << "error: the scalar kernel isn't available" << std::endl;
+        return 1;
+    }
+    for (size_t size = 0; size <= 2100; size += 7) expected[size] = hash_content(data.data(), size);
+    for (size_t size : { size_t(4 << 20) - 1, size_t(4 << 20) + 65 }) expected[size] = hash_content(data.data(), size);
+
+    std::cout << std::left << std::setw(8) << "kernel" << std::right << std::setw(10) << "size"
+        << std::setw(10) << "GB/s" << std::setw(10) << "vs scalar" << std::endl;
+
+    kernels.erase(std::remove(kernels.begin(), kernels.end(), "scalar"), kernels.end());
+    kernels.insert(kernels.begin(), "scalar");
+
+    for (const auto &name : kernels) {
+        use_hash_content_kernel(name);
+
+        for (const auto &[size, digest] : expected) {
+            if (hash_content(data.data(), size) == digest) continue;
+            std::cerr << "error: " << name << " hashes " << size << " bytes differently than scalar" << std::endl;
+            status = 1;
+        }
+
+        for (size_t size : sizes) {
+            ContentHash digest;
+            double speed = measure(data, size, seconds, digest);
+
+            if (name == "scalar") {
+                scalar_speed[size] = speed;
+                expected[size] = digest;
+            } else if (digest != expected[size]) {
+                std::cerr << "error: " << name << " hashes " << size << " bytes differently than scalar" << std::endl;
+                status = 1;
+            }
+
+            std::cout << std::left << std::setw(8) << name << std::right << std::setw(10) << size
+                << std::setw(10) << std::fixed << std::setprecision(2) << speed / 1e9
+                << std::setw(9) << speed / scalar_speed[size] << "x" << std::endl;
+        }
+    }
+
+    return status;
+}
@@ -0,0 +1,218 @@
+// Stats the inputs of a no-op build the three ways weld can: one stat call
+// after another, split across threads and batched through io_uring, and
+// prints how long each takes. Without a dir it generates 20000 files, with
+// one it stats every file below it. Exits with 1 when the modes disagree.
+//
+// With --weld it also builds a generated project of 200 sources once and
+// then times whole no-op runs of that weld with each --stat-batching. Those
+// include the up-to-date checks, where off stats a header once per source
+// that includes it and the other modes once per build.
+//
+// usage: weld_bench_stat [--weld <weld>] [dir] [rounds]
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../src/stat_batch.hpp"
+
+static std::vector<std::string> generate_files(const std::filesystem::path &root) {
+    std::vector<std::string> paths;
+
+    for (int dir = 0; dir < 200; ++dir) {
+        std::filesystem::path path = root / ("dir" + std::to_string(dir));
+        std::filesystem::create_directories(path);
+
+        for (int file = 0; file < 100; ++file) {
+            paths.push_back((path / ("file" + std::to_string(file) + ".cpp")).string());
+            std::ofstream(paths.back()) << "\n";
+        }
+    }
+    return paths;
+}
+
+static void generate_project(const std::filesystem::path &root) {
+    std::filesystem::create_directories(root / "src");
+
+    std::ofstream(root / "weld.toml")
+        << "[project]\nname = \"noop\"\ntype = \"ConsoleApp\"\n\n"
+        << "[files]\ncextensions = [\".cpp\"]\n\n"
+        << "[settings]\ntoolset = \"g++\"\n\nsrc_dir = \"src\"\nout_dir = \"out\"\n\n"
+        << "[gnuc]\ncflags = [\"-O0\"]\n";
+
+    std::ofstream(root / "src" / "shared.hpp") << "#pragma once\n#include <cstdio>\n";
+
+    std::ofstream main(root / "src" / "main.cpp");
+    main << "#include \"shared.hpp\"\n";
+    for (int file = 0; file < 199; ++file) main << "int f" << file << "();\n";
+    main << "int main() {\n    int sum = 0;\n";
+    for (int file = 0; file < 199; ++file) main << "    sum += f" << file << "();\n";
+    main << "    std::printf(\"%d\\n\", sum);\n}\n";
+
+    for (int file = 0; file < 199; ++file) {
+        std::ofstream(root / "src" / ("f" + std::to_string(file) + ".cpp"))
+            << "#include \"shared.hpp\"\nint f" << file << "() { return " << file << "; }\n";
+    }
+}
+
+// Runs weld in `dir` with its stdout in `log`, the exit code or -1
+static int run_weld(const std::string &weld, const std::filesystem::path &dir, const std::vector<std::string> &flags, const std::string &log) {
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+
+    if (pid == 0) {
+        int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || chdir(dir.c_str()) != 0) _exit(127);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+
+        // Nothing from the user's setup, like a shared cache, may change what runs
+        for (const char *name : { "WELD_CACHE", "WELD_CACHE_DIR", "WELD_REMOTE_CACHE", "WELD_WORKERS", "WELD_STAT_BATCHING" }) unsetenv(name);
+        setenv("HOME", dir.c_str(), 1);
+
+        std::vector<char *> argv = { const_cast<char *>(weld.c_str()) };
+        for (const auto &flag : flags) argv.push_back(const_cast<char *>(flag.c_str()));
+        argv.push_back(nullptr);
+
+        execv(weld.c_str(), argv.data());
+        _exit(127);
+    }
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static std::string read_log(const std::string &log) {
+    std::ifstream in(log);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// Best time of a whole no-op weld run per --stat-batching, 1 when a run failed or rebuilt something
+static int time_noop_builds(const std::string &weld, size_t rounds) {
+    std::filesystem::path root = std::filesystem::temp_directory_path() / ("weld-bench-noop-" + std::to_string(getpid()));
+    std::string log = (root / "weld.log").string();
+    generate_project(root);
+
+    int status = 0;
+    if (run_weld(weld, root, {}, log) != 0) {
+        std::cerr << "error: building the generated project failed:\n" << read_log(log);
+        status = 1;
+    }
+
+    double baseline = 0;
+    for (const char *mode : { "off", "auto", "threads", "io-uring" }) {
+        if (status != 0) break;
+
+        double best = 0;
+        for (size_t round = 0; round < rounds; ++round) {
+            auto start = std::chrono::steady_clock::now();
+            int code = run_weld(weld, root, { "--stat-batching", mode }, log);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            if (code != 0 || read_log(log).find("Building") != std::string::npos) {
+                std::cerr << "error: the no-op build with --stat-batching " << mode << " wasn't one:\n" << read_log(log);
+                status = 1;
+                break;
+            }
+            if (round == 0 || elapsed.count() < best) best = elapsed.count();
+        }
+        if (status != 0) break;
+
+        if (baseline == 0) baseline = best;
+        std::cout << std::left << std::setw(10) << mode << std::right << std::setw(10) << best * 1e3 << " ms"
+            << std::setw(9) << baseline / best << "x" << std::endl;
+    }
+
+    std::error_code ec;
+    std::filesystem::remove_all(root, ec);
+    return status;
+}
+
+static bool same(const FileStat &a, const FileStat &b) {
+    return a.exists == b.exists && a.inode == b.inode && a.size == b.size && a.mtime() == b.mtime();
+}
+
+int main(int argc, char **argv) {
+    std::filesystem::path temp_dir;
+    std::vector<std::string> paths;
+    std::string weld;
+
+    std::vector<std::string> args(argv + 1, argv + argc);
+    if (args.size() >= 2 && args[0] == "--weld") {
+        weld = std::filesystem::absolute(args[1]).string();
+        args.erase(args.begin(), args.begin() + 2);
+    }
+
+    if (!args.empty()) {
+        for (const auto &entry : std::filesystem::recursive_directory_iterator(args[0])) {
+            if (entry.is_regular_file()) paths.push_back(entry.path().string());
+        }
+    } else {
+        temp_dir = std::filesystem::temp_directory_path() / ("weld-bench-stat-" + std::to_string(getpid()));
+        paths = generate_files(temp_dir);
+    }
+    size_t rounds = args.size() > 1 ? std::max(1, std::atoi(args[1].c_str())) : 5;
+
+    // A missing input is part of every no-op check too
+    paths.push_back("/nonexistent/weld-bench-stat");
+
+    const std::pair<const char *, StatBatching> modes[] = {
+        { "off", StatBatching::Off },
+        { "auto", StatBatching::Auto },
+        { "threads", StatBatching::Threads },
+        { "io-uring", StatBatching::IoUring },
+    };
+
+    std::vector<FileStat> expected;
+    double baseline = 0;
+    int status = 0;
+
+    std::cout << paths.size() << " paths, best of " << rounds << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+
+    for (const auto &[name, batching] : modes) {
+        double best = 0;
+        std::vector<FileStat> stats;
+
+        for (size_t round = 0; round < rounds; ++round) {
+            auto start = std::chrono::steady_clock::now();
+            stats = stat_paths(paths, batching);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (round == 0 || elapsed.count() < best) best = elapsed.count();
+        }
+
+        if (batching == StatBatching::Off) {
+            expected = stats;
+            baseline = best;
+        } else if (!std::equal(stats.begin(), stats.end(), expected.begin(), expected.end(), same)) {
+            std::cerr << "error: stat batching " << name << " gives different stat data than single stat calls" << std::endl;
+            status = 1;
+        }
+
+        std::cout << std::left << std::setw(10) << name << std::right << std::setw(10) << best * 1e3 << " ms"
+            << std::setw(9) << baseline / best << "x" << std::endl;
+    }
+
+    std::error_code ec;
+    if (!temp_dir.empty()) std::filesystem::remove_all(temp_dir, ec);
+
+    if (!weld.empty()) {
+        std::cout << "no-op weld runs, best of " << rounds << std::endl;
+        if (time_noop_builds(weld, rounds) != 0) status = 1;
+    }
+    return status;
+}
@@ -0,0 +1,153 @@
+// Lists the sources of a tree with the old recursive_directory_iterator walk
+// and with walk_sources, cold and with a listing cache, and prints the time
+// each takes. Exits with 1 when they find different files. Without a dir it
+// generates a tree of 2000 dirs with 20 files each.
+//
+// usage: weld_bench_walk [dir] [rounds]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../src/build_state.hpp"
+#include "../src/dir_walker.hpp"
+
+// What weld listed sources with before walk_sources
+std::vector<std::filesystem::path> get_args_with_extensions(const std::filesystem::path& dir, const std::vector<std::string>& extensions) {
+    std::vector<std::filesystem::path> result;
+
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(dir)) {
+        if (std::filesystem::is_regular_file(entry)) {
+            std::string ext = entry.path().extension().string();
+
+            if (std::find(extensions.begin(), extensions.end(), ext) != extensions.end()) {
+                result.push_back(entry.path());
+            }
+        }
+    }
+
+    return result;
+}
+
+static void generate_tree(const std::filesystem::path &root) {
+    const char *names[] = { ".cpp", ".hpp", ".c", ".h", ".txt" };
+
+    for (int dir = 0; dir < 2000; ++dir) {
+        std::filesystem::path path = root / ("module" + std::to_string(dir / 50)) / ("dir" + std::to_string(dir));
+        std::filesystem::create_directories(path);
+
+        for (int file = 0; file < 20; ++file) {
+            std::ofstream(path / ("file" + std::to_string(file) + names[file % 5])) << "\n";
+        }
+    }
+
+    // The listing cache leaves out dirs changed in the last 2 s, so the tree is
+    // made an hour old, like a checkout that isn't brand new
+    struct timespec times[2];
+    clock_gettime(CLOCK_REALTIME, &times[0]);
+    times[0].tv_sec -= 3600;
+    times[1] = times[0];
+
+    utimensat(AT_FDCWD, root.c_str(), times, 0);
+    for (const auto &entry : std::filesystem::recursive_directory_iterator(root)) {
+        if (entry.is_directory()) utimensat(AT_FDCWD, entry.path().c_str(), times, 0);
+    }
+}
+
+template <typename Function>
+static double best_of(size_t rounds, Function function) {
+    double best = 0;
+    for (size_t round = 0; round < rounds; ++round) {
+        auto start = std::chrono::steady_clock::now();
+        function();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (round == 0 || elapsed.count() < best) best = elapsed.count();
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    std::filesystem::path temp_dir;
+    std::string root;
+
+    if (argc > 1) {
+        root = argv[1];
+    } else {
+        temp_dir = std::filesystem::temp_directory_path() / ("weld-bench-walk-" + std::to_string(getpid()));
+        generate_tree(temp_dir);
+        root = temp_dir.string();
+    }
+    size_t rounds = argc > 2 ? std::max(1, std::atoi(argv[2])) : 5;
+
+    const std::vector<std::string> extensions = { ".cpp", ".c" };
+    std::vector<std::string> old_files, new_files;
+
+    double old_time = best_of(rounds, [&]() {
+        old_files.clear();
+        for (const auto &path : get_args_with_extensions(root, extensions)) old_files.push_back(path.lexically_normal().string());
+    });
+
+    double walk_time = best_of(rounds, [&]() {
+        PathList files = walk_sources(root, extensions, {});
+        new_files.assign(files.size(), {});
+        for (size_t i = 0; i < files.size(); ++i) new_files[i] = files[i];
+    });
+
+    std::filesystem::path cache_path = std::filesystem::temp_directory_path() / ("weld-bench-listings-" + std::to_string(getpid()));
+    ListingCache listings(cache_path);
+    std::vector<std::string> dirs;
+    walk_sources(root, extensions, {}, &dirs, &listings);
+
+    // The cache leaves out dirs changed in the last 2 s, with none stored the cached row would time a cold walk
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    size_t cacheable = std::count_if(dirs.begin(), dirs.end(), [&now](const std::string &dir) {
+        struct stat st;
+        return stat(dir.c_str(), &st) == 0 && st.st_mtim.tv_sec + 2 < now.tv_sec;
+    });
+
+    if (cacheable == 0) {
+        std::cerr << "error: every dir of " << root << " changed in the last 2 s, the listing cache stored none" << std::endl;
+        std::error_code ec;
+        if (!temp_dir.empty()) std::filesystem::remove_all(temp_dir, ec);
+        return 1;
+    }
+
+    double cached_time = best_of(rounds, [&]() {
+        walk_sources(root, extensions, {}, nullptr, &listings);
+    });
+
+    std::sort(old_files.begin(), old_files.end());
+
+    std::cout << old_files.size() << " files in " << root << ", best of " << rounds << std::endl;
+    if (cacheable < dirs.size()) {
+        std::cout << "only " << cacheable << " of " << dirs.size() << " dirs are old enough to be cached" << std::endl;
+    }
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << std::left << std::setw(28) << "get_args_with_extensions" << std::right << std::setw(10) << old_time * 1e3 << " ms" << std::endl;
+    std::cout << std::left << std::setw(28) << "walk_sources" << std::right << std::setw(10) << walk_time * 1e3 << " ms"
+        << std::setw(9) << old_time / walk_time << "x" << std::endl;
+    std::cout << std::left << std::setw(28) << "walk_sources, cached" << std::right << std::setw(10) << cached_time * 1e3 << " ms"
+        << std::setw(9) << old_time / cached_time << "x" << std::endl;
+
+    std::error_code ec;
+    std::filesystem::remove(cache_path, ec);
+    if (!temp_dir.empty()) std::filesystem::remove_all(temp_dir, ec);
+
+    if (old_files != new_files) {
+        std::cerr << "error: walk_sources found " << new_files.size() << " files, get_args_with_extensions " << old_files.size() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,541 @@
+#include "build_state.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <ctime>
+
+#include <sys/stat.h>
+
+#include "hash.hpp"
+
+static constexpr char STATE_MAGIC[8] = { 'W', 'E', 'L', 'D', 'S', 'T', 'A', 'T' };
+static constexpr uint32_t STATE_VERSION = 3;
+
+static constexpr char DIGESTS_MAGIC[8] = { 'W', 'E', 'L', 'D', 'D', 'I', 'G', 'S' };
+static constexpr uint32_t DIGESTS_VERSION = 4;
+
+static constexpr char LISTINGS_MAGIC[8] = { 'W', 'E', 'L', 'D', 'L', 'I', 'S', 'T' };
+static constexpr uint32_t LISTINGS_VERSION = 1;
+
+// A file changed within this many ns of being hashed may change again
+// without a new mtime, so its digest isn't memoized
+static constexpr uint64_t RACY_WINDOW_NS = 2000000000ull;
+
+template<typename T>
+static void write_value(std::ostream &out, const T &value) {
+    out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void write_string(std::ostream &out, const std::string &str) {
+    write_value(out, static_cast<uint32_t>(str.size()));
+    out.write(str.data(), str.size());
+}
+
+template<typename T>
+static bool read_value(std::istream &in, T &value) {
+    return static_cast<bool>(in.read(reinterpret_cast<char *>(&value), sizeof(value)));
+}
+
+static bool read_string(std::istream &in, std::string &str) {
+    uint32_t size;
+    if (!read_value(in, size)) return false;
+    str.resize(size);
+    return static_cast<bool>(in.read(str.data(), size));
+}
+
+static void write_strings(std::ostream &out, const std::vector<std::string> &strings) {
+    write_value(out, static_cast<uint32_t>(strings.size()));
+    for (const auto &str : strings) write_string(out, str);
+}
+
+static bool read_strings(std::istream &in, std::vector<std::string> &strings) {
+    uint32_t count;
+    if (!read_value(in, count)) return false;
+
+    strings.clear();
+    strings.reserve(std::min<uint32_t>(count, 4096));
+
+    for (uint32_t i = 0; i < count; ++i) {
+        std::string str;
+        if (!read_string(in, str)) return false;
+        strings.push_back(std::move(str));
+    }
+    return true;
+}
+
+static uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + now.tv_nsec;
+}
+
+BuildState::BuildState(std::filesystem::path path)
+    : m_Path(std::move(path)) {
+    load();
+}
+
+void BuildState::load() {
+    std::ifstream in(m_Path, std::ios::binary);
+    if (!in.is_open()) return;
+
+    char magic[sizeof(STATE_MAGIC)];
+    uint32_t version;
+    uint64_t count;
+
+    if (!in.read(magic, sizeof(magic))
+        || std::string_view(magic, sizeof(magic)) != std::string_view(STATE_MAGIC, sizeof(STATE_MAGIC))
+        || !read_value(in, version) || version != STATE_VERSION
+        || !read_value(in, count)) {
+        // Unknown or outdated state, everything gets rebuilt
+        return;
+    }
+
+    for (uint64_t i = 0; i < count; ++i) {
+        std::string output;
+        BuildStateEntry entry;
+
+        if (!read_string(in, output)
+            || !read_value(in, entry.command_hash)
+            || !read_value(in, entry.inputs_hash)) {
+            m_Entries.clear();
+            return;
+        }
+
+        m_Entries[output] = entry;
+    }
+}
+
+bool BuildState::find(const std::string &output, BuildStateEntry &entry) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    auto it = m_Entries.find(output);
+    if (it == m_Entries.end()) return false;
+
+    entry = it->second;
+    return true;
+}
+
+void BuildState::record(const std::string &output, BuildStateEntry entry) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Entries[output] = std::move(entry);
+}
+
+void BuildState::forget(const std::string &output) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Entries.erase(output);
+}
+
+bool BuildState::save() {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    std::filesystem::path tmp_path = m_Path;
+    tmp_path += ".tmp";
+
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) {
+            std::cerr << "error: failed to write " << m_Path.string() << std::endl;
+            return false;
+        }
+
+        out.write(STATE_MAGIC, sizeof(STATE_MAGIC));
+        write_value(out, STATE_VERSION);
+        write_value(out, static_cast<uint64_t>(m_Entries.size()));
+
+        for (const auto &[output, entry] : m_Entries) {
+            write_string(out, output);
+            write_value(out, entry.command_hash);
+            write_value(out, entry.inputs_hash);
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, m_Path, ec);
+    return !ec;
+}
+
+static void update_stamp(Hasher &hasher, const std::string &path, const StatCache *stats) {
+    FileStat st = stat_file(path, stats);
+    if (st.exists) {
+        hasher.update_value(st.mtime_sec);
+        hasher.update_value(st.mtime_nsec);
+        hasher.update_value(static_cast<int64_t>(st.size));
+    } else {
+        hasher.update_value(static_cast<int64_t>(-1));
+    }
+}
+
+static void update_digest(Hasher &hasher, const std::string &path, DigestTable &digests) {
+    ContentHash digest;
+    if (digests.digest(path, digest)) {
+        hasher.update_value(digest);
+    } else {
+        hasher.update_value(static_cast<int64_t>(-1));
+    }
+}
+
+uint64_t hash_input_stamps(const std::vector<std::string_view> &inputs, const StatCache *stats) {
+    Hasher hasher;
+    std::string path;
+
+    for (const auto &input : inputs) {
+        hasher.update(input);
+        path.assign(input);
+        update_stamp(hasher, path, stats);
+    }
+
+    return hasher.digest();
+}
+
+DigestTable::DigestTable(std::filesystem::path path)
+    : m_Path(std::move(path)) {
+    load();
+}
+
+void DigestTable::load() {
+    std::ifstream in(m_Path, std::ios::binary);
+    if (!in.is_open()) return;
+
+    char magic[sizeof(DIGESTS_MAGIC)];
+    uint32_t version;
+    uint64_t count;
+
+    if (!in.read(magic, sizeof(magic))
+        || std::string_view(magic, sizeof(magic)) != std::string_view(DIGESTS_MAGIC, sizeof(DIGESTS_MAGIC))
+        || !read_value(in, version) || version != DIGESTS_VERSION
+        || !read_value(in, count)) {
+        return;
+    }
+
+    for (uint64_t i = 0; i < count; ++i) {
+        std::string path;
+        Entry entry;
+
+        if (!read_string(in, path)
+            || !read_value(in, entry.inode)
+            || !read_value(in, entry.size)
+            || !read_value(in, entry.mtime)
+            || !read_value(in, entry.known)
+            || !read_value(in, entry.digest)
+            || !read_value(in, entry.fingerprint.tokens)
+            || !read_value(in, entry.fingerprint.lines)
+            || !read_value(in, entry.fingerprint.line_sensitive)) {
+            m_Entries.clear();
+            return;
+        }
+
+        m_Entries[path] = entry;
+    }
+}
+
+template<typename Compute>
+bool DigestTable::lookup(const std::string &path, Known kind, Entry &entry, Compute compute) {
+    FileStat st = stat_file(path, m_Stats);
+    if (!st.exists) return false;
+
+    Entry current;
+    current.inode = st.inode;
+    current.size = st.size;
+    current.mtime = st.mtime();
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        auto it = m_Entries.find(path);
+        if (it != m_Entries.end()
+            && it->second.inode == current.inode
+            && it->second.size == current.size
+            && it->second.mtime == current.mtime) {
+            if (it->second.known & kind) {
+                entry = it->second;
+                return true;
+            }
+
+            // Keep what is known about the same file already
+            current = it->second;
+        }
+    }
+
+    if (!compute(path, current)) return false;
+    current.known |= kind;
+    entry = current;
+
+    // The stat may be a prefetched one from before the file was rewritten, the
+    // result is only kept under the stat data the file still has
+    FileStat fresh = stat_file(path, nullptr);
+    bool same = fresh.exists && fresh.inode == current.inode && fresh.size == current.size && fresh.mtime() == current.mtime;
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (same && current.mtime + RACY_WINDOW_NS < now_ns()) {
+        m_Entries[path] = current;
+        m_Changed = true;
+    } else {
+        m_Entries.erase(path);
+    }
+
+    return true;
+}
+
+bool DigestTable::digest(const std::string &path, ContentHash &digest) {
+    Entry entry;
+    bool ok = lookup(path, KNOWN_DIGEST, entry, [](const std::string &path, Entry &entry) {
+        return hash_file(path, entry.digest);
+    });
+
+    if (ok) digest = entry.digest;
+    return ok;
+}
+
+bool DigestTable::fingerprint(const std::string &path, TokenFingerprint &fingerprint) {
+    Entry entry;
+    bool ok = lookup(path, KNOWN_FINGERPRINT, entry, [](const std::string &path, Entry &entry) {
+        return fingerprint_file(path, entry.fingerprint);
+    });
+
+    if (ok) fingerprint = entry.fingerprint;
+    return ok;
+}
+
+bool DigestTable::save() {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (!m_Changed) return true;
+
+    std::filesystem::path tmp_path = m_Path;
+    tmp_path += ".tmp";
+
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) {
+            std::cerr << "error: failed to write " << m_Path.string() << std::endl;
+            return false;
+        }
+
+        out.write(DIGESTS_MAGIC, sizeof(DIGESTS_MAGIC));
+        write_value(out, DIGESTS_VERSION);
+        write_value(out, static_cast<uint64_t>(m_Entries.size()));
+
+        for (const auto &[path, entry] : m_Entries) {
+            write_string(out, path);
+            write_value(out, entry.inode);
+            write_value(out, entry.size);
+            write_value(out, entry.mtime);
+            write_value(out, entry.known);
+            write_value(out, entry.digest);
+            write_value(out, entry.fingerprint.tokens);
+            write_value(out, entry.fingerprint.lines);
+            write_value(out, entry.fingerprint.line_sensitive);
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, m_Path, ec);
+    if (!ec) m_Changed = false;
+    return !ec;
+}
+
+ListingCache::ListingCache(std::filesystem::path path)
+    : m_Path(std::move(path)) {
+    load();
+}
+
+void ListingCache::load() {
+    std::ifstream in(m_Path, std::ios::binary);
+    if (!in.is_open()) return;
+
+    char magic[sizeof(LISTINGS_MAGIC)];
+    uint32_t version;
+    uint64_t count;
+
+    if (!in.read(magic, sizeof(magic))
+        || std::string_view(magic, sizeof(magic)) != std::string_view(LISTINGS_MAGIC, sizeof(LISTINGS_MAGIC))
+        || !read_value(in, version) || version != LISTINGS_VERSION
+        || !read_value(in, count)) {
+        return;
+    }
+
+    for (uint64_t i = 0; i < count; ++i) {
+        std::string dir;
+        Entry entry;
+
+        if (!read_string(in, dir)
+            || !read_string(in, entry.filter)
+            || !read_value(in, entry.listing.inode)
+            || !read_value(in, entry.listing.mtime)
+            || !read_strings(in, entry.listing.files)
+            || !read_strings(in, entry.listing.dirs)) {
+            m_Entries.clear();
+            return;
+        }
+
+        m_Entries[dir] = std::move(entry);
+    }
+}
+
+bool ListingCache::find(const std::string &dir, const std::string &filter, Listing &listing) {
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0) return false;
+
+    uint64_t mtime = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ull + st.st_mtim.tv_nsec;
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    auto it = m_Entries.find(dir);
+    if (it == m_Entries.end()
+        || it->second.filter != filter
+        || it->second.listing.inode != st.st_ino
+        || it->second.listing.mtime != mtime) {
+        return false;
+    }
+
+    listing = it->second.listing;
+    return true;
+}
+
+void ListingCache::store(const std::string &dir, const std::string &filter, const Listing &listing) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    // Another entry could still be added within the same mtime tick
+    if (listing.mtime + RACY_WINDOW_NS < now_ns()) {
+        m_Entries[dir] = Entry{ filter, listing };
+    } else {
+        m_Entries.erase(dir);
+    }
+    m_Changed = true;
+}
+
+bool ListingCache::save() {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (!m_Changed) return true;
+
+    std::filesystem::path tmp_path = m_Path;
+    tmp_path += ".tmp";
+
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) {
+            std::cerr << "error: failed to write " << m_Path.string() << std::endl;
+            return false;
+        }
+
+        out.write(LISTINGS_MAGIC, sizeof(LISTINGS_MAGIC));
+        write_value(out, LISTINGS_VERSION);
+        write_value(out, static_cast<uint64_t>(m_Entries.size()));
+
+        for (const auto &[dir, entry] : m_Entries) {
+            write_string(out, dir);
+            write_string(out, entry.filter);
+            write_value(out, entry.listing.inode);
+            write_value(out, entry.listing.mtime);
+            write_strings(out, entry.listing.files);
+            write_strings(out, entry.listing.dirs);
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, m_Path, ec);
+    if (!ec) m_Changed = false;
+    return !ec;
+}
+
+uint64_t hash_input_contents(
+    const std::vector<std::string_view> &inputs,
+    const std::unordered_set<std::string> &generated,
+    DigestTable &digests,
+    SourceCheck sources,
+    bool debug_info,
+    const StatCache *stats
+) {
+    Hasher hasher;
+    std::string path;
+
+    // A macro from any header may expand __LINE__ in the source that uses it,
+    // so one line sensitive input makes the lines count for all of them
+    std::vector<TokenFingerprint> fingerprints;
+    std::vector<bool> found;
+    bool lines = debug_info;
+
+    if (sources == SourceCheck::Tokens) {
+        fingerprints.resize(inputs.size());
+        found.resize(inputs.size());
+
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            path.assign(inputs[i]);
+            if (generated.count(path) || !has_token_syntax(path)) continue;
+
+            found[i] = digests.fingerprint(path, fingerprints[i]);
+            lines = lines || (found[i] && fingerprints[i].line_sensitive);
+        }
+    }
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        const auto &input = inputs[i];
+        hasher.update(input);
+        path.assign(input);
+
+        if (generated.count(path) || sources == SourceCheck::Digests) {
+            update_digest(hasher, path, digests);
+        } else if (sources == SourceCheck::Stamps) {
+            update_stamp(hasher, path, stats);
+        } else if (!has_token_syntax(path)) {
+            update_digest(hasher, path, digests);
+        } else if (found[i]) {
+            hasher.update_value(fingerprints[i].select(lines));
+        } else {
+            hasher.update_value(static_cast<int64_t>(-1));
+        }
+    }
+
+    return hasher.digest();
+}
+
+std::vector<std::string> parse_depfile(const std::filesystem::path &path) {
+    std::ifstream in(path);
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    std::string content = buffer.str();
+
+    std::vector<std::string> result;
+    std::string current;
+    bool target = true;
+
+    auto flush = [&]() {
+        if (current.empty()) return;
+
+        if (target && current.back() == ':') {
+            // Everything up to the first `target:` is the rule's output
+            target = false;
+        } else if (!target) {
+            result.push_back(current);
+        }
+
+        current.clear();
+    };
+
+    for (size_t i = 0; i < content.size(); ++i) {
+        char c = content[i];
+
+        if (c == '\\' && i + 1 < content.size()) {
+            char next = content[i + 1];
+            if (next == '\n') { ++i; flush(); continue; }
+            if (next == '\r' && i + 2 < content.size() && content[i + 2] == '\n') { i += 2; flush(); continue; }
+            if (next == ' ' || next == '#' || next == '\\') { current += next; ++i; continue; }
+        }
+
+        if (c == '$' && i + 1 < content.size() && content[i + 1] == '$') {
+            current += '$';
+            ++i;
+            continue;
+        }
+
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            flush();
+            continue;
+        }
+
+        current += c;
+    }
+
+    flush();
+    return result;
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "content_hash.hpp"
+#include "stat_batch.hpp"
+#include "token_fingerprint.hpp"
+
+struct BuildStateEntry {
+    uint64_t command_hash = 0;
+
+    // Over every input the output was built from, including headers from the deps log
+    uint64_t inputs_hash = 0;
+};
+
+// What every output was last built from, persisted in the out dir so
+// unchanged actions can be skipped on the next invocation.
+class BuildState {
+public:
+    BuildState(std::filesystem::path path);
+public:
+    bool find(const std::string &output, BuildStateEntry &entry);
+    void record(const std::string &output, BuildStateEntry entry);
+
+    // The output gets rebuilt next time
+    void forget(const std::string &output);
+    bool save();
+private:
+    void load();
+private:
+    std::filesystem::path m_Path;
+    std::unordered_map<std::string, BuildStateEntry> m_Entries;
+    std::mutex m_Mutex;
+};
+
+// How inputs that no action generates are compared with the last build
+enum class SourceCheck {
+    Stamps,
+    Digests,
+    Tokens
+};
+
+// Content digests and token fingerprints of files, memoized by inode, size
+// and mtime so an unchanged file is only stat'ed. Persisted in the out dir
+// next to the build state, so the memo outlives the invocation.
+class DigestTable {
+public:
+    DigestTable(std::filesystem::path path);
+public:
+    // False when the file can't be read
+    bool digest(const std::string &path, ContentHash &digest);
+    bool fingerprint(const std::string &path, TokenFingerprint &fingerprint);
+    bool save();
+
+    // Files are stat'ed through `stats` when set
+    inline void use_stats(const StatCache *stats) { m_Stats = stats; }
+private:
+    enum Known : uint8_t {
+        KNOWN_DIGEST = 1,
+        KNOWN_FINGERPRINT = 2
+    };
+
+    struct Entry {
+        uint64_t inode = 0, size = 0, mtime = 0;
+        uint8_t known = 0;
+        ContentHash digest;
+        TokenFingerprint fingerprint;
+    };
+
+    void load();
+
+    // The memoized entry of `path` with `kind` filled in by `compute` when it isn't known yet
+    template<typename Compute>
+    bool lookup(const std::string &path, Known kind, Entry &entry, Compute compute);
+private:
+    std::filesystem::path m_Path;
+    std::unordered_map<std::string, Entry> m_Entries;
+    const StatCache *m_Stats = nullptr;
+    bool m_Changed = false;
+    std::mutex m_Mutex;
+};
+
+// The source files and subdirs of listed dirs, kept while a dir keeps its
+// inode and mtime. Adding, removing or renaming an entry gives a dir a new
+// mtime, so an unchanged dir is stat'ed instead of read. Persisted in the out
+// dir next to the build state.
+class ListingCache {
+public:
+    ListingCache(std::filesystem::path path);
+public:
+    struct Listing {
+        uint64_t inode = 0, mtime = 0;
+
+        // Entry names, the files are the ones with a wanted extension
+        std::vector<std::string> files, dirs;
+    };
+
+    // False when `dir` changed since it was listed for `filter`
+    bool find(const std::string &dir, const std::string &filter, Listing &listing);
+    void store(const std::string &dir, const std::string &filter, const Listing &listing);
+    bool save();
+private:
+    struct Entry {
+        std::string filter;
+        Listing listing;
+    };
+
+    void load();
+private:
+    std::filesystem::path m_Path;
+    std::unordered_map<std::string, Entry> m_Entries;
+    bool m_Changed = false;
+    std::mutex m_Mutex;
+};
+
+// Hash over the path and current stat data of every input, a missing
+// file hashes differently than any existing one. Stat data prefetched into
+// `stats` is used when it's there.
+uint64_t hash_input_stamps(const std::vector<std::string_view> &inputs, const StatCache *stats = nullptr);
+
+// Inputs in `generated` by content and the rest as `sources` says, so an
+// output that was rebuilt byte-identical leaves the hash of its consumers the
+// same. Token fingerprints include the line and column of every token with
+// `debug_info` or when any of the inputs is line sensitive.
+uint64_t hash_input_contents(
+    const std::vector<std::string_view> &inputs,
+    const std::unordered_set<std::string> &generated,
+    DigestTable &digests,
+    SourceCheck sources,
+    bool debug_info,
+    const StatCache *stats = nullptr
+);
+
+std::vector<std::string> parse_depfile(const std::filesystem::path &path);
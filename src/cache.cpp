@@ -0,0 +1,915 @@
+#include "cache.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.hpp"
+#include "pack_store.hpp"
+
+static std::string hex_key(uint64_t key) {
+    char buffer[17];
+    std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(key));
+    return buffer;
+}
+
+static bool read_file(const std::filesystem::path &path, std::string &content) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) return false;
+
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    content = buffer.str();
+    return true;
+}
+
+// Writes through a temporary file, so concurrent weld processes never see half an entry
+static bool write_file_atomic(const std::filesystem::path &path, const std::string &content) {
+    std::filesystem::create_directories(path.parent_path());
+
+    std::filesystem::path tmp_path = path;
+    tmp_path += ".tmp." + std::to_string(getpid());
+
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) return false;
+        out << content;
+        if (!out) return false;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, path, ec);
+    return !ec;
+}
+
+// Copies what is left of `in` to `out`, in the kernel where it can
+static bool copy_content(int in, int out) {
+    while (true) {
+        ssize_t copied = copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0);
+        if (copied == 0) return true;
+        if (copied < 0 && errno == EINTR) continue;
+        if (copied < 0) break;
+    }
+
+    // Older kernels and some file systems can't, the offsets are still where the copy stopped
+    char buffer[64 * 1024];
+    while (true) {
+        ssize_t size = read(in, buffer, sizeof(buffer));
+        if (size == 0) return true;
+        if (size < 0 && errno == EINTR) continue;
+        if (size < 0) return false;
+
+        for (ssize_t written = 0; written < size; ) {
+            ssize_t result = write(out, buffer + written, size - written);
+            if (result < 0 && errno == EINTR) continue;
+            if (result < 0) return false;
+            written += result;
+        }
+    }
+}
+
+bool clone_file(const std::filesystem::path &from, const std::filesystem::path &to, bool hardlink) {
+    std::error_code ec;
+    std::filesystem::remove(to, ec);
+
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    bool done = out >= 0 && ioctl(out, FICLONE, in) == 0;
+
+    // Both names share one inode then, so writing either in place changes the other
+    if (!done && out >= 0 && hardlink) {
+        close(out);
+        std::filesystem::remove(to, ec);
+
+        done = link(from.c_str(), to.c_str()) == 0;
+        out = done ? -1 : open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    }
+
+    if (!done && out >= 0) done = copy_content(in, out);
+
+    if (out >= 0) close(out);
+    close(in);
+
+    if (!done) std::filesystem::remove(to, ec);
+    return done;
+}
+
+class FileStorage : public CacheStorage {
+public:
+    FileStorage(std::filesystem::path dir, bool hardlinks)
+        : m_Dir(std::move(dir)), m_Hardlinks(hardlinks) {}
+public:
+    bool read(char kind, uint64_t key, std::string &blob) override {
+        return read_file(path(kind, key), blob);
+    }
+
+    bool write(char kind, uint64_t key, const std::string &blob) override {
+        return write_file_atomic(path(kind, key), blob);
+    }
+
+    bool restore(char kind, uint64_t key, const std::filesystem::path &to) override {
+        std::filesystem::path from = path(kind, key);
+        return std::filesystem::exists(from) && clone_file(from, to, m_Hardlinks);
+    }
+
+    bool store(char kind, uint64_t key, const std::filesystem::path &from) override {
+        std::filesystem::path to = path(kind, key);
+        std::filesystem::create_directories(to.parent_path());
+
+        std::filesystem::path tmp_path = to;
+        tmp_path += ".tmp." + std::to_string(getpid());
+
+        std::error_code ec;
+        if (!clone_file(from, tmp_path, m_Hardlinks)) return false;
+
+        // Objects are never written in place, a hardlinked output that is fails instead of changing the cache
+        chmod(tmp_path.c_str(), 0444);
+
+        std::filesystem::rename(tmp_path, to, ec);
+        return !ec;
+    }
+
+    void for_each(const std::function<void(char kind, uint64_t key, uint64_t size, int64_t time)> &callback) override {
+        std::error_code ec;
+
+        for (const char *subdir : { "manifests", "objects" }) {
+            std::filesystem::path root = m_Dir / subdir;
+            if (!std::filesystem::exists(root, ec)) continue;
+
+            for (auto it = std::filesystem::recursive_directory_iterator(root, ec);
+                 it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+                struct stat st;
+                if (stat(it->path().c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+                std::string name = it->path().filename().string();
+                std::string extension = it->path().extension().string();
+                char kind = subdir[0] == 'm' ? 'm' : extension == ".o" ? 'o' : extension == ".stderr" ? 'e' : 0;
+
+                // Leftovers of writers that died, or files that aren't entries at all
+                std::string hex = name.substr(0, name.size() - extension.size());
+                if (kind == 0 || (kind == 'm' && !extension.empty()) || hex.size() != 16) continue;
+
+                callback(kind, std::strtoull(hex.c_str(), nullptr, 16), st.st_size, st.st_mtim.tv_sec);
+            }
+        }
+    }
+
+    void evict(const std::vector<std::pair<char, uint64_t>> &entries) override {
+        std::error_code ec;
+        for (const auto &[kind, key] : entries) std::filesystem::remove(path(kind, key), ec);
+    }
+private:
+    std::filesystem::path path(char kind, uint64_t key) const {
+        std::string hex = hex_key(key);
+        if (kind == 'm') return m_Dir / "manifests" / hex.substr(0, 2) / hex;
+        return m_Dir / "objects" / hex.substr(0, 2) / (hex + (kind == 'o' ? ".o" : ".stderr"));
+    }
+private:
+    std::filesystem::path m_Dir;
+    bool m_Hardlinks;
+};
+
+class PackStorage : public CacheStorage {
+public:
+    PackStorage(std::filesystem::path dir) : m_Packs(std::move(dir)) {}
+public:
+    bool read(char kind, uint64_t key, std::string &blob) override {
+        return m_Packs.get(kind, key, blob);
+    }
+
+    bool write(char kind, uint64_t key, const std::string &blob) override {
+        return m_Packs.put(kind, key, blob);
+    }
+
+    bool restore(char kind, uint64_t key, const std::filesystem::path &to) override {
+        std::string blob;
+        if (!m_Packs.get(kind, key, blob)) return false;
+
+        // Never write through a hardlink left by the files backend
+        std::error_code ec;
+        std::filesystem::remove(to, ec);
+
+        std::ofstream out(to, std::ios::binary | std::ios::trunc);
+        out << blob;
+        return static_cast<bool>(out);
+    }
+
+    bool store(char kind, uint64_t key, const std::filesystem::path &from) override {
+        std::string blob;
+        return read_file(from, blob) && m_Packs.put(kind, key, blob);
+    }
+
+    void for_each(const std::function<void(char kind, uint64_t key, uint64_t size, int64_t time)> &callback) override {
+        m_Packs.for_each([&callback](char kind, uint64_t key, uint64_t size) {
+            callback(kind, key, size, 0);
+        });
+    }
+
+    void evict(const std::vector<std::pair<char, uint64_t>> &entries) override {
+        std::set<std::pair<char, uint64_t>> evicted(entries.begin(), entries.end());
+
+        m_Packs.compact([&evicted](char kind, uint64_t key) {
+            return evicted.count({ kind, key }) == 0;
+        });
+    }
+private:
+    PackStore m_Packs;
+};
+
+std::unique_ptr<CacheStorage> make_cache_storage(const std::filesystem::path &dir, CacheBackend backend, bool hardlinks) {
+    if (backend == CacheBackend::Pack) return std::make_unique<PackStorage>(dir / "packs");
+    return std::make_unique<FileStorage>(dir, hardlinks);
+}
+
+// Appended to the journal for every entry a build used, the latest record of an entry wins
+struct JournalRecord {
+    uint64_t key;
+    int64_t time;
+    char kind;
+    char reserved[7];
+};
+
+// Journaled uses reach the file in batches of this many records
+static constexpr size_t JOURNAL_BATCH = 256;
+
+static int64_t now_seconds() {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static CacheStats read_stats(std::istream &in);
+static void update_stats(const std::filesystem::path &dir, const std::function<void(CacheStats &stats)> &update);
+
+CompileCache::CompileCache(std::filesystem::path dir, CacheBackend backend, CacheLimits limits, bool hardlinks)
+    : m_Dir(std::move(dir)), m_Limits(limits) {
+    std::filesystem::create_directories(m_Dir / "pins");
+    m_Storage = make_cache_storage(m_Dir, backend, hardlinks);
+
+    // Entries used after this are pinned for other processes' collectors
+    std::ofstream(m_Dir / "pins" / std::to_string(getpid())) << now_seconds() << "\n";
+
+    if (!m_Limits.bounded()) return;
+
+    std::ifstream in(m_Dir / "stats");
+    CacheStats stats = read_stats(in);
+
+    bool over = (m_Limits.max_size && stats.size > m_Limits.max_size)
+        || (m_Limits.max_entries && stats.entries > m_Limits.max_entries);
+
+    if (over) {
+        m_Collector = std::thread([this]() {
+            collect_garbage(m_Dir, m_Limits, [this](char kind, uint64_t key) {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                return m_Touched.count({ kind, key }) != 0;
+            });
+        });
+    }
+}
+
+CompileCache::~CompileCache() {
+    if (m_Collector.joinable()) m_Collector.join();
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        flush_journal();
+    }
+
+    flush_stats();
+
+    std::error_code ec;
+    std::filesystem::remove(m_Dir / "pins" / std::to_string(getpid()), ec);
+}
+
+void CompileCache::touch(char kind, uint64_t key) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Touched.insert({ kind, key });
+
+    JournalRecord record = {};
+    record.key = key;
+    record.time = now_seconds();
+    record.kind = kind;
+    m_Journal.append(reinterpret_cast<const char *>(&record), sizeof(record));
+
+    if (m_Journal.size() >= JOURNAL_BATCH * sizeof(JournalRecord)) flush_journal();
+}
+
+// Opens the journal locked, a collector may have swapped it for a compacted one meanwhile
+static int lock_journal(const std::filesystem::path &path) {
+    while (true) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) return -1;
+
+        flock(fd, LOCK_EX);
+
+        struct stat opened, current;
+        if (fstat(fd, &opened) == 0 && stat(path.c_str(), &current) == 0 && opened.st_ino == current.st_ino) return fd;
+
+        close(fd);
+    }
+}
+
+void CompileCache::flush_journal() {
+    if (m_Journal.empty()) return;
+
+    int fd = lock_journal(m_Dir / "journal");
+    if (fd >= 0) {
+        (void)!write(fd, m_Journal.data(), m_Journal.size());
+        close(fd);
+    }
+
+    m_Journal.clear();
+}
+
+std::filesystem::path CompileCache::default_dir() {
+    if (const char *dir = std::getenv("WELD_CACHE_DIR"); dir && *dir) return dir;
+    if (const char *dir = std::getenv("XDG_CACHE_HOME"); dir && *dir) return std::filesystem::path(dir) / "weld";
+    if (const char *home = std::getenv("HOME"); home && *home) return std::filesystem::path(home) / ".cache" / "weld";
+    return std::filesystem::temp_directory_path() / "weld-cache";
+}
+
+void CompileCache::count(uint64_t CacheStats::*counter) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    ++(m_Stats.*counter);
+}
+
+uint64_t CompileCache::compiler_identity(const std::string &path) {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (auto it = m_Compilers.find(path); it != m_Compilers.end()) return it->second;
+    }
+
+    Hasher hasher;
+    hasher.update(path);
+
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+        hasher.update_value(static_cast<int64_t>(st.st_size));
+        hasher.update_value(static_cast<int64_t>(st.st_mtim.tv_sec));
+        hasher.update_value(static_cast<int64_t>(st.st_mtim.tv_nsec));
+    }
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Compilers[path] = hasher.digest();
+}
+
+bool CompileCache::file_digest(const std::string &path, ContentHash &digest) {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (auto it = m_Digests.find(path); it != m_Digests.end()) {
+            digest = it->second.first;
+            return it->second.second;
+        }
+    }
+
+    std::string content;
+    bool cacheable = read_file(path, content);
+
+    // The output of these changes with every compile
+    if (cacheable) {
+        cacheable = content.find("__DATE__") == std::string::npos
+            && content.find("__TIME__") == std::string::npos
+            && content.find("__TIMESTAMP__") == std::string::npos;
+    }
+
+    digest = hash_content(content.data(), content.size());
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Digests[path] = { digest, cacheable };
+    return cacheable;
+}
+
+bool CompileCache::direct_key(const Action &action, uint64_t &key) {
+    if (action.argv.empty() || action.inputs.empty()) return false;
+
+    Hasher hasher;
+    // The probed toolchain when there is one, the compiler's stat data otherwise
+    hasher.update_value(action.toolchain ? action.toolchain : compiler_identity(action.argv[0]));
+    hasher.update_value(toolchain_environment());
+
+    // Maps the checkout dir away, so the object is the same wherever the tree lives
+    std::string prefix_map = "-ffile-prefix-map=" + action.cwd.string() + "=";
+
+    // The object and depfile paths don't change what gets compiled
+    for (size_t i = 1; i < action.argv.size(); ++i) {
+        const std::string &arg = action.argv[i];
+        if ((arg == "-o" || arg == "-MF") && i + 1 < action.argv.size()) {
+            ++i;
+            continue;
+        }
+        if (!action.cwd.empty() && arg.compare(0, prefix_map.size(), prefix_map) == 0) continue;
+        hasher.update(arg);
+    }
+
+    ContentHash source;
+    if (!file_digest(action.inputs.front().string(), source)) return false;
+    hasher.update_value(source);
+
+    key = hasher.digest();
+    return true;
+}
+
+bool CompileCache::result_key(const Action &action, uint64_t direct, const std::vector<std::string> &headers, uint64_t &key) {
+    Hasher hasher;
+    hasher.update_value(direct);
+
+    for (const auto &header : headers) {
+        ContentHash digest;
+        if (!file_digest(resolve_path(action, header).string(), digest)) return false;
+
+        hasher.update(header);
+        hasher.update_value(digest);
+    }
+
+    key = hasher.digest();
+    return true;
+}
+
+static std::vector<std::string> parse_manifest(const std::string &manifest) {
+    std::vector<std::string> headers;
+    std::istringstream lines(manifest);
+
+    for (std::string line; std::getline(lines, line); ) {
+        if (!line.empty()) headers.push_back(line);
+    }
+
+    return headers;
+}
+
+// Remote entries bundle the diagnostics and the object in one blob
+static constexpr char BUNDLE_MAGIC[8] = { 'W', 'E', 'L', 'D', 'O', 'B', 'J', '1' };
+
+static std::string pack_bundle(const std::string &diagnostics, const std::string &object) {
+    std::string bundle(BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC));
+    uint64_t size = diagnostics.size();
+    bundle.append(reinterpret_cast<const char *>(&size), sizeof(size));
+    bundle += diagnostics;
+    bundle += object;
+    return bundle;
+}
+
+static bool unpack_bundle(const std::string &bundle, std::string &diagnostics, std::string &object) {
+    size_t header = sizeof(BUNDLE_MAGIC) + sizeof(uint64_t);
+    if (bundle.size() < header || bundle.compare(0, sizeof(BUNDLE_MAGIC), BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) != 0) {
+        return false;
+    }
+
+    uint64_t size;
+    std::memcpy(&size, bundle.data() + sizeof(BUNDLE_MAGIC), sizeof(size));
+    if (bundle.size() - header < size) return false;
+
+    diagnostics = bundle.substr(header, size);
+    object = bundle.substr(header + size);
+    return true;
+}
+
+bool CompileCache::archive_key(const Action &action, uint64_t &key) {
+    if (action.argv.empty()) return false;
+
+    Hasher hasher;
+    hasher.update("archive");
+    hasher.update_value(action.toolchain ? action.toolchain : compiler_identity(action.argv[0]));
+    hasher.update_value(toolchain_environment());
+
+    for (size_t i = 1; i < action.argv.size(); ++i) hasher.update(action.argv[i]);
+
+    // Members are fresh objects of this build, they are hashed as they are now
+    for (const auto &input : action.inputs) {
+        ContentHash digest;
+        if (!hash_file(input.string(), digest)) return false;
+        hasher.update_value(digest);
+    }
+
+    key = hasher.digest();
+    return true;
+}
+
+bool CompileCache::restore_output(const Action &action, uint64_t result, CacheHit &hit) {
+    if (!m_Storage->restore('o', result, action.outputs.front())) return false;
+
+    m_Storage->read('e', result, hit.diagnostics);
+    touch('o', result);
+    touch('e', result);
+    return true;
+}
+
+bool CompileCache::restore(const Action &action, uint64_t direct, const std::string &manifest, CacheHit &hit) {
+    uint64_t result;
+    std::vector<std::string> headers = parse_manifest(manifest);
+
+    if (!result_key(action, direct, headers, result)) return false;
+    if (!restore_output(action, result, hit)) return false;
+
+    touch('m', direct);
+    hit.inputs = std::move(headers);
+    return true;
+}
+
+bool CompileCache::download_output(uint64_t result) {
+    std::string bundle, diagnostics, object;
+
+    if (!m_Remote->get("o", hex_key(result), bundle) || !unpack_bundle(bundle, diagnostics, object)) {
+        return false;
+    }
+
+    return m_Storage->write('o', result, object) && m_Storage->write('e', result, diagnostics);
+}
+
+bool CompileCache::download(const Action &action, uint64_t direct, std::string &manifest) {
+    uint64_t result;
+
+    return m_Remote->get("m", hex_key(direct), manifest)
+        && result_key(action, direct, parse_manifest(manifest), result)
+        && download_output(result)
+        && m_Storage->write('m', direct, manifest);
+}
+
+bool CompileCache::lookup(const Action &action, CacheHit &hit) {
+    bool remote = m_Remote && m_Remote->valid();
+
+    // Archives have no headers, the key is their final one
+    if (action.kind == ActionKind::Archive) {
+        uint64_t result;
+        if (archive_key(action, result)) {
+            if (restore_output(action, result, hit)) {
+                count(&CacheStats::hits);
+                return true;
+            }
+
+            if (remote && download_output(result) && restore_output(action, result, hit)) {
+                count(&CacheStats::hits);
+                count(&CacheStats::remote_hits);
+                return true;
+            }
+        }
+
+        count(&CacheStats::misses);
+        return false;
+    }
+
+    uint64_t direct;
+    std::string manifest;
+
+    if (!direct_key(action, direct)) {
+        count(&CacheStats::misses);
+        return false;
+    }
+
+    if (m_Storage->read('m', direct, manifest) && restore(action, direct, manifest, hit)) {
+        count(&CacheStats::hits);
+        return true;
+    }
+
+    if (remote && download(action, direct, manifest) && restore(action, direct, manifest, hit)) {
+        count(&CacheStats::hits);
+        count(&CacheStats::remote_hits);
+        return true;
+    }
+
+    count(&CacheStats::misses);
+    return false;
+}
+
+bool CompileCache::store_output(const Action &action, uint64_t result, const std::string &diagnostics,
+                                std::vector<RemoteBlob> &uploads) {
+    if (!m_Storage->store('o', result, action.outputs.front())) return false;
+    m_Storage->write('e', result, diagnostics);
+
+    touch('o', result);
+    touch('e', result);
+
+    {
+        std::error_code ec;
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        ++m_Stats.stores;
+        ++m_Stats.entries;
+        m_Stats.size += std::filesystem::file_size(action.outputs.front(), ec) + diagnostics.size();
+    }
+
+    if (m_Remote && m_Remote->writable()) {
+        std::string content;
+        if (read_file(action.outputs.front(), content)) {
+            uploads.push_back({ "o", hex_key(result), pack_bundle(diagnostics, content) });
+        }
+    }
+
+    return true;
+}
+
+void CompileCache::store(const Action &action, const std::string &diagnostics, const std::vector<std::string> &inputs) {
+    std::vector<RemoteBlob> uploads;
+
+    if (action.kind == ActionKind::Archive) {
+        uint64_t result;
+        if (archive_key(action, result) && store_output(action, result, diagnostics, uploads) && !uploads.empty()) {
+            m_Remote->put_async(std::move(uploads));
+        }
+        return;
+    }
+
+    uint64_t direct, result;
+    if (!direct_key(action, direct) || !result_key(action, direct, inputs, result)) return;
+
+    // The manifest goes last, so a lookup never finds it without the object
+    if (!store_output(action, result, diagnostics, uploads)) return;
+
+    std::string manifest;
+    for (const auto &input : inputs) manifest += input + "\n";
+    m_Storage->write('m', direct, manifest);
+    touch('m', direct);
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Stats.size += manifest.size();
+    }
+
+    // Same order remotely, the manifest is only put once the object is uploaded
+    if (!uploads.empty()) {
+        uploads.push_back({ "m", hex_key(direct), manifest });
+        m_Remote->put_async(std::move(uploads));
+    }
+}
+
+static CacheStats read_stats(std::istream &in) {
+    CacheStats stats;
+    std::string name;
+    uint64_t value;
+
+    while (in >> name >> value) {
+        if (name == "hits") stats.hits = value;
+        else if (name == "misses") stats.misses = value;
+        else if (name == "stores") stats.stores = value;
+        else if (name == "remote_hits") stats.remote_hits = value;
+        else if (name == "size") stats.size = value;
+        else if (name == "entries") stats.entries = value;
+    }
+
+    return stats;
+}
+
+static void update_stats(const std::filesystem::path &dir, const std::function<void(CacheStats &stats)> &update) {
+    std::filesystem::path path = dir / "stats";
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+
+    // Several weld processes may share the cache
+    flock(fd, LOCK_EX);
+
+    std::string content;
+    read_file(path, content);
+    std::istringstream in(content);
+    CacheStats stats = read_stats(in);
+
+    update(stats);
+
+    std::string out = "hits " + std::to_string(stats.hits) + "\n"
+        + "misses " + std::to_string(stats.misses) + "\n"
+        + "stores " + std::to_string(stats.stores) + "\n"
+        + "remote_hits " + std::to_string(stats.remote_hits) + "\n"
+        + "size " + std::to_string(stats.size) + "\n"
+        + "entries " + std::to_string(stats.entries) + "\n";
+
+    if (ftruncate(fd, 0) == 0) {
+        (void)!pwrite(fd, out.data(), out.size(), 0);
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+void CompileCache::flush_stats() {
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    if (m_Stats.hits == 0 && m_Stats.misses == 0 && m_Stats.stores == 0) return;
+
+    update_stats(m_Dir, [this](CacheStats &stats) {
+        stats.hits += m_Stats.hits;
+        stats.misses += m_Stats.misses;
+        stats.stores += m_Stats.stores;
+        stats.remote_hits += m_Stats.remote_hits;
+        stats.size += m_Stats.size;
+        stats.entries += m_Stats.entries;
+    });
+
+    m_Stats = {};
+}
+
+void CompileCache::print_stats(const std::filesystem::path &dir) {
+    std::ifstream in(dir / "stats");
+    CacheStats stats = read_stats(in);
+
+    uint64_t entries = 0, size = 0;
+    std::error_code ec;
+
+    if (std::filesystem::exists(dir)) {
+        for (auto it = std::filesystem::recursive_directory_iterator(dir, ec);
+             it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            if (!it->is_regular_file(ec)) continue;
+
+            size += it->file_size(ec);
+            if (it->path().extension() == ".o") ++entries;
+        }
+    }
+
+    PackStats packs;
+    if (std::filesystem::exists(dir / "packs" / "index")) {
+        PackStore store(dir / "packs");
+        store.for_each([&entries](char kind, uint64_t, uint64_t) {
+            if (kind == 'o') ++entries;
+        });
+        packs = store.stats();
+    }
+
+    uint64_t lookups = stats.hits + stats.misses;
+    double rate = lookups ? 100.0 * stats.hits / lookups : 0.0;
+
+    std::printf("cache directory  %s\n", dir.c_str());
+    std::printf("hits             %llu\n", static_cast<unsigned long long>(stats.hits));
+    std::printf("misses           %llu\n", static_cast<unsigned long long>(stats.misses));
+    std::printf("hit rate         %.1f %%\n", rate);
+    std::printf("remote hits      %llu\n", static_cast<unsigned long long>(stats.remote_hits));
+    std::printf("stores           %llu\n", static_cast<unsigned long long>(stats.stores));
+    std::printf("entries          %llu\n", static_cast<unsigned long long>(entries));
+    std::printf("size             %.1f MB\n", size / (1024.0 * 1024.0));
+
+    if (packs.total_bytes > 0) {
+        std::printf("packed           %.1f MB live of %.1f MB\n", packs.live_bytes / (1024.0 * 1024.0), packs.total_bytes / (1024.0 * 1024.0));
+    }
+}
+
+struct EntryHash {
+    size_t operator()(const std::pair<char, uint64_t> &entry) const {
+        return entry.second ^ (static_cast<uint8_t>(entry.first) * 0x9e3779b97f4a7c15ull);
+    }
+};
+
+// The start of the oldest build still using the cache, pins of dead processes are removed
+static int64_t oldest_pin(const std::filesystem::path &dir) {
+    int64_t oldest = std::numeric_limits<int64_t>::max();
+    std::error_code ec;
+
+    for (auto &entry : std::filesystem::directory_iterator(dir / "pins", ec)) {
+        pid_t pid = std::atoi(entry.path().filename().c_str());
+
+        if (pid <= 0 || (kill(pid, 0) != 0 && errno == ESRCH)) {
+            std::filesystem::remove(entry.path(), ec);
+            continue;
+        }
+
+        int64_t start = 0;
+        std::ifstream(entry.path()) >> start;
+        oldest = std::min(oldest, start);
+    }
+
+    return oldest;
+}
+
+static void read_journal(const std::string &journal, std::unordered_map<std::pair<char, uint64_t>, int64_t, EntryHash> &used) {
+    for (size_t offset = 0; offset + sizeof(JournalRecord) <= journal.size(); offset += sizeof(JournalRecord)) {
+        JournalRecord record;
+        std::memcpy(&record, journal.data() + offset, sizeof(record));
+
+        int64_t &time = used[{ record.kind, record.key }];
+        time = std::max(time, record.time);
+    }
+}
+
+GarbageStats CompileCache::collect_garbage(const std::filesystem::path &dir, const CacheLimits &limits,
+                                           const std::function<bool(char kind, uint64_t key)> &pinned) {
+    GarbageStats result;
+
+    // One collector at a time, a second one would only find the same entries
+    int lock = open((dir / "gc.lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock < 0 || flock(lock, LOCK_EX | LOCK_NB) != 0) {
+        if (lock >= 0) close(lock);
+        return result;
+    }
+
+    int64_t pinned_since = std::min(now_seconds(), oldest_pin(dir));
+
+    std::unordered_map<std::pair<char, uint64_t>, int64_t, EntryHash> used;
+    std::string journal;
+    read_file(dir / "journal", journal);
+    read_journal(journal, used);
+
+    struct Entry {
+        CacheStorage *storage;
+        char kind;
+        uint64_t key, size;
+        int64_t time;
+    };
+
+    std::vector<std::unique_ptr<CacheStorage>> storages;
+    storages.push_back(make_cache_storage(dir, CacheBackend::Files));
+    if (std::filesystem::exists(dir / "packs" / "index")) {
+        storages.push_back(make_cache_storage(dir, CacheBackend::Pack));
+    }
+
+    std::vector<Entry> entries;
+    for (auto &storage : storages) {
+        storage->for_each([&](char kind, uint64_t key, uint64_t size, int64_t time) {
+            if (auto it = used.find({ kind, key }); it != used.end()) time = std::max(time, it->second);
+
+            entries.push_back({ storage.get(), kind, key, size, time });
+            result.size += size;
+            if (kind == 'o') ++result.entries;
+        });
+    }
+
+    bool over_limit = (limits.max_size && result.size > limits.max_size)
+        || (limits.max_entries && result.entries > limits.max_entries);
+
+    // Going a bit below the limits keeps the next builds from collecting again right away
+    auto over_target = [&]() {
+        return (limits.max_size && result.size > limits.max_size - limits.max_size / 10)
+            || (limits.max_entries && result.entries > limits.max_entries - limits.max_entries / 10);
+    };
+
+    std::unordered_map<CacheStorage *, std::vector<std::pair<char, uint64_t>>> evicted;
+    std::unordered_map<std::pair<char, uint64_t>, bool, EntryHash> removed;
+
+    auto evict = [&](const Entry &entry) {
+        evicted[entry.storage].push_back({ entry.kind, entry.key });
+        removed[{ entry.kind, entry.key }] = true;
+
+        result.size -= entry.size;
+        result.freed += entry.size;
+        ++result.removed;
+        if (entry.kind == 'o') --result.entries;
+    };
+
+    if (over_limit) {
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.time < b.time; });
+
+        // Diagnostics go together with their object
+        std::unordered_map<uint64_t, const Entry *> diagnostics;
+        std::unordered_map<uint64_t, bool> objects;
+        for (const auto &entry : entries) {
+            if (entry.kind == 'e') diagnostics[entry.key] = &entry;
+            if (entry.kind == 'o') objects[entry.key] = true;
+        }
+
+        for (const auto &entry : entries) {
+            if (!over_target()) break;
+            if (entry.kind == 'e' && objects.count(entry.key)) continue;
+            if (entry.time >= pinned_since || (pinned && pinned(entry.kind, entry.key))) continue;
+
+            evict(entry);
+
+            if (auto it = diagnostics.find(entry.key); entry.kind == 'o' && it != diagnostics.end()) {
+                evict(*it->second);
+            }
+        }
+    }
+
+    for (auto &[storage, keys] : evicted) storage->evict(keys);
+
+    // Keeps one record per remaining entry, including the ones builds appended meanwhile
+    int fd = lock_journal(dir / "journal");
+    if (fd >= 0) {
+        journal.clear();
+        read_file(dir / "journal", journal);
+        read_journal(journal, used);
+
+        std::unordered_map<std::pair<char, uint64_t>, bool, EntryHash> present;
+        for (const auto &entry : entries) present[{ entry.kind, entry.key }] = true;
+
+        // Entries stored after the scan above are only known by their records
+        std::string compacted;
+        for (const auto &[entry, time] : used) {
+            if (removed.count(entry) || (!present.count(entry) && time < pinned_since)) continue;
+
+            JournalRecord record = {};
+            record.key = entry.second;
+            record.time = time;
+            record.kind = entry.first;
+            compacted.append(reinterpret_cast<const char *>(&record), sizeof(record));
+        }
+
+        write_file_atomic(dir / "journal", compacted);
+        close(fd);
+    }
+
+    update_stats(dir, [&result](CacheStats &stats) {
+        stats.size = result.size;
+        stats.entries = result.entries;
+    });
+
+    close(lock);
+    return result;
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "content_hash.hpp"
+#include "graph.hpp"
+#include "remote_cache.hpp"
+
+struct CacheStats {
+    uint64_t hits = 0, misses = 0, stores = 0;
+
+    // Hits that had to be downloaded from the remote cache first
+    uint64_t remote_hits = 0;
+
+    // Grow with every store and are set to the real values by the garbage collector
+    uint64_t size = 0, entries = 0;
+};
+
+// Budgets of a cache dir, 0 leaves it unbounded
+struct CacheLimits {
+    uint64_t max_size = 0, max_entries = 0;
+
+    inline bool bounded() const { return max_size != 0 || max_entries != 0; }
+};
+
+struct GarbageStats {
+    uint64_t removed = 0, freed = 0;
+    uint64_t size = 0, entries = 0;
+};
+
+enum class CacheBackend {
+    // One file per entry, objects are restored as reflinks or copies
+    Files,
+    // Compressed blobs in a few segment files, see pack_store.hpp
+    Pack
+};
+
+// Where the entries of a CompileCache live, `kind` is 'm' for manifests, 'o' for objects and 'e' for diagnostics
+class CacheStorage {
+public:
+    virtual ~CacheStorage() = default;
+public:
+    virtual bool read(char kind, uint64_t key, std::string &blob) = 0;
+    virtual bool write(char kind, uint64_t key, const std::string &blob) = 0;
+
+    // Objects go straight between the storage and the build tree
+    virtual bool restore(char kind, uint64_t key, const std::filesystem::path &to) = 0;
+    virtual bool store(char kind, uint64_t key, const std::filesystem::path &from) = 0;
+
+    // `time` is when the entry was written, or 0 when the storage doesn't keep it
+    virtual void for_each(const std::function<void(char kind, uint64_t key, uint64_t size, int64_t time)> &callback) = 0;
+    virtual void evict(const std::vector<std::pair<char, uint64_t>> &entries) = 0;
+};
+
+// With `hardlinks`, objects the files backend can't reflink are hardlinked instead of copied
+std::unique_ptr<CacheStorage> make_cache_storage(const std::filesystem::path &dir, CacheBackend backend, bool hardlinks = false);
+
+struct CacheHit {
+    // The compiler output of the cached compile and the inputs from its manifest
+    std::string diagnostics;
+    std::vector<std::string> inputs;
+};
+
+// Content-addressed cache of compile results, shared by every project on
+// the machine. Lookups work in direct mode: the key covers the compiler,
+// the command line and the source, and points at a manifest listing the
+// headers of the last compile. The object is stored under the hash of
+// that key and the content of every header. Archives are keyed directly on
+// `ar`, its command line and the content of every member. Links aren't
+// cached, they read system libraries and startup files no key covers.
+//
+// Layout of the cache dir:
+//   manifests/<xx>/<key>      one header path per line
+//   objects/<xx>/<key>.o      the object or archive
+//   objects/<xx>/<key>.stderr the diagnostics of the compile
+//   packs/                    all of the above with the pack backend
+//   stats                     hit, miss and store counters
+//   journal                   when entries were last used, see collect_garbage
+//   pins/<pid>                start time of every build using the cache
+//
+// Lookups and stores may run on several threads at once. With a remote
+// cache attached, local misses are looked up remotely under the same keys
+// and downloaded entries are added to the local cache.
+//
+// Hits and stores are appended to the journal in batches. When the
+// limits are exceeded at the start of a build, the least recently used
+// entries are evicted on a background thread while the build runs.
+class CompileCache {
+public:
+    CompileCache(std::filesystem::path dir, CacheBackend backend = CacheBackend::Files, CacheLimits limits = {},
+                 bool hardlinks = false);
+    ~CompileCache();
+public:
+    inline void use_remote(RemoteCache *remote) { m_Remote = remote; }
+
+    // Restores the object or archive of `action` when the cache has it
+    bool lookup(const Action &action, CacheHit &hit);
+    void store(const Action &action, const std::string &diagnostics, const std::vector<std::string> &inputs);
+
+    // Adds the counters of this invocation to the persisted ones
+    void flush_stats();
+
+    static std::filesystem::path default_dir();
+    static void print_stats(const std::filesystem::path &dir);
+
+    // Evicts the least recently used entries until the cache is below 90% of
+    // `limits`. Entries `pinned` returns true for and entries used since the
+    // oldest running build started are kept.
+    static GarbageStats collect_garbage(const std::filesystem::path &dir, const CacheLimits &limits,
+                                        const std::function<bool(char kind, uint64_t key)> &pinned = nullptr);
+private:
+    bool direct_key(const Action &action, uint64_t &key);
+    bool result_key(const Action &action, uint64_t direct, const std::vector<std::string> &headers, uint64_t &key);
+    bool archive_key(const Action &action, uint64_t &key);
+    bool file_digest(const std::string &path, ContentHash &digest);
+    uint64_t compiler_identity(const std::string &path);
+
+    bool restore_output(const Action &action, uint64_t result, CacheHit &hit);
+    bool restore(const Action &action, uint64_t direct, const std::string &manifest, CacheHit &hit);
+    bool download_output(uint64_t result);
+    bool download(const Action &action, uint64_t direct, std::string &manifest);
+    bool store_output(const Action &action, uint64_t result, const std::string &diagnostics,
+                      std::vector<RemoteBlob> &uploads);
+    void count(uint64_t CacheStats::*counter);
+    void touch(char kind, uint64_t key);
+    void flush_journal();
+private:
+    std::filesystem::path m_Dir;
+    std::unique_ptr<CacheStorage> m_Storage;
+    CacheLimits m_Limits;
+    std::thread m_Collector;
+    RemoteCache *m_Remote = nullptr;
+
+    std::mutex m_Mutex;
+    CacheStats m_Stats;
+
+    // Used by this build, so the collector leaves them alone
+    std::set<std::pair<char, uint64_t>> m_Touched;
+    std::string m_Journal;
+
+    // Headers are shared by many TUs, so each file is only hashed once per build
+    std::unordered_map<std::string, std::pair<ContentHash, bool>> m_Digests;
+    std::unordered_map<std::string, uint64_t> m_Compilers;
+};
+
+// Puts a copy of `from` at `to`, as a reflink when the filesystem allows it.
+// With `hardlink`, a hardlink is tried before copying, which shares the inode.
+bool clone_file(const std::filesystem::path &from, const std::filesystem::path &to, bool hardlink = false);
@@ -0,0 +1,75 @@
+#include "cache_server.hpp"
+
+#include <cctype>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include "http.hpp"
+
+// Only `/<kind>/<hex digest>` is served, so requests can't escape the directory
+static bool blob_path(const std::filesystem::path &dir, const std::string &path, std::filesystem::path &file) {
+    if (path.size() < 4 || path[0] != '/') return false;
+
+    size_t slash = path.find('/', 1);
+    if (slash == std::string::npos) return false;
+
+    std::string kind = path.substr(1, slash - 1);
+    std::string digest = path.substr(slash + 1);
+
+    if (kind.empty() || digest.size() < 2) return false;
+    for (char c : kind) if (!std::islower(static_cast<unsigned char>(c))) return false;
+    for (char c : digest) if (!std::isxdigit(static_cast<unsigned char>(c))) return false;
+
+    file = dir / kind / digest.substr(0, 2) / digest;
+    return true;
+}
+
+static void handle_request(const std::filesystem::path &dir, const HttpRequest &request, HttpResponse &response) {
+    std::filesystem::path file;
+
+    if (!blob_path(dir, request.path, file)) {
+        response.status = 400;
+    } else if (request.method == "GET") {
+        std::ifstream in(file, std::ios::binary);
+
+        if (in.is_open()) {
+            std::stringstream content;
+            content << in.rdbuf();
+            response.status = 200;
+            response.body = content.str();
+        } else {
+            response.status = 404;
+        }
+    } else if (request.method == "PUT") {
+        std::error_code ec;
+        std::filesystem::create_directories(file.parent_path(), ec);
+
+        std::filesystem::path tmp_file = file;
+        tmp_file += ".tmp." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+        {
+            std::ofstream out(tmp_file, std::ios::binary | std::ios::trunc);
+            out << request.body;
+        }
+
+        std::filesystem::rename(tmp_file, file, ec);
+        response.status = ec ? 500 : 201;
+    } else {
+        response.status = 405;
+    }
+}
+
+int run_cache_server(const std::filesystem::path &dir, const std::string &host, const std::string &port) {
+    std::filesystem::create_directories(dir);
+
+    int server = http_listen(host, port);
+    if (server < 0) return 1;
+
+    std::cout << "Serving ---> " << dir.string() << " on http://" << host << ":" << port << std::endl;
+
+    http_serve(server, std::thread::hardware_concurrency(), [&dir](const HttpRequest &request, HttpResponse &response) {
+        handle_request(dir, request, response);
+    });
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+
+// Serves `dir` as a remote cache (see remote_cache.hpp) until weld is killed
+int run_cache_server(const std::filesystem::path &dir, const std::string &host, const std::string &port);
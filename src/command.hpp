@@ -1,48 +1,31 @@
 #pragma once
 
 #include <string>
-#include <sstream>
 #include <vector>
 #include <filesystem>
+#include <type_traits>
+
+#include "process.hpp"
 
 class Commands {
 public:
     template<typename ...Args>
-    static inline void run(Args && ...args) {
-        std::string commands = join_args(std::forward<Args>(args)...);
-        std::system(commands.c_str());
+    static inline int run(Args && ...args) {
+        std::vector<std::string> argv;
+        (append_arg(argv, std::forward<Args>(args)), ...);
+        return Process::run(argv);
     }
 private:
-    template <typename Iterator>
-    static std::string join_range(Iterator begin, Iterator end) {
-        std::ostringstream oss;
-        for (Iterator it = begin; it != end; ++it) {
-            if (it != begin) oss << " ";
-            oss << *it;
+    template <typename Arg>
+    static void append_arg(std::vector<std::string> &argv, Arg &&arg) {
+        if constexpr (std::is_same_v<std::decay_t<Arg>, std::vector<std::string>>) {
+            argv.insert(argv.end(), arg.begin(), arg.end());
+        } else if constexpr (std::is_same_v<std::decay_t<Arg>, std::vector<std::filesystem::path>>) {
+            for (const auto &path : arg) argv.push_back(path.string());
+        } else if constexpr (std::is_same_v<std::decay_t<Arg>, std::filesystem::path>) {
+            argv.push_back(arg.string());
+        } else {
+            argv.emplace_back(std::forward<Arg>(arg));
         }
-        return oss.str();
-    }
-    
-    template <typename... Args>
-    static std::string join_args(Args&&... args) {
-        std::ostringstream oss;
-        bool first = true;
-    
-        (void)std::initializer_list<int>{(
-            [&]() {
-                if constexpr (std::is_same_v<std::decay_t<Args>, std::vector<std::string>>) {
-                    if (!first) oss << " ";
-                    oss << join_range(args.begin(), args.end());
-                } else if constexpr (std::is_same_v<std::decay_t<Args>, std::vector<std::filesystem::path>>) {
-                    if (!first) oss << " ";
-                    oss << join_range(args.begin(), args.end());
-                } else {
-                    if (!first) oss << " ";
-                    oss << std::forward<Args>(args);
-                }
-                first = false;
-            }(), 0)...};
-    
-        return oss.str();
     }
-};
\ No newline at end of file
+};
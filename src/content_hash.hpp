@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct ContentHash {
+    uint64_t low = 0, high = 0;
+
+    inline bool operator==(const ContentHash &other) const { return low == other.low && high == other.high; }
+    inline bool operator!=(const ContentHash &other) const { return !(*this == other); }
+};
+
+// A 128-bit non-cryptographic hash for file contents, in the style of
+// XXH3: eight 64-bit lanes take 64 byte stripes with a 32x32 multiply
+// each, and get scrambled every 1 KiB. The lanes run on AVX2 or NEON when
+// the CPU has them, picked at runtime, and every path gives the same
+// digest, so cache keys match across machines.
+//
+// Inputs past 4 MiB are hashed as a list of 4 MiB chunk digests, which is
+// what lets large files be hashed in parallel without changing the result.
+ContentHash hash_content(const void *data, size_t size);
+
+// Large files are mapped instead of read, and huge ones are hashed in
+// chunks on a thread pool. False when the file can't be read.
+bool hash_file(const std::string &path, ContentHash &hash);
+
+// The kernel the hash runs on, "avx2", "neon" or "scalar"
+const char *hash_content_kernel();
+
+// The kernels this build can run on this CPU, the one picked by default first
+std::vector<std::string> hash_content_kernels();
+
+// Switches every following hash to the kernel `name`, for benchmarks. Not safe
+// while other threads hash, false when the kernel isn't available.
+bool use_hash_content_kernel(const std::string &name);
@@ -9,16 +9,15 @@
 
 class Dependencies {
 public:
-    void read(std::string path) {
-        auto config = toml::parse(path + "/weld.toml");
-        
+    // Takes the manifest the reader parsed already
+    void read(const toml::value &config) {
         if (config.contains("dependencies")) {
-            auto dependencies = config["dependencies"].as_table();
+            const auto &dependencies = config.at("dependencies").as_table();
             
-            for (auto &[key, value] : dependencies) {
-                if (value.is_table()) {;
+            for (const auto &[key, value] : dependencies) {
+                if (value.is_table()) {
                     if (value.contains("path")) {
-                        auto path = value.at("path");
+                        const auto &path = value.at("path");
                         
                         bool include = false;
                         if (value.contains("include")) {
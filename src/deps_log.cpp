@@ -0,0 +1,285 @@
+#include "deps_log.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr char DEPS_MAGIC[8] = { 'W', 'E', 'L', 'D', 'D', 'E', 'P', 'S' };
+static constexpr uint32_t DEPS_VERSION = 1;
+static constexpr size_t DEPS_HEADER_SIZE = sizeof(DEPS_MAGIC) + sizeof(uint32_t);
+static constexpr uint32_t DEPS_RECORD_FLAG = 0x80000000u;
+
+// Rewrite the log on load once it is mostly made of replaced records
+static constexpr size_t DEPS_MIN_DEAD_FOR_RECOMPACT = 1000;
+static constexpr size_t DEPS_DEAD_RATIO_FOR_RECOMPACT = 3;
+
+static void append_u32(std::string &buffer, uint32_t value) {
+    buffer.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void append_path_record(std::string &buffer, std::string_view path, uint32_t id) {
+    size_t padding = (4 - path.size() % 4) % 4;
+    append_u32(buffer, static_cast<uint32_t>(path.size() + padding + sizeof(uint32_t)));
+    buffer.append(path);
+    buffer.append(padding, '\0');
+    append_u32(buffer, ~id);
+}
+
+static void append_deps_record(std::string &buffer, uint32_t output, const uint32_t *ids, uint32_t count) {
+    append_u32(buffer, DEPS_RECORD_FLAG | static_cast<uint32_t>((count + 1) * sizeof(uint32_t)));
+    append_u32(buffer, output);
+    buffer.append(reinterpret_cast<const char *>(ids), count * sizeof(uint32_t));
+}
+
+static std::string deps_header() {
+    std::string header(DEPS_MAGIC, sizeof(DEPS_MAGIC));
+    append_u32(header, DEPS_VERSION);
+    return header;
+}
+
+DepsLog::DepsLog(std::filesystem::path path)
+    : m_Path(std::move(path)) {
+    load();
+
+    size_t live = 0;
+    for (const auto &deps : m_Deps) live += deps.valid;
+
+    if (m_DeadRecords > DEPS_MIN_DEAD_FOR_RECOMPACT
+        && m_DeadRecords > live * DEPS_DEAD_RATIO_FOR_RECOMPACT) {
+        recompact();
+    }
+
+    open_for_append();
+}
+
+DepsLog::~DepsLog() {
+    if (m_Fd >= 0) close(m_Fd);
+    if (m_Map) munmap(m_Map, m_MapSize);
+}
+
+void DepsLog::load() {
+    int fd = open(m_Path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < DEPS_HEADER_SIZE) {
+        close(fd);
+        std::filesystem::remove(m_Path);
+        return;
+    }
+
+    m_MapSize = st.st_size;
+    m_Map = mmap(nullptr, m_MapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (m_Map == MAP_FAILED) {
+        m_Map = nullptr;
+        m_MapSize = 0;
+        return;
+    }
+
+    const char *data = static_cast<const char *>(m_Map);
+    uint32_t version;
+    std::memcpy(&version, data + sizeof(DEPS_MAGIC), sizeof(version));
+
+    if (std::memcmp(data, DEPS_MAGIC, sizeof(DEPS_MAGIC)) != 0 || version != DEPS_VERSION) {
+        // Written by another weld version, start over
+        munmap(m_Map, m_MapSize);
+        m_Map = nullptr;
+        m_MapSize = 0;
+        std::filesystem::remove(m_Path);
+        return;
+    }
+
+    size_t offset = DEPS_HEADER_SIZE;
+
+    while (offset + sizeof(uint32_t) <= m_MapSize) {
+        uint32_t header;
+        std::memcpy(&header, data + offset, sizeof(header));
+
+        bool is_deps = header & DEPS_RECORD_FLAG;
+        size_t size = header & ~DEPS_RECORD_FLAG;
+        const char *payload = data + offset + sizeof(uint32_t);
+
+        if (size < sizeof(uint32_t) || size % 4 != 0 || offset + sizeof(uint32_t) + size > m_MapSize) break;
+
+        // The header and every record are 4 byte aligned, so the ids can be read in place
+        const uint32_t *words = reinterpret_cast<const uint32_t *>(payload);
+
+        if (is_deps) {
+            uint32_t output = words[0];
+            uint32_t count = static_cast<uint32_t>(size / sizeof(uint32_t) - 1);
+
+            bool valid = output < m_Paths.size();
+            for (uint32_t i = 0; valid && i < count; ++i) {
+                valid = words[i + 1] < m_Paths.size();
+            }
+            if (!valid) break;
+
+            if (m_Deps.size() <= output) m_Deps.resize(output + 1);
+            if (m_Deps[output].valid) ++m_DeadRecords;
+            m_Deps[output] = { words + 1, count, true };
+        } else {
+            uint32_t id = static_cast<uint32_t>(m_Paths.size());
+            if (~words[size / sizeof(uint32_t) - 1] != id) break;
+
+            size_t length = size - sizeof(uint32_t);
+            while (length > 0 && payload[length - 1] == '\0') --length;
+
+            std::string_view path(payload, length);
+            m_Paths.push_back(path);
+            m_Ids[path] = id;
+        }
+
+        offset += sizeof(uint32_t) + size;
+    }
+
+    if (offset < m_MapSize) {
+        // A build was interrupted mid-write, drop the partial record
+        std::cerr << "warning: truncating damaged deps log " << m_Path.string() << std::endl;
+        if (truncate(m_Path.c_str(), offset) != 0) {
+            std::cerr << "error: failed to truncate " << m_Path.string() << std::endl;
+        }
+    }
+}
+
+void DepsLog::recompact() {
+    std::string buffer = deps_header();
+    std::vector<int64_t> remap(m_Paths.size(), -1);
+    uint32_t next = 0;
+
+    auto emit_path = [&](uint32_t id) {
+        if (remap[id] < 0) {
+            remap[id] = next;
+            append_path_record(buffer, m_Paths[id], next++);
+        }
+        return static_cast<uint32_t>(remap[id]);
+    };
+
+    std::vector<uint32_t> ids;
+    for (uint32_t output = 0; output < m_Deps.size(); ++output) {
+        const Deps &deps = m_Deps[output];
+        if (!deps.valid) continue;
+
+        ids.clear();
+        for (uint32_t i = 0; i < deps.count; ++i) ids.push_back(emit_path(deps.ids[i]));
+        append_deps_record(buffer, emit_path(output), ids.data(), static_cast<uint32_t>(ids.size()));
+    }
+
+    std::filesystem::path tmp_path = m_Path;
+    tmp_path += ".tmp";
+
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+
+    bool ok = write(fd, buffer.data(), buffer.size()) == static_cast<ssize_t>(buffer.size());
+    close(fd);
+
+    if (!ok || rename(tmp_path.c_str(), m_Path.c_str()) != 0) {
+        std::filesystem::remove(tmp_path);
+        return;
+    }
+
+    if (m_Map) munmap(m_Map, m_MapSize);
+    m_Map = nullptr;
+    m_MapSize = 0;
+    m_Paths.clear();
+    m_Ids.clear();
+    m_Deps.clear();
+    m_DeadRecords = 0;
+
+    load();
+}
+
+bool DepsLog::open_for_append() {
+    m_Fd = open(m_Path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (m_Fd < 0) {
+        std::cerr << "error: failed to open " << m_Path.string() << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(m_Fd, &st) == 0 && st.st_size == 0) {
+        write_buffer(deps_header());
+    }
+
+    return true;
+}
+
+void DepsLog::write_buffer(const std::string &buffer) {
+    if (m_Fd < 0) return;
+
+    if (write(m_Fd, buffer.data(), buffer.size()) != static_cast<ssize_t>(buffer.size())) {
+        std::cerr << "error: failed to write " << m_Path.string() << std::endl;
+        close(m_Fd);
+        m_Fd = -1;
+    }
+}
+
+void DepsLog::add_path(std::string_view path) {
+    std::string buffer;
+    append_path_record(buffer, path, static_cast<uint32_t>(m_Paths.size()));
+    write_buffer(buffer);
+
+    m_OwnedPaths.emplace_back(path);
+    std::string_view owned = m_OwnedPaths.back();
+
+    m_Ids[owned] = static_cast<uint32_t>(m_Paths.size());
+    m_Paths.push_back(owned);
+}
+
+uint32_t DepsLog::path_id(std::string_view path) {
+    auto it = m_Ids.find(path);
+    if (it != m_Ids.end()) return it->second;
+
+    add_path(path);
+    return static_cast<uint32_t>(m_Paths.size() - 1);
+}
+
+void DepsLog::add_deps(uint32_t output, const uint32_t *ids, uint32_t count) {
+    std::string buffer;
+    append_deps_record(buffer, output, ids, count);
+    write_buffer(buffer);
+
+    m_OwnedDeps.emplace_back(ids, ids + count);
+    if (m_Deps.size() <= output) m_Deps.resize(output + 1);
+    m_Deps[output] = { m_OwnedDeps.back().data(), count, true };
+}
+
+bool DepsLog::find(std::string_view output, std::vector<std::string_view> &inputs) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    auto it = m_Ids.find(output);
+    if (it == m_Ids.end() || it->second >= m_Deps.size()) return false;
+
+    const Deps &deps = m_Deps[it->second];
+    if (!deps.valid) return false;
+
+    inputs.clear();
+    for (uint32_t i = 0; i < deps.count; ++i) inputs.push_back(m_Paths[deps.ids[i]]);
+    return true;
+}
+
+void DepsLog::record(std::string_view output, const std::vector<std::string> &inputs) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    uint32_t output_id = path_id(output);
+
+    std::vector<uint32_t> ids;
+    ids.reserve(inputs.size());
+    for (const auto &input : inputs) ids.push_back(path_id(input));
+
+    // Nothing changed, keep the log from growing
+    if (output_id < m_Deps.size() && m_Deps[output_id].valid
+        && m_Deps[output_id].count == ids.size()
+        && std::equal(ids.begin(), ids.end(), m_Deps[output_id].ids)) {
+        return;
+    }
+
+    add_deps(output_id, ids.data(), static_cast<uint32_t>(ids.size()));
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Append-only binary log of the headers every output was built from,
+// stored in the out dir and memory-mapped on startup.
+//
+// Layout: an 8 byte magic and a u32 version, followed by records that each
+// start with a u32 header. A path record (high bit clear) holds the
+// path padded to 4 bytes and `~id` as checksum, ids count up from zero.
+// A deps record (high bit set) holds the output id followed by one id per
+// input. A later deps record for the same output replaces the earlier one.
+class DepsLog {
+public:
+    DepsLog(std::filesystem::path path);
+    ~DepsLog();
+public:
+    bool find(std::string_view output, std::vector<std::string_view> &inputs);
+    void record(std::string_view output, const std::vector<std::string> &inputs);
+private:
+    void load();
+    void recompact();
+    bool open_for_append();
+
+    uint32_t path_id(std::string_view path);
+    void add_path(std::string_view path);
+    void add_deps(uint32_t output, const uint32_t *ids, uint32_t count);
+    void write_buffer(const std::string &buffer);
+private:
+    struct Deps {
+        const uint32_t *ids = nullptr;
+        uint32_t count = 0;
+        bool valid = false;
+    };
+
+    std::filesystem::path m_Path;
+    std::mutex m_Mutex;
+
+    // The mapped log, paths and deps loaded from it point into it
+    void *m_Map = nullptr;
+    size_t m_MapSize = 0;
+    int m_Fd = -1;
+
+    std::vector<std::string_view> m_Paths;
+    std::unordered_map<std::string_view, uint32_t> m_Ids;
+    std::vector<Deps> m_Deps;
+    size_t m_DeadRecords = 0;
+
+    // Storage for paths and deps recorded after the log was mapped
+    std::deque<std::string> m_OwnedPaths;
+    std::deque<std::vector<uint32_t>> m_OwnedDeps;
+};
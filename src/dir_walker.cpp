@@ -0,0 +1,365 @@
+#include "dir_walker.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "build_state.hpp"
+#include "threadpool.hpp"
+
+static constexpr size_t DENTS_BUFFER_SIZE = 32 << 10;
+
+void PathList::add(std::string_view path) {
+    m_Spans.emplace_back(m_Arena.size(), path.size());
+    m_Arena.append(path);
+}
+
+void PathList::append(const PathList &other) {
+    size_t base = m_Arena.size();
+    m_Arena.append(other.m_Arena);
+    for (const auto &[offset, length] : other.m_Spans) m_Spans.emplace_back(base + offset, length);
+}
+
+void PathList::sort() {
+    std::sort(m_Spans.begin(), m_Spans.end(), [this](const Span &a, const Span &b) {
+        return view(a) < view(b);
+    });
+}
+
+static bool is_glob(const std::string &part) {
+    return part.find_first_of("*?[") != std::string::npos;
+}
+
+ExcludeMatcher::ExcludeMatcher(const std::string &root, const std::vector<std::string> &patterns) {
+    for (const auto &pattern : patterns) {
+        std::filesystem::path relative
+            = (std::filesystem::path(root) / pattern).lexically_normal().lexically_relative(root);
+        if (relative.empty()) continue;
+
+        std::vector<std::string> parts;
+        bool outside = false;
+
+        for (const auto &component : relative) {
+            std::string part = component.string();
+            if (part.empty() || part == ".") continue;
+
+            // Nothing that is walked can match
+            if (part == "..") {
+                outside = true;
+                break;
+            }
+            parts.push_back(std::move(part));
+        }
+        if (outside) continue;
+
+        if (std::any_of(parts.begin(), parts.end(), is_glob)) {
+            m_Globs.push_back(std::move(parts));
+            continue;
+        }
+
+        Node *node = &m_Root;
+        for (const auto &part : parts) node = &node->children[part];
+        node->excluded = true;
+    }
+}
+
+bool ExcludeMatcher::start(State &state) const {
+    state.node = &m_Root;
+    state.globs.clear();
+    if (m_Root.excluded) return false;
+
+    for (uint32_t pattern = 0; pattern < m_Globs.size(); ++pattern) {
+        if (advance(state, pattern, 0)) return false;
+    }
+    return true;
+}
+
+bool ExcludeMatcher::excludes_path(std::string_view relative) const {
+    State state, next;
+    if (!start(state)) return true;
+
+    std::string name;
+    for (size_t begin = 0; begin < relative.size(); ) {
+        size_t end = std::min(relative.find('/', begin), relative.size());
+        name.assign(relative.substr(begin, end - begin));
+
+        if (!name.empty() && excludes(state, name.c_str(), next)) return true;
+        std::swap(state, next);
+        begin = end + 1;
+    }
+    return false;
+}
+
+bool ExcludeMatcher::advance(State &state, uint32_t pattern, uint32_t position) const {
+    const auto &parts = m_Globs[pattern];
+
+    // `**` can match no component at all, so whatever follows it is reached too
+    for (; position < parts.size(); ++position) {
+        std::pair<uint32_t, uint32_t> entry(pattern, position);
+        if (std::find(state.globs.begin(), state.globs.end(), entry) == state.globs.end()) {
+            state.globs.push_back(entry);
+        }
+        if (parts[position] != "**") return false;
+    }
+    return true;
+}
+
+bool ExcludeMatcher::excludes(const State &state, const char *name, State &next) const {
+    next.node = nullptr;
+    next.globs.clear();
+
+    if (state.node) {
+        auto child = state.node->children.find(std::string_view(name));
+        if (child != state.node->children.end()) {
+            if (child->second.excluded) return true;
+            next.node = &child->second;
+        }
+    }
+
+    for (const auto &[pattern, position] : state.globs) {
+        const std::string &part = m_Globs[pattern][position];
+
+        if (part == "**") {
+            if (advance(next, pattern, position)) return true;
+        } else if (fnmatch(part.c_str(), name, 0) == 0) {
+            if (advance(next, pattern, position + 1)) return true;
+        }
+    }
+    return false;
+}
+
+// Listing a dir mostly waits on the file system, so it gets threads even on a single core
+static ThreadPool &walk_pool() {
+    static ThreadPool pool(std::max(2u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+// Symlinks count as what they point to, except that dirs behind them aren't walked
+static unsigned char resolve_type(int dir_fd, const char *name, unsigned char type) {
+    struct stat st;
+
+    if (type == DT_UNKNOWN) {
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return DT_UNKNOWN;
+        if (S_ISDIR(st.st_mode)) return DT_DIR;
+        if (S_ISREG(st.st_mode)) return DT_REG;
+        if (!S_ISLNK(st.st_mode)) return DT_UNKNOWN;
+    }
+
+    if (fstatat(dir_fd, name, &st, 0) != 0) return DT_UNKNOWN;
+    return S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+}
+
+std::string_view extension_of(std::string_view name) {
+    size_t dot = name.rfind('.');
+    if (dot == std::string_view::npos || dot == 0) return {};
+    return name.substr(dot);
+}
+
+// Every dir is a task on the walk pool, a task queues the subdirs it finds
+class SourceWalk {
+public:
+    SourceWalk(
+        const std::vector<std::string> &extensions,
+        const ExcludeMatcher &exclude,
+        ListingCache *listings,
+        std::vector<std::string> *dirs
+    );
+public:
+    void run(const std::string &root, ExcludeMatcher::State state);
+public:
+    PathList files;
+
+    // The first dir that couldn't be listed, and why
+    std::string failed_dir;
+    int failed_errno = 0;
+private:
+    void schedule(std::string dir, ExcludeMatcher::State state);
+    void list(const std::string &dir, const ExcludeMatcher::State &state);
+    bool read(const std::string &dir, ListingCache::Listing &listing);
+private:
+    std::unordered_set<std::string_view> m_Extensions;
+    const ExcludeMatcher &m_Exclude;
+
+    // Listings depend on the extensions, this names them in the cache
+    ListingCache *m_Listings;
+    std::string m_Filter;
+
+    std::vector<std::string> *m_Dirs;
+
+    std::mutex m_Mutex;
+    std::condition_variable m_Done;
+    size_t m_Pending = 0;
+};
+
+SourceWalk::SourceWalk(
+    const std::vector<std::string> &extensions,
+    const ExcludeMatcher &exclude,
+    ListingCache *listings,
+    std::vector<std::string> *dirs
+) : m_Extensions(extensions.begin(), extensions.end()), m_Exclude(exclude), m_Listings(listings), m_Dirs(dirs) {
+    for (const auto &extension : extensions) {
+        m_Filter += extension;
+        m_Filter += '\0';
+    }
+}
+
+void SourceWalk::run(const std::string &root, ExcludeMatcher::State state) {
+    schedule(root, std::move(state));
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Done.wait(lock, [this]() { return m_Pending == 0; });
+}
+
+void SourceWalk::schedule(std::string dir, ExcludeMatcher::State state) {
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        ++m_Pending;
+    }
+
+    walk_pool().enqueue([this, dir = std::move(dir), state = std::move(state)]() {
+        list(dir, state);
+
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (--m_Pending == 0) m_Done.notify_all();
+    });
+}
+
+bool SourceWalk::read(const std::string &dir, ListingCache::Listing &listing) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    // Taken before reading, an entry added meanwhile gives the dir a newer mtime
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        listing.inode = st.st_ino;
+        listing.mtime = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ull + st.st_mtim.tv_nsec;
+    }
+
+    alignas(struct dirent64) char buffer[DENTS_BUFFER_SIZE];
+
+    while (true) {
+        long size = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+        if (size == 0) break;
+
+        // A partial listing must never be cached, the dir fails like it didn't open
+        if (size < 0) {
+            if (errno == EINTR) continue;
+
+            int error = errno;
+            close(fd);
+            errno = error;
+            return false;
+        }
+
+        for (long offset = 0; offset < size; ) {
+            const struct dirent64 *entry = reinterpret_cast<const struct dirent64 *>(buffer + offset);
+            offset += entry->d_reclen;
+
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN || type == DT_LNK) type = resolve_type(fd, name, type);
+
+            if (type == DT_DIR) {
+                listing.dirs.emplace_back(name);
+            } else if (type == DT_REG && m_Extensions.count(extension_of(name))) {
+                listing.files.emplace_back(name);
+            }
+        }
+    }
+
+    close(fd);
+    return true;
+}
+
+void SourceWalk::list(const std::string &dir, const ExcludeMatcher::State &state) {
+    ListingCache::Listing listing;
+
+    if (!m_Listings || !m_Listings->find(dir, m_Filter, listing)) {
+        if (!read(dir, listing)) {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if (failed_dir.empty()) {
+                failed_dir = dir;
+                failed_errno = errno;
+            }
+            return;
+        }
+
+        if (m_Listings) m_Listings->store(dir, m_Filter, listing);
+    }
+
+    PathList found;
+    std::vector<std::pair<std::string, ExcludeMatcher::State>> subdirs;
+    ExcludeMatcher::State next;
+
+    std::string path = dir + "/";
+    size_t base = path.size();
+
+    // Excluded after listing, so the cached listing stays the same whatever is excluded
+    for (const auto &name : listing.files) {
+        if (m_Exclude.excludes(state, name.c_str(), next)) continue;
+
+        path.resize(base);
+        path += name;
+        found.add(path);
+    }
+
+    for (const auto &name : listing.dirs) {
+        if (m_Exclude.excludes(state, name.c_str(), next)) continue;
+
+        path.resize(base);
+        path += name;
+        subdirs.emplace_back(path, std::move(next));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        files.append(found);
+        if (m_Dirs) m_Dirs->push_back(dir);
+    }
+
+    for (auto &[subdir, subdir_state] : subdirs) schedule(std::move(subdir), std::move(subdir_state));
+}
+
+PathList walk_sources(
+    const std::string &dir,
+    const std::vector<std::string> &extensions,
+    const std::vector<std::string> &exclude,
+    std::vector<std::string> *dirs,
+    ListingCache *listings
+) {
+    // Paths below a normal root are normal too
+    std::string root = std::filesystem::path(dir).lexically_normal().string();
+    while (root.size() > 1 && root.back() == '/') root.pop_back();
+
+    ExcludeMatcher matcher(root, exclude);
+    ExcludeMatcher::State state;
+    if (!matcher.start(state)) return {};
+
+    SourceWalk walk(extensions, matcher, listings, dirs);
+    walk.run(root, std::move(state));
+
+    if (!walk.failed_dir.empty()) {
+        std::cerr << "error: failed to list " << walk.failed_dir << ": " << std::strerror(walk.failed_errno) << std::endl;
+        exit(1);
+    }
+
+    walk.files.sort();
+    if (dirs) std::sort(dirs->begin(), dirs->end());
+    return std::move(walk.files);
+}
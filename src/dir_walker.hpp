@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+class ListingCache;
+
+// Paths stored back to back in a single buffer instead of one allocation each
+class PathList {
+public:
+    void add(std::string_view path);
+    void append(const PathList &other);
+
+    // Byte order, so a walk gives the same list however its dirs were scheduled
+    void sort();
+public:
+    inline size_t size() const { return m_Spans.size(); }
+    inline bool empty() const { return m_Spans.empty(); }
+    inline std::string_view operator[](size_t i) const { return view(m_Spans[i]); }
+private:
+    // Offset into the arena and length
+    using Span = std::pair<size_t, size_t>;
+
+    inline std::string_view view(const Span &span) const {
+        return std::string_view(m_Arena).substr(span.first, span.second);
+    }
+private:
+    std::string m_Arena;
+    std::vector<Span> m_Spans;
+};
+
+// The `exclude` patterns of a manifest, compiled once. Plain paths go into a
+// trie of path components, patterns with `*`, `?` or `[` run as a small NFA
+// over the components, where `**` matches any number of them. Anything below
+// an excluded dir is excluded too.
+class ExcludeMatcher {
+private:
+    struct Node {
+        bool excluded = false;
+        std::map<std::string, Node, std::less<>> children;
+    };
+public:
+    // Patterns are relative to `root`, like `third_party/` or `**/*_test.cpp`
+    ExcludeMatcher(const std::string &root, const std::vector<std::string> &patterns);
+public:
+    // Where a dir is in the trie and in every pattern
+    struct State {
+        const Node *node = nullptr;
+        std::vector<std::pair<uint32_t, uint32_t>> globs;
+    };
+
+    // False when `root` itself is excluded
+    bool start(State &state) const;
+
+    // Whether the entry `name` of the dir at `state` is excluded, `next` is
+    // the state to list it with when it is a dir
+    bool excludes(const State &state, const char *name, State &next) const;
+
+    // Whether `relative`, a path below root, is excluded
+    bool excludes_path(std::string_view relative) const;
+private:
+    // Adds the pattern position to `state`, true when that completes the pattern
+    bool advance(State &state, uint32_t pattern, uint32_t position) const;
+private:
+    Node m_Root;
+    std::vector<std::vector<std::string>> m_Globs;
+};
+
+// Like std::filesystem::path::extension, `.bashrc` has none
+std::string_view extension_of(std::string_view name);
+
+// Regular files below `dir` whose extension is one of `extensions`, found by
+// walking its dirs in parallel with getdents64. The file type comes from the
+// dir entry, only symlinks and file systems that don't report types are
+// stat'ed. Symlinks to dirs aren't followed, dirs `exclude` matches aren't
+// entered. Every dir that was listed, `dir` included, goes into `dirs` when
+// it is set. Dirs unchanged since `listings` has them are only stat'ed.
+PathList walk_sources(
+    const std::string &dir,
+    const std::vector<std::string> &extensions,
+    const std::vector<std::string> &exclude,
+    std::vector<std::string> *dirs = nullptr,
+    ListingCache *listings = nullptr
+);
@@ -0,0 +1,322 @@
+#include "distributed.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_set>
+
+
+// Only used to ask a worker for its slots, a worker that takes longer is not worth waiting for
+static constexpr int WORKER_STATUS_TIMEOUT_SECONDS = 2;
+
+// Past this a worker is considered stuck and the compile is redone locally
+static constexpr int WORKER_COMPILE_TIMEOUT_SECONDS = 120;
+
+static constexpr auto WORKER_RETRY_DELAY = std::chrono::seconds(10);
+
+// A full worker usually has a slot again once one of its compiles finished
+static constexpr auto WORKER_BUSY_DELAY = std::chrono::milliseconds(200);
+
+static void put_string(std::string &data, const std::string &value) {
+    uint64_t size = value.size();
+    data.append(reinterpret_cast<const char *>(&size), sizeof(size));
+    data += value;
+}
+
+static bool get_string(const std::string &data, size_t &offset, std::string &value) {
+    uint64_t size;
+    if (data.size() - offset < sizeof(size)) return false;
+    std::memcpy(&size, data.data() + offset, sizeof(size));
+    offset += sizeof(size);
+
+    if (data.size() - offset < size) return false;
+    value = data.substr(offset, size);
+    offset += size;
+    return true;
+}
+
+std::string encode_compile_request(const CompileRequest &request) {
+    std::string data;
+    uint32_t count = request.argv.size();
+    data.append(reinterpret_cast<const char *>(&count), sizeof(count));
+
+    for (const auto &arg : request.argv) put_string(data, arg);
+    put_string(data, request.source);
+    return data;
+}
+
+bool decode_compile_request(const std::string &data, CompileRequest &request) {
+    uint32_t count;
+    if (data.size() < sizeof(count)) return false;
+    std::memcpy(&count, data.data(), sizeof(count));
+
+    size_t offset = sizeof(count);
+    request.argv.resize(count);
+
+    for (auto &arg : request.argv) {
+        if (!get_string(data, offset, arg)) return false;
+    }
+
+    return get_string(data, offset, request.source) && offset == data.size();
+}
+
+std::string encode_compile_result(const CompileResult &result) {
+    std::string data;
+    int32_t exit_code = result.exit_code;
+    data.append(reinterpret_cast<const char *>(&exit_code), sizeof(exit_code));
+
+    put_string(data, result.diagnostics);
+    put_string(data, result.object);
+    return data;
+}
+
+bool decode_compile_result(const std::string &data, CompileResult &result) {
+    int32_t exit_code;
+    if (data.size() < sizeof(exit_code)) return false;
+    std::memcpy(&exit_code, data.data(), sizeof(exit_code));
+    result.exit_code = exit_code;
+
+    size_t offset = sizeof(exit_code);
+    return get_string(data, offset, result.diagnostics)
+        && get_string(data, offset, result.object)
+        && offset == data.size();
+}
+
+DistributedCompiler::DistributedCompiler(const std::vector<std::string> &workers) {
+    for (const auto &address : workers) {
+        HttpClient status(address, WORKER_STATUS_TIMEOUT_SECONDS);
+        std::string body;
+
+        if (!status.valid() || !status.get("/status", body)) {
+            std::cerr << "warning: worker " << address << " is not reachable" << std::endl;
+            continue;
+        }
+
+        // slots <n>
+        std::istringstream fields(body);
+        std::string name;
+        size_t slots = 0;
+        fields >> name >> slots;
+
+        if (name != "slots" || slots == 0) {
+            std::cerr << "warning: worker " << address << " sent an invalid status" << std::endl;
+            continue;
+        }
+
+        Worker worker;
+        worker.client = std::make_unique<HttpClient>(address, WORKER_COMPILE_TIMEOUT_SECONDS);
+        worker.slots = slots;
+
+        m_Slots += slots;
+        m_Workers.push_back(std::move(worker));
+    }
+}
+
+bool DistributedCompiler::acquire(size_t &worker) {
+    auto now = std::chrono::steady_clock::now();
+
+    // The worker with the most free slots, so the load stays even
+    bool found = false;
+    for (size_t i = 0; i < m_Workers.size(); ++i) {
+        const Worker &candidate = m_Workers[i];
+        if (candidate.running >= candidate.slots || candidate.retry_at > now) continue;
+
+        if (!found || candidate.slots - candidate.running > m_Workers[worker].slots - m_Workers[worker].running) {
+            worker = i;
+            found = true;
+        }
+    }
+
+    if (found) ++m_Workers[worker].running;
+    return found;
+}
+
+std::chrono::steady_clock::time_point DistributedCompiler::next_retry() const {
+    auto now = std::chrono::steady_clock::now();
+    auto next = std::chrono::steady_clock::time_point::max();
+
+    for (const auto &worker : m_Workers) {
+        if (worker.running < worker.slots) next = std::min(next, std::max(worker.retry_at, now));
+    }
+
+    return next;
+}
+
+void DistributedCompiler::release(size_t worker, bool failed) {
+    --m_Workers[worker].running;
+
+    if (failed) {
+        m_Workers[worker].retry_at = std::chrono::steady_clock::now() + WORKER_RETRY_DELAY;
+    }
+}
+
+static bool takes_value(const std::string &arg) {
+    return arg == "-o" || arg == "-MF" || arg == "-MT" || arg == "-MQ"
+        || arg == "-I" || arg == "-D" || arg == "-U" || arg == "-include" || arg == "-imacros"
+        || arg == "-isystem" || arg == "-iquote" || arg == "-idirafter";
+}
+
+// The flags left once the source is preprocessed, preprocessor and dependency flags are dropped
+static std::vector<std::string> remote_argv(const Action &action) {
+    std::filesystem::path compiler = action.argv.front();
+    std::vector<std::string> argv = { compiler.filename().string() };
+
+    for (size_t i = 1; i < action.argv.size(); ++i) {
+        const std::string &arg = action.argv[i];
+
+        // `-c <source>`, the worker puts the preprocessed source in its place
+        if (takes_value(arg) || arg == "-c") {
+            ++i;
+            continue;
+        }
+
+        bool preprocessor = arg.compare(0, 2, "-I") == 0 || arg.compare(0, 2, "-D") == 0 || arg.compare(0, 2, "-U") == 0
+            || arg == "-MD" || arg == "-MMD" || arg == "-MP";
+        if (preprocessor || arg == "-E" || arg == "-P") continue;
+
+        argv.push_back(arg);
+    }
+
+    // g++ and clang++ compile .c files as C++, the plain drivers go by the extension
+    bool cxx = argv.front().find("++") != std::string::npos || action.inputs.front().extension() != ".c";
+    argv.insert(argv.end(), { "-x", cxx ? "c++-cpp-output" : "cpp-output", "-c" });
+    return argv;
+}
+
+static bool has_prefix(const std::string &arg, const char *prefix) {
+    return arg.compare(0, std::strlen(prefix), prefix) == 0;
+}
+
+// Exact flags, and prefixes for the ones ending in '='
+static const std::unordered_set<std::string> REMOTE_FLAGS = {
+    "-c", "-w", "-ansi", "-pedantic", "-pedantic-errors", "-pthread",
+    "-std=", "-O", "-O0", "-O1", "-O2", "-O3", "-Os", "-Og", "-Oz", "-Ofast",
+    "-g", "-g0", "-g1", "-g2", "-g3", "-ggdb", "-ggdb0", "-ggdb1", "-ggdb2", "-ggdb3", "-gdwarf",
+    "-gdwarf-2", "-gdwarf-3", "-gdwarf-4", "-gdwarf-5", "-gcolumn-info", "-gno-column-info", "-gstrict-dwarf",
+    "-fPIC", "-fpic", "-fPIE", "-fpie", "-fexceptions", "-frtti", "-fvisibility=", "-fvisibility-inlines-hidden",
+    "-fstack-protector", "-fstack-protector-strong", "-fstack-protector-all", "-fstack-clash-protection",
+    "-fcf-protection", "-fcf-protection=", "-fomit-frame-pointer", "-fstrict-aliasing", "-fwrapv", "-ftrapv",
+    "-fsigned-char", "-funsigned-char", "-ffunction-sections", "-fdata-sections", "-fcommon", "-fpermissive",
+    "-fasynchronous-unwind-tables", "-funwind-tables", "-fshort-enums", "-fstrict-enums", "-ffast-math",
+    "-funroll-loops", "-finline-functions", "-fopenmp", "-fcoroutines", "-fconcepts", "-fchar8_t",
+    "-fsized-deallocation", "-faligned-new", "-flto", "-flto=", "-fsanitize=", "-fdiagnostics-color",
+    "-fdiagnostics-color=", "-fmessage-length=", "-fmax-errors=", "-ftemplate-depth=", "-fconstexpr-depth=",
+    "-fconstexpr-steps=", "-ffile-prefix-map=", "-fdebug-prefix-map=", "-fmacro-prefix-map="
+};
+
+static bool is_remote_flag(const std::string &arg) {
+    if (REMOTE_FLAGS.count(arg)) return true;
+
+    size_t equals = arg.find('=');
+    if (equals != std::string::npos && REMOTE_FLAGS.count(arg.substr(0, equals + 1))) return true;
+
+    // Turning a feature off never makes the compiler write or run anything. -Wa, -Wl and
+    // -Wp pass flags on to other programs, -m flags taking a path aren't codegen.
+    if (has_prefix(arg, "-fno-") || has_prefix(arg, "-gno-")) return true;
+    if (has_prefix(arg, "-W")) return arg.find(',') == std::string::npos;
+    if (has_prefix(arg, "-m")) return arg.size() > 2 && arg.find('/') == std::string::npos;
+    return false;
+}
+
+bool is_remote_argv(const std::vector<std::string> &argv) {
+    for (size_t i = 1; i < argv.size(); ++i) {
+        if (argv[i] == "-x") {
+            if (++i >= argv.size() || (argv[i] != "cpp-output" && argv[i] != "c++-cpp-output")) return false;
+            continue;
+        }
+
+        if (!is_remote_flag(argv[i])) return false;
+    }
+
+    return true;
+}
+
+bool DistributedCompiler::accepts(const Action &action) const {
+    return !action.argv.empty() && !action.inputs.empty() && is_remote_argv(remote_argv(action));
+}
+
+std::filesystem::path DistributedCompiler::preprocessed_path(const Action &action) {
+    return action.outputs.front().string() + ".ii";
+}
+
+std::vector<std::string> DistributedCompiler::preprocess_argv(const Action &action) {
+    std::vector<std::string> argv = action.argv;
+
+    for (size_t i = 1; i < argv.size(); ++i) {
+        if (argv[i] == "-c") {
+            argv[i] = "-E";
+        } else if (argv[i] == "-o" && i + 1 < argv.size()) {
+            argv[++i] = preprocessed_path(action).string();
+        }
+    }
+
+    return argv;
+}
+
+bool DistributedCompiler::take_preprocessed(const Action &action, std::string *source) {
+    std::filesystem::path path = preprocessed_path(action);
+    bool ok = true;
+
+    if (source) {
+        std::ifstream in(path, std::ios::binary);
+        std::stringstream content;
+        content << in.rdbuf();
+        ok = in.is_open();
+        *source = content.str();
+    }
+
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+    return ok;
+}
+
+std::unique_ptr<HttpExchange> DistributedCompiler::send(size_t worker, const Action &action, const std::string &source) {
+    CompileRequest request;
+    request.argv = remote_argv(action);
+    request.source = source;
+
+    return m_Workers[worker].client->start({ "POST", "/compile", encode_compile_request(request) });
+}
+
+RemoteOutcome DistributedCompiler::receive(size_t worker, const Action &action, const HttpResponse &response,
+                                           std::string &output, int &exit_code) {
+    if (response.status == 503) {
+        --m_Workers[worker].running;
+        m_Workers[worker].retry_at = std::chrono::steady_clock::now() + WORKER_BUSY_DELAY;
+        return RemoteOutcome::Busy;
+    }
+
+    if (response.status == 400) {
+        release(worker, false);
+        return RemoteOutcome::Refused;
+    }
+
+    CompileResult result;
+    if (response.status != 200 || !decode_compile_result(response.body, result)) {
+        release(worker, true);
+        return RemoteOutcome::Failed;
+    }
+
+    if (result.exit_code == 0) {
+        std::ofstream out(action.outputs.front(), std::ios::binary | std::ios::trunc);
+        out << result.object;
+        out.close();
+
+        // A half written object would look like a finished compile
+        if (!out) {
+            std::error_code ec;
+            std::filesystem::remove(action.outputs.front(), ec);
+            release(worker, false);
+            return RemoteOutcome::Failed;
+        }
+    }
+
+    release(worker, false);
+    output += result.diagnostics;
+    exit_code = result.exit_code;
+    return RemoteOutcome::Done;
+}
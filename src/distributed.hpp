@@ -0,0 +1,93 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "graph.hpp"
+#include "http.hpp"
+
+// A compile shipped to a worker: the flags of the compile and the preprocessed source
+struct CompileRequest {
+    std::vector<std::string> argv;
+    std::string source;
+};
+
+struct CompileResult {
+    int exit_code = 127;
+    std::string diagnostics, object;
+};
+
+std::string encode_compile_request(const CompileRequest &request);
+bool decode_compile_request(const std::string &data, CompileRequest &request);
+std::string encode_compile_result(const CompileResult &result);
+bool decode_compile_result(const std::string &data, CompileResult &result);
+
+// Whether a worker runs a compile with these flags. Only code generation and
+// warning flags are let through, anything that could write other files or
+// run other programs is not.
+bool is_remote_argv(const std::vector<std::string> &argv);
+
+// What a worker made of a compile sent to it
+enum class RemoteOutcome {
+    Done,
+    // Every slot was taken, the compile can go to another worker
+    Busy,
+    // The worker won't run these flags, the compile has to run locally
+    Refused,
+    // No usable answer or the object couldn't be written, the compile runs locally
+    Failed
+};
+
+// Runs compiles on `weld worker` daemons. Sources are preprocessed locally,
+// so workers only need the compiler and never see the headers. The scheduler
+// preprocesses with `preprocess_argv` in a local job slot, then sends the
+// source from its event loop, so waiting on a worker never holds a thread or
+// a local slot. Each compile goes to the worker with the most free slots.
+// Compiles a worker failed on go back to the scheduler to run locally.
+class DistributedCompiler {
+public:
+    // `workers` are host:port addresses, unreachable ones are left out
+    DistributedCompiler(const std::vector<std::string> &workers);
+public:
+    // The number of compiles the workers can run at once
+    inline size_t slots() const { return m_Slots; }
+    inline const std::string &address(size_t worker) const { return m_Workers[worker].client->address(); }
+
+    // Whether a worker would run `action` at all
+    bool accepts(const Action &action) const;
+
+    // Takes a slot on the worker with the most free ones, false when none is free right now
+    bool acquire(size_t &worker);
+    // When a busy or failed worker may be tried again, for waiting on a free slot
+    std::chrono::steady_clock::time_point next_retry() const;
+    void release(size_t worker, bool failed);
+
+    // The same command with -E, it writes the preprocessed source to `preprocessed_path` and the depfile
+    static std::vector<std::string> preprocess_argv(const Action &action);
+    static std::filesystem::path preprocessed_path(const Action &action);
+    // Reads what the -E command wrote and removes the file, with `source` null it's only removed
+    static bool take_preprocessed(const Action &action, std::string *source);
+
+    // Sends the preprocessed `source` of `action`, nullptr when `worker` can't be reached
+    std::unique_ptr<HttpExchange> send(size_t worker, const Action &action, const std::string &source);
+
+    // Handles the answer to `send` and releases the worker. Done writes the object and
+    // sets `exit_code` and `output`, a status of 0 means no answer came back.
+    RemoteOutcome receive(size_t worker, const Action &action, const HttpResponse &response,
+                          std::string &output, int &exit_code);
+private:
+    struct Worker {
+        std::unique_ptr<HttpClient> client;
+        size_t slots = 0, running = 0;
+
+        // Busy and failed workers get a break before they are tried again
+        std::chrono::steady_clock::time_point retry_at;
+    };
+private:
+    std::vector<Worker> m_Workers;
+    size_t m_Slots = 0;
+};
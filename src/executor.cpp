@@ -0,0 +1,349 @@
+#include "executor.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Without pidfds, exits are polled with wait4 every few milliseconds
+static constexpr int POLL_INTERVAL_MS = 10;
+
+// Written to by the SIGINT/SIGTERM handler and watched by the event loop
+static int s_InterruptPipe[2] = { -1, -1 };
+
+static void on_interrupt(int) {
+    char byte = 0;
+    (void)!write(s_InterruptPipe[1], &byte, 1);
+}
+
+static int pidfd_open(pid_t pid) {
+    #ifdef SYS_pidfd_open
+        return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+    #else
+        errno = ENOSYS;
+        return -1;
+    #endif
+}
+
+Executor::Executor(size_t jobs)
+    : m_Jobs(jobs == 0 ? 1 : jobs) {
+    m_Epoll = epoll_create1(EPOLL_CLOEXEC);
+
+    if (s_InterruptPipe[0] < 0 && pipe2(s_InterruptPipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        s_InterruptPipe[0] = s_InterruptPipe[1] = -1;
+    }
+
+    if (s_InterruptPipe[0] >= 0) {
+        watch(s_InterruptPipe[0], FdKind::Interrupt, 0);
+
+        struct sigaction action = {};
+        action.sa_handler = on_interrupt;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, &m_OldInt);
+        sigaction(SIGTERM, &action, &m_OldTerm);
+    }
+}
+
+Executor::~Executor() {
+    cancel();
+
+    // Waits for the tasks still running
+    m_Pool.reset();
+    if (m_TaskEvent >= 0) close(m_TaskEvent);
+
+    if (s_InterruptPipe[0] >= 0) {
+        sigaction(SIGINT, &m_OldInt, nullptr);
+        sigaction(SIGTERM, &m_OldTerm, nullptr);
+    }
+
+    if (m_Epoll >= 0) close(m_Epoll);
+}
+
+void Executor::watch(int fd, FdKind kind, pid_t pid, uint32_t events) {
+    struct epoll_event event = {};
+    event.events = events;
+    event.data.fd = fd;
+
+    epoll_ctl(m_Epoll, EPOLL_CTL_ADD, fd, &event);
+    m_Fds[fd] = { kind, pid };
+}
+
+bool Executor::start(
+    size_t id,
+    const std::vector<std::string> &argv,
+    std::string &error,
+    const std::filesystem::path &cwd,
+    const SandboxMounts *sandbox
+) {
+    Child child;
+    child.completion.id = id;
+
+    if (!Process::start(argv, true, child.process, error, cwd, sandbox)) return false;
+
+    pid_t pid = child.process.pid;
+
+    if (m_HasPidfd) {
+        child.pidfd = pidfd_open(pid);
+        if (child.pidfd < 0) m_HasPidfd = false;
+    }
+
+    if (child.pidfd >= 0) watch(child.pidfd, FdKind::Pid, pid);
+    watch(child.process.out_fd, FdKind::Output, pid);
+    watch(child.process.err_fd, FdKind::Output, pid);
+
+    m_Children.emplace(pid, std::move(child));
+    return true;
+}
+
+void Executor::start_task(size_t id, Task task) {
+    if (!m_Pool) {
+        m_TaskEvent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        watch(m_TaskEvent, FdKind::Task, 0);
+        m_Pool = std::make_unique<ThreadPool>(m_Jobs);
+    }
+
+    ++m_Tasks;
+    m_Pool->enqueue([this, id, task = std::move(task)]() {
+        Completion completion;
+        completion.id = id;
+        completion.exit_code = task(completion.output);
+
+        {
+            std::lock_guard<std::mutex> lock(m_TaskMutex);
+            m_TaskDone.push_back(std::move(completion));
+        }
+
+        uint64_t one = 1;
+        (void)!write(m_TaskEvent, &one, sizeof(one));
+    });
+}
+
+void Executor::start_exchange(size_t id, std::unique_ptr<HttpExchange> exchange) {
+    int fd = exchange->fd();
+    watch(fd, FdKind::Exchange, 0, exchange->sending() ? EPOLLOUT : EPOLLIN);
+    m_Exchanges[fd] = { id, std::move(exchange) };
+}
+
+void Executor::advance(Exchange &exchange, std::vector<Completion> &completed) {
+    int fd = exchange.exchange->fd();
+    bool sending = exchange.exchange->sending();
+
+    if (exchange.exchange->advance()) {
+        // Done sending, the response comes back on the same socket
+        if (sending && !exchange.exchange->sending()) {
+            struct epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            epoll_ctl(m_Epoll, EPOLL_CTL_MOD, fd, &event);
+        }
+        return;
+    }
+
+    HttpResponse &response = exchange.exchange->response();
+
+    Completion completion;
+    completion.id = exchange.id;
+    completion.exit_code = response.status;
+    completion.output = std::move(response.body);
+    completed.push_back(std::move(completion));
+
+    m_Fds.erase(fd);
+    m_Exchanges.erase(fd);
+}
+
+// Waits no longer than the closest exchange deadline
+int Executor::next_timeout(int timeout_ms) const {
+    if (!m_HasPidfd) timeout_ms = timeout_ms < 0 ? POLL_INTERVAL_MS : std::min(timeout_ms, POLL_INTERVAL_MS);
+
+    auto now = std::chrono::steady_clock::now();
+    for (auto &[fd, exchange] : m_Exchanges) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(exchange.exchange->deadline() - now).count();
+        int left_ms = static_cast<int>(std::max<decltype(left)>(left, 0) + 1);
+        timeout_ms = timeout_ms < 0 ? left_ms : std::min(timeout_ms, left_ms);
+    }
+
+    return timeout_ms;
+}
+
+void Executor::expire(std::vector<Completion> &completed) {
+    auto now = std::chrono::steady_clock::now();
+
+    for (auto it = m_Exchanges.begin(); it != m_Exchanges.end(); ) {
+        if (it->second.exchange->deadline() > now) {
+            ++it;
+            continue;
+        }
+
+        Completion completion;
+        completion.id = it->second.id;
+        completion.exit_code = 0;
+        completed.push_back(std::move(completion));
+
+        m_Fds.erase(it->first);
+        it = m_Exchanges.erase(it);
+    }
+}
+
+void Executor::reap(Child &child) {
+    int status;
+    pid_t pid = wait4(child.process.pid, &status, WNOHANG, &child.completion.usage);
+    if (pid != child.process.pid) return;
+
+    child.exited = true;
+    child.completion.exit_code = Process::exit_code(status);
+
+    if (child.pidfd >= 0) {
+        m_Fds.erase(child.pidfd);
+        close(child.pidfd);
+        child.pidfd = -1;
+    }
+}
+
+void Executor::read_output(Child &child, int &fd) {
+    char buffer[16 * 1024];
+
+    while (true) {
+        ssize_t size = read(fd, buffer, sizeof(buffer));
+
+        if (size > 0) {
+            child.completion.output.append(buffer, size);
+            continue;
+        }
+
+        if (size < 0 && errno == EINTR) continue;
+        if (size < 0 && errno == EAGAIN) return;
+
+        // EOF, the child and everything it started closed this end
+        m_Fds.erase(fd);
+        close(fd);
+        fd = -1;
+        return;
+    }
+}
+
+void Executor::complete_if_done(pid_t pid, std::vector<Completion> &completed) {
+    auto it = m_Children.find(pid);
+    if (it == m_Children.end()) return;
+
+    Child &child = it->second;
+    if (!child.exited || child.process.out_fd >= 0 || child.process.err_fd >= 0) return;
+
+    Process::finish(child.process);
+    completed.push_back(std::move(child.completion));
+    m_Children.erase(it);
+}
+
+void Executor::handle(int fd, std::vector<Completion> &completed) {
+    auto it = m_Fds.find(fd);
+    if (it == m_Fds.end()) return;
+
+    auto [kind, pid] = it->second;
+
+    if (kind == FdKind::Interrupt) {
+        char buffer[64];
+        while (read(fd, buffer, sizeof(buffer)) > 0) {}
+        m_Interrupted = true;
+        return;
+    }
+
+    if (kind == FdKind::Task) {
+        uint64_t count;
+        (void)!read(fd, &count, sizeof(count));
+
+        std::lock_guard<std::mutex> lock(m_TaskMutex);
+        m_Tasks -= m_TaskDone.size();
+        for (auto &completion : m_TaskDone) completed.push_back(std::move(completion));
+        m_TaskDone.clear();
+        return;
+    }
+
+    if (kind == FdKind::Exchange) {
+        advance(m_Exchanges.at(fd), completed);
+        return;
+    }
+
+    auto child = m_Children.find(pid);
+    if (child == m_Children.end()) return;
+
+    if (kind == FdKind::Pid) {
+        reap(child->second);
+    } else {
+        ChildProcess &process = child->second.process;
+        read_output(child->second, fd == process.out_fd ? process.out_fd : process.err_fd);
+    }
+
+    complete_if_done(pid, completed);
+}
+
+void Executor::wait(std::vector<Completion> &completed, int timeout_ms) {
+    struct epoll_event events[64];
+    auto start = std::chrono::steady_clock::now();
+
+    while (completed.empty() && !m_Interrupted && (running() > 0 || timeout_ms >= 0)) {
+        int left_ms = -1;
+        if (timeout_ms >= 0) {
+            auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            if (waited >= timeout_ms) break;
+            left_ms = static_cast<int>(timeout_ms - waited);
+        }
+
+        int count = epoll_wait(m_Epoll, events, 64, next_timeout(left_ms));
+
+        if (count < 0 && errno != EINTR) break;
+
+        for (int i = 0; i < count; ++i) {
+            handle(events[i].data.fd, completed);
+        }
+
+        expire(completed);
+
+        if (!m_HasPidfd) {
+            std::vector<pid_t> pids;
+            for (auto &[pid, child] : m_Children) {
+                if (!child.exited) pids.push_back(pid);
+            }
+
+            for (pid_t pid : pids) {
+                reap(m_Children.at(pid));
+                complete_if_done(pid, completed);
+            }
+        }
+    }
+}
+
+void Executor::cancel() {
+    for (auto &[pid, child] : m_Children) {
+        if (!child.exited) kill(pid, SIGTERM);
+    }
+
+    for (auto &[pid, child] : m_Children) {
+        if (!child.exited) {
+            while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {}
+        }
+
+        if (child.pidfd >= 0) {
+            m_Fds.erase(child.pidfd);
+            close(child.pidfd);
+        }
+
+        m_Fds.erase(child.process.out_fd);
+        m_Fds.erase(child.process.err_fd);
+        Process::finish(child.process);
+    }
+
+    m_Children.clear();
+
+    cancel_exchanges();
+}
+
+void Executor::cancel_exchanges() {
+    // Closing the socket is all a worker needs to stop the compile
+    for (auto &[fd, exchange] : m_Exchanges) m_Fds.erase(fd);
+    m_Exchanges.clear();
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <csignal>
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "http.hpp"
+#include "process.hpp"
+#include "threadpool.hpp"
+
+struct Completion {
+    size_t id;
+    int exit_code = 127;
+    std::string output;
+    struct rusage usage = {};
+};
+
+// In-process work like cache lookups, returns an exit code like a child would
+using Task = std::function<int(std::string &output)>;
+
+// Runs up to `jobs` children from a single event loop. Child exits are
+// picked up through pidfds and their output pipes are multiplexed with
+// epoll, so no thread is blocked per running job. Tasks run on a pool
+// and report back to the same loop through an eventfd. HTTP exchanges
+// are driven by the loop as well, until they finish or time out.
+class Executor {
+public:
+    Executor(size_t jobs);
+    ~Executor();
+public:
+    inline bool can_start() const { return m_Children.size() < m_Jobs; }
+    inline size_t running() const { return m_Children.size() + m_Tasks + m_Exchanges.size(); }
+    inline bool interrupted() const { return m_Interrupted; }
+
+    // `id` is handed back in the Completion of the child
+    bool start(size_t id, const std::vector<std::string> &argv, std::string &error, const std::filesystem::path &cwd = {},
+               const SandboxMounts *sandbox = nullptr);
+
+    // Tasks don't take a job slot, they are bound by the pool size instead
+    void start_task(size_t id, Task task);
+
+    // Exchanges don't take a job slot either. They complete with the response status
+    // as exit code and the body as output, the status is 0 when none came back in time.
+    void start_exchange(size_t id, std::unique_ptr<HttpExchange> exchange);
+
+    // Blocks until at least one child finished, until weld got interrupted or,
+    // with a `timeout_ms` other than -1, until that passed
+    void wait(std::vector<Completion> &completed, int timeout_ms = -1);
+
+    // Terminates every running child and waits for them, exchanges are dropped
+    void cancel();
+    void cancel_exchanges();
+private:
+    struct Child {
+        ChildProcess process;
+        int pidfd = -1;
+        bool exited = false;
+        Completion completion;
+    };
+
+    struct Exchange {
+        size_t id;
+        std::unique_ptr<HttpExchange> exchange;
+    };
+
+    enum class FdKind { Pid, Output, Interrupt, Task, Exchange };
+
+    void watch(int fd, FdKind kind, pid_t pid, uint32_t events = EPOLLIN);
+    void advance(Exchange &exchange, std::vector<Completion> &completed);
+    int next_timeout(int timeout_ms) const;
+    void expire(std::vector<Completion> &completed);
+    void handle(int fd, std::vector<Completion> &completed);
+    void reap(Child &child);
+    void read_output(Child &child, int &fd);
+    void complete_if_done(pid_t pid, std::vector<Completion> &completed);
+private:
+    size_t m_Jobs;
+    int m_Epoll = -1;
+    bool m_HasPidfd = true;
+    bool m_Interrupted = false;
+    struct sigaction m_OldInt = {}, m_OldTerm = {};
+
+    std::unordered_map<pid_t, Child> m_Children;
+    std::unordered_map<int, std::pair<FdKind, pid_t>> m_Fds;
+
+    // Keyed by their socket
+    std::unordered_map<int, Exchange> m_Exchanges;
+
+    // Created with the first task, finished tasks are queued for the loop
+    std::unique_ptr<ThreadPool> m_Pool;
+    int m_TaskEvent = -1;
+    size_t m_Tasks = 0;
+    std::mutex m_TaskMutex;
+    std::vector<Completion> m_TaskDone;
+};
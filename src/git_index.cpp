@@ -0,0 +1,323 @@
+#include "git_index.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr char INDEX_MAGIC[4] = { 'D', 'I', 'R', 'C' };
+
+// ctime, mtime, dev, ino, mode, uid, gid and size, each a big endian u32
+static constexpr size_t ENTRY_STAT_SIZE = 40;
+
+static constexpr uint16_t FLAG_EXTENDED = 0x4000;
+static constexpr uint16_t EXTENDED_SKIP_WORKTREE = 0x4000;
+
+static constexpr uint32_t MODE_TYPE = 0170000;
+static constexpr uint32_t MODE_REGULAR = 0100000;
+static constexpr uint32_t MODE_SYMLINK = 0120000;
+
+static uint32_t read_be32(const unsigned char *data) {
+    return static_cast<uint32_t>(data[0]) << 24 | static_cast<uint32_t>(data[1]) << 16
+        | static_cast<uint32_t>(data[2]) << 8 | data[3];
+}
+
+static uint16_t read_be16(const unsigned char *data) {
+    return static_cast<uint16_t>(data[0] << 8 | data[1]);
+}
+
+// Git's offset varint, every continuation byte adds one before shifting
+static bool read_varint(const unsigned char *&data, const unsigned char *end, uint64_t &value) {
+    if (data == end) return false;
+
+    unsigned char byte = *data++;
+    value = byte & 127;
+
+    while (byte & 128) {
+        if (data == end || value > (UINT64_MAX >> 7) - 1) return false;
+        byte = *data++;
+        value = ((value + 1) << 7) | (byte & 127);
+    }
+    return true;
+}
+
+static bool parse_index(
+    const unsigned char *data,
+    size_t size,
+    size_t hash_size,
+    std::vector<GitIndexEntry> &entries
+) {
+    if (size < 12 + hash_size || std::memcmp(data, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) return false;
+
+    uint32_t version = read_be32(data + 4);
+    uint32_t count = read_be32(data + 8);
+    if (version < 2 || version > 4) return false;
+
+    // The checksum of everything before it closes the index
+    const unsigned char *end = data + size - hash_size;
+    const unsigned char *cursor = data + 12;
+
+    const size_t fixed_size = ENTRY_STAT_SIZE + hash_size + sizeof(uint16_t);
+    std::string path;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        const unsigned char *entry = cursor;
+        if (static_cast<size_t>(end - cursor) < fixed_size) return false;
+
+        uint16_t flags = read_be16(cursor + ENTRY_STAT_SIZE + hash_size);
+        cursor += fixed_size;
+
+        uint16_t extended = 0;
+        if (flags & FLAG_EXTENDED) {
+            if (version < 3 || end - cursor < 2) return false;
+            extended = read_be16(cursor);
+            cursor += 2;
+        }
+
+        if (version == 4) {
+            // The path drops that many bytes from the end of the previous one and appends its own
+            uint64_t strip;
+            if (!read_varint(cursor, end, strip) || strip > path.size()) return false;
+            path.resize(path.size() - strip);
+
+            const void *nul = std::memchr(cursor, '\0', end - cursor);
+            if (!nul) return false;
+
+            const unsigned char *name_end = static_cast<const unsigned char *>(nul);
+            path.append(reinterpret_cast<const char *>(cursor), name_end - cursor);
+            cursor = name_end + 1;
+        } else {
+            const void *nul = std::memchr(cursor, '\0', end - cursor);
+            if (!nul) return false;
+
+            const unsigned char *name_end = static_cast<const unsigned char *>(nul);
+            path.assign(reinterpret_cast<const char *>(cursor), name_end - cursor);
+
+            // One to eight NULs pad the entry to a multiple of eight bytes
+            size_t padded = (static_cast<size_t>(name_end - entry) + 8) & ~static_cast<size_t>(7);
+            if (static_cast<size_t>(end - entry) < padded) return false;
+            cursor = entry + padded;
+        }
+
+        // A conflict has the base at stage 1, ours at 2 and theirs at 3
+        uint32_t stage = (flags >> 12) & 3;
+        if ((stage != 0 && stage != 2) || (extended & EXTENDED_SKIP_WORKTREE)) continue;
+
+        GitIndexEntry indexed;
+        indexed.path = path;
+        indexed.mode = read_be32(entry + 24);
+        indexed.mtime = static_cast<uint64_t>(read_be32(entry + 8)) * 1000000000ull + read_be32(entry + 12);
+        indexed.stage = stage;
+        entries.push_back(std::move(indexed));
+    }
+
+    // Extensions are a signature and a u32 size each, a split index links to the rest of its entries
+    while (end - cursor >= 8) {
+        if (std::memcmp(cursor, "link", 4) == 0) return false;
+
+        uint32_t extension_size = read_be32(cursor + 4);
+        if (static_cast<size_t>(end - cursor) - 8 < extension_size) return false;
+        cursor += 8 + extension_size;
+    }
+
+    return cursor == end;
+}
+
+static uint64_t mtime_of(const struct stat &st) {
+    return static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ull + st.st_mtim.tv_nsec;
+}
+
+bool read_git_index(
+    const std::string &path,
+    size_t hash_size,
+    std::vector<GitIndexEntry> &entries,
+    uint64_t *mtime
+) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    std::vector<GitIndexEntry> parsed;
+    bool ok = parse_index(static_cast<const unsigned char *>(map), size, hash_size, parsed);
+    munmap(map, size);
+
+    if (ok) entries = std::move(parsed);
+    if (ok && mtime) *mtime = mtime_of(st);
+    return ok;
+}
+
+static std::string read_file(const std::filesystem::path &path) {
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+// The work tree `dir` is in and its git dir. `.git` is a file pointing at the
+// git dir in linked work trees and submodules.
+static bool find_git_dir(const std::filesystem::path &dir, std::filesystem::path &work_tree, std::filesystem::path &git_dir) {
+    for (std::filesystem::path current = dir; ; current = current.parent_path()) {
+        std::filesystem::path dot_git = current / ".git";
+        std::error_code ec;
+
+        if (std::filesystem::is_directory(dot_git, ec)) {
+            work_tree = current;
+            git_dir = dot_git;
+            return true;
+        }
+
+        if (std::filesystem::is_regular_file(dot_git, ec)) {
+            std::string contents = read_file(dot_git);
+            if (contents.rfind("gitdir: ", 0) != 0) return false;
+
+            std::string target = contents.substr(8);
+            while (!target.empty() && (target.back() == '\n' || target.back() == '\r')) target.pop_back();
+
+            work_tree = current;
+            git_dir = (current / target).lexically_normal();
+            return true;
+        }
+
+        if (current == current.parent_path()) return false;
+    }
+}
+
+// Object ids are SHA-1 unless the repository was made with `--object-format=sha256`
+static size_t object_hash_size(const std::filesystem::path &git_dir) {
+    // Linked work trees keep their config in the main git dir
+    std::filesystem::path common_dir = git_dir;
+    std::error_code ec;
+
+    if (std::filesystem::exists(git_dir / "commondir", ec)) {
+        std::string common = read_file(git_dir / "commondir");
+        while (!common.empty() && (common.back() == '\n' || common.back() == '\r')) common.pop_back();
+        common_dir = (git_dir / common).lexically_normal();
+    }
+
+    std::stringstream config(read_file(common_dir / "config"));
+    for (std::string line; std::getline(config, line); ) {
+        std::transform(line.begin(), line.end(), line.begin(), [](unsigned char c) { return std::tolower(c); });
+        if (line.find("objectformat") != std::string::npos && line.find("sha256") != std::string::npos) return 32;
+    }
+    return 20;
+}
+
+bool list_git_sources(
+    const std::string &dir,
+    const std::vector<std::string> &extensions,
+    const std::vector<std::string> &exclude,
+    PathList &files,
+    std::vector<std::string> *watch
+) {
+    std::string root = std::filesystem::path(dir).lexically_normal().string();
+    while (root.size() > 1 && root.back() == '/') root.pop_back();
+
+    std::filesystem::path work_tree, git_dir;
+    if (!find_git_dir(std::filesystem::absolute(root), work_tree, git_dir)) return false;
+
+    std::string index_path = (git_dir / "index").string();
+    std::vector<GitIndexEntry> entries;
+    uint64_t index_mtime = 0;
+    if (!read_git_index(index_path, object_hash_size(git_dir), entries, &index_mtime)) return false;
+
+    // Index paths are relative to the work tree and use `/` throughout
+    std::string prefix = std::filesystem::absolute(root).lexically_relative(work_tree).string();
+    if (prefix == ".") prefix.clear();
+    if (!prefix.empty()) prefix += '/';
+
+    ExcludeMatcher matcher(root, exclude);
+    std::unordered_set<std::string_view> wanted(extensions.begin(), extensions.end());
+
+    PathList found;
+    std::unordered_set<std::string> dirs;
+    std::string path, parent;
+
+    // Index entries are sorted, so the files of a dir mostly follow each other and share its fd
+    int parent_fd = -1;
+    bool parent_open = false;
+
+    // Nothing was added to or removed from the dir since git wrote the index
+    bool parent_unchanged = false;
+    size_t conflicts = 0;
+
+    for (const auto &entry : entries) {
+        uint32_t type = entry.mode & MODE_TYPE;
+        if (type != MODE_REGULAR && type != MODE_SYMLINK) continue;
+        if (entry.path.compare(0, prefix.size(), prefix) != 0) continue;
+
+        std::string_view relative = std::string_view(entry.path).substr(prefix.size());
+        size_t slash = relative.rfind('/');
+        std::string_view name = relative.substr(slash + 1);
+        if (!wanted.count(extension_of(name)) || matcher.excludes_path(relative)) continue;
+
+        std::string_view entry_parent = slash == std::string_view::npos ? std::string_view() : relative.substr(0, slash);
+        if (!parent_open || entry_parent != parent) {
+            if (parent_fd >= 0) close(parent_fd);
+            parent = entry_parent;
+
+            path = root;
+            if (!parent.empty()) path += '/' + parent;
+
+            parent_fd = open(path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+            parent_open = true;
+            if (watch && parent_fd >= 0) dirs.insert(path);
+
+            struct stat st;
+            parent_unchanged = parent_fd >= 0 && fstat(parent_fd, &st) == 0 && mtime_of(st) < index_mtime;
+        }
+        if (parent_fd < 0) continue;
+
+        if (entry.stage != 0) {
+            if (conflicts++ == 0) std::cerr << "warning: " << entry.path << " has an unresolved merge conflict, building the work tree file" << std::endl;
+        }
+
+        // Racy like git has it, the file may have changed in the same tick the index was written
+        bool trusted = parent_unchanged && type == MODE_REGULAR && entry.stage == 0 && entry.mtime < index_mtime;
+
+        // Deleted from the work tree without telling git, or a symlink to anything but a file
+        struct stat st;
+        if (!trusted && (fstatat(parent_fd, name.data(), &st, 0) != 0 || !S_ISREG(st.st_mode))) continue;
+
+        path = root;
+        path += '/';
+        path += relative;
+        found.add(path);
+    }
+
+    if (parent_fd >= 0) close(parent_fd);
+
+    if (conflicts > 1) {
+        std::cerr << "note: " << conflicts - 1 << " more source files have merge conflicts" << std::endl;
+    }
+
+    found.sort();
+    files = std::move(found);
+
+    if (watch) {
+        watch->push_back(index_path);
+        watch->push_back(root);
+        for (const auto &parent : dirs) watch->push_back(parent);
+        std::sort(watch->begin(), watch->end());
+        watch->erase(std::unique(watch->begin(), watch->end()), watch->end());
+    }
+    return true;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "dir_walker.hpp"
+
+// Where the sources of a project come from
+enum class SourceDiscovery {
+    // Walking src_dir, which finds untracked files too
+    Walk,
+
+    // Only the files the git index tracks below src_dir, no dir is listed
+    GitIndex
+};
+
+// A file of the git index
+struct GitIndexEntry {
+    // Relative to the work tree
+    std::string path;
+
+    // From the stat data git cached, tells files, symlinks and submodules apart
+    uint32_t mode = 0;
+
+    // Nanoseconds, from the cached stat data too
+    uint64_t mtime = 0;
+
+    // 0, or 2 for our side of a conflict, the work tree file is built either way
+    uint32_t stage = 0;
+};
+
+// Reads a version 2, 3 or 4 index by mapping it. Of a conflict only our side
+// is kept, entries outside a sparse checkout are left out. `mtime` gets the
+// mtime of the index in nanoseconds when it is set. False when the index
+// can't be read or is split, then only part of the entries are in it.
+bool read_git_index(
+    const std::string &path,
+    size_t hash_size,
+    std::vector<GitIndexEntry> &entries,
+    uint64_t *mtime = nullptr
+);
+
+// Like walk_sources, but the regular files come from the index of the git
+// work tree `dir` is in. The stat data git cached stands in for a stat call
+// when the file's dir hasn't changed since the index was written and the
+// entry isn't racy, so only those files, symlinks and conflicted ones are
+// stat'ed, to drop the ones deleted from the work tree. A file deleted before
+// git last wrote the index but not staged is still listed. `watch` gets the
+// index and the dirs of the files, which change whenever a file is added or
+// removed. False when `dir` isn't in a work tree or its index can't be read.
+bool list_git_sources(
+    const std::string &dir,
+    const std::vector<std::string> &extensions,
+    const std::vector<std::string> &exclude,
+    PathList &files,
+    std::vector<std::string> *watch = nullptr
+);
@@ -0,0 +1,641 @@
+#include "graph.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <deque>
+#include <cstdlib>
+#include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "cache.hpp"
+#include "distributed.hpp"
+#include "executor.hpp"
+#include "hash.hpp"
+#include "sandbox.hpp"
+
+// A source turned away by busy workers this long is compiled locally instead
+static constexpr auto REMOTE_BUSY_LIMIT = std::chrono::seconds(30);
+
+// The clock file times are taken from, a file written later never gets an older mtime
+static uint64_t file_clock_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + now.tv_nsec;
+}
+
+size_t BuildGraph::add(Action action) {
+    m_Actions.push_back(std::move(action));
+    return m_Actions.size() - 1;
+}
+
+void BuildGraph::depend(size_t action, size_t on) {
+    m_Actions[action].deps.push_back(on);
+}
+
+Scheduler::Scheduler(BuildGraph &graph, BuildState &state, DepsLog &deps_log, size_t jobs)
+    : m_Graph(graph), m_State(state), m_DepsLog(deps_log), m_Jobs(jobs == 0 ? 1 : jobs) {}
+
+static inline bool is_tracked(const Action &action) {
+    return !action.outputs.empty()
+        && (action.kind == ActionKind::Compile
+            || action.kind == ActionKind::Archive
+            || action.kind == ActionKind::Link);
+}
+
+// Besides the command line, these change what gcc and clang produce
+static const char *const TOOLCHAIN_ENV[] = {
+    "CPATH", "C_INCLUDE_PATH", "CPLUS_INCLUDE_PATH", "LIBRARY_PATH",
+    "COMPILER_PATH", "GCC_EXEC_PREFIX", "SOURCE_DATE_EPOCH"
+};
+
+uint64_t toolchain_environment() {
+    static const uint64_t digest = []() {
+        Hasher hasher;
+        for (const char *name : TOOLCHAIN_ENV) {
+            const char *value = std::getenv(name);
+            hasher.update(value ? value : "");
+        }
+        return hasher.digest();
+    }();
+
+    return digest;
+}
+
+// The signature stored in the build state, an action reruns exactly when it changes
+static uint64_t hash_command(const Action &action) {
+    Hasher hasher;
+
+    // A probed tool is known by what it is, so finding the same compiler elsewhere in PATH changes nothing
+    if (action.toolchain && !action.argv.empty()) {
+        hasher.update_value(action.toolchain);
+    } else if (!action.argv.empty()) {
+        hasher.update(action.argv.front());
+    }
+
+    for (size_t i = 1; i < action.argv.size(); ++i) hasher.update(action.argv[i]);
+
+    // The paths in argv are relative to the cwd
+    hasher.update(action.cwd.string());
+    hasher.update_value(toolchain_environment());
+    return hasher.digest();
+}
+
+// The declared inputs of an action followed by the discovered ones, in a stable order
+static std::vector<std::string_view> collect_inputs(
+    const std::vector<std::string> &declared,
+    const std::vector<std::string_view> &discovered
+) {
+    std::vector<std::string_view> inputs;
+    std::unordered_set<std::string_view> seen;
+
+    for (const auto &input : declared) {
+        if (seen.insert(input).second) inputs.push_back(input);
+    }
+    for (const auto &input : discovered) {
+        if (seen.insert(input).second) inputs.push_back(input);
+    }
+
+    return inputs;
+}
+
+static std::vector<std::string> declared_inputs(const Action &action) {
+    std::vector<std::string> inputs;
+    for (const auto &input : action.inputs) inputs.push_back(input.string());
+    return inputs;
+}
+
+// With debug info every line number ends up in the object
+static bool emits_debug_info(const Action &action) {
+    for (size_t i = 1; i < action.argv.size(); ++i) {
+        const std::string &arg = action.argv[i];
+        if (arg.rfind("-g", 0) == 0 && arg != "-g0") return true;
+    }
+    return false;
+}
+
+uint64_t Scheduler::hash_inputs(const Action &action, const std::vector<std::string_view> &inputs) {
+    if (!m_Digests) return hash_input_stamps(inputs, m_StatCache);
+    return hash_input_contents(inputs, m_Generated, *m_Digests, m_Sources, emits_debug_info(action), m_StatCache);
+}
+
+bool Scheduler::up_to_date(const Action &action) {
+    if (!is_tracked(action)) return false;
+
+    std::string output = action.outputs.front().string();
+
+    BuildStateEntry entry;
+    if (!m_State.find(output, entry)) return false;
+
+    if (entry.command_hash != hash_command(action)) return false;
+
+    for (const auto &output : action.outputs) {
+        if (!stat_file(output.string(), m_StatCache).exists) return false;
+    }
+
+    std::vector<std::string_view> discovered;
+    if (!action.depfile.empty() && !m_DepsLog.find(output, discovered)) return false;
+
+    std::vector<std::string> declared = declared_inputs(action);
+    return entry.inputs_hash == hash_inputs(action, collect_inputs(declared, discovered));
+}
+
+void Scheduler::prefetch_stats() {
+    if (!m_StatCache) return;
+
+    std::vector<std::string> paths;
+    std::unordered_set<std::string> seen;
+    std::vector<std::string_view> discovered;
+
+    auto add = [&paths, &seen](std::string path) {
+        if (seen.insert(path).second) paths.push_back(std::move(path));
+    };
+
+    for (size_t id = 0; id < m_Graph.size(); ++id) {
+        const Action &action = m_Graph[id];
+        if (!is_tracked(action)) continue;
+
+        for (const auto &output : action.outputs) add(output.string());
+        for (const auto &input : action.inputs) add(input.string());
+
+        discovered.clear();
+        if (!action.depfile.empty() && m_DepsLog.find(action.outputs.front().string(), discovered)) {
+            for (const auto &header : discovered) add(std::string(header));
+        }
+    }
+
+    m_StatCache->prefetch(paths);
+}
+
+// Prefetched stat data of what an action rewrites is stale once it ran
+void Scheduler::invalidate_outputs(const Action &action) {
+    if (!m_StatCache) return;
+
+    // Shell commands may write anywhere
+    if (action.kind == ActionKind::Command) {
+        m_StatCache->clear();
+        return;
+    }
+
+    for (const auto &output : action.outputs) m_StatCache->invalidate(output.string());
+}
+
+std::vector<std::string> Scheduler::take_depfile(const Action &action) {
+    if (action.depfile.empty()) return {};
+
+    std::vector<std::string> headers = parse_depfile(action.depfile);
+    std::filesystem::remove(action.depfile);
+    return headers;
+}
+
+std::filesystem::path resolve_path(const Action &action, const std::string &path) {
+    std::filesystem::path resolved = path;
+    if (action.cwd.empty() || resolved.is_absolute()) return resolved;
+    return (action.cwd / resolved).lexically_normal();
+}
+
+// Fresh stat data of the declared inputs and the headers the last build read,
+// the prefetched stat data may be older than the build
+Scheduler::InputSnapshot Scheduler::snapshot_inputs(const Action &action) {
+    InputSnapshot snapshot;
+    snapshot.started = file_clock_ns();
+    if (!is_tracked(action)) return snapshot;
+
+    std::vector<std::string> declared = declared_inputs(action);
+    std::vector<std::string_view> discovered;
+    if (!action.depfile.empty()) m_DepsLog.find(action.outputs.front().string(), discovered);
+
+    std::string path;
+    for (const auto &input : collect_inputs(declared, discovered)) {
+        path.assign(input);
+        if (!m_Generated.count(path)) snapshot.stats.emplace(path, stat_file(path, nullptr));
+    }
+    return snapshot;
+}
+
+static bool same_stat(const FileStat &a, const FileStat &b) {
+    return a.exists == b.exists && a.inode == b.inode && a.size == b.size && a.mtime() == b.mtime();
+}
+
+// An input that changed since the snapshot may have been read half old and
+// half new, so the action isn't recorded. Headers it found for the first time
+// are only known to be unchanged when they are older than the action.
+bool Scheduler::record(const Action &action, const std::vector<std::string> &headers, const InputSnapshot &snapshot) {
+    if (!is_tracked(action)) return true;
+
+    std::string output = action.outputs.front().string();
+    std::vector<std::string> declared = declared_inputs(action);
+
+    // The deps log and the stamps need paths that hold from weld's cwd
+    std::vector<std::string> resolved;
+    resolved.reserve(headers.size());
+    for (const auto &header : headers) resolved.push_back(resolve_path(action, header).string());
+
+    if (!action.depfile.empty()) {
+        m_DepsLog.record(output, resolved);
+    }
+
+    std::vector<std::string_view> discovered(resolved.begin(), resolved.end());
+    std::vector<std::string_view> inputs = collect_inputs(declared, discovered);
+
+    // Outputs of other actions were written before it started
+    std::string path;
+    for (const auto &input : inputs) {
+        path.assign(input);
+        if (m_Generated.count(path)) continue;
+
+        FileStat st = stat_file(path, nullptr);
+        auto before = snapshot.stats.find(path);
+
+        // Written in the same clock tick the action started in, it may or may not have changed
+        if (before == snapshot.stats.end() && st.exists && st.mtime() >= snapshot.started) {
+            m_State.forget(output);
+            return false;
+        }
+
+        if (before != snapshot.stats.end() && !same_stat(st, before->second)) {
+            std::cerr << "warning: " << path << " changed while " << output << " was built, it's rebuilt next time" << std::endl;
+            m_State.forget(output);
+            return false;
+        }
+    }
+
+    BuildStateEntry entry;
+    entry.command_hash = hash_command(action);
+    entry.inputs_hash = hash_inputs(action, inputs);
+    m_State.record(output, entry);
+    return true;
+}
+
+void Scheduler::restore_from_cache(const Action &action, const CacheHit &hit, const InputSnapshot &snapshot) {
+    std::cout << action.start_message + "\n" + hit.diagnostics + action.finish_message + " (cached)\n" << std::flush;
+
+    record(action, hit.inputs, snapshot);
+}
+
+// Compiles and archives are looked up in the compile cache, links read too much nobody declares
+static inline bool is_cached(const Action &action) {
+    return action.kind == ActionKind::Compile || action.kind == ActionKind::Archive;
+}
+
+// Command actions run one shell command after another, everything else runs its argv
+static inline bool needs_process(const Action &action) {
+    return action.kind == ActionKind::Command ? !action.commands.empty() : !action.argv.empty();
+}
+
+static std::vector<std::string> process_argv(const Action &action, size_t command) {
+    if (action.kind == ActionKind::Command) {
+        return { "/bin/sh", "-c", action.commands[command] };
+    }
+    return action.argv;
+}
+
+bool Scheduler::run() {
+    size_t count = m_Graph.size();
+
+    m_Generated.clear();
+    for (size_t id = 0; id < count; ++id) {
+        if (!is_tracked(m_Graph[id])) continue;
+        for (const auto &output : m_Graph[id].outputs) m_Generated.insert(output.string());
+    }
+
+    prefetch_stats();
+
+    std::vector<std::vector<size_t>> dependents(count);
+    std::vector<size_t> pending(count, 0);
+
+    for (size_t id = 0; id < count; ++id) {
+        for (size_t dep : m_Graph[id].deps) {
+            dependents[dep].push_back(id);
+            ++pending[id];
+        }
+    }
+
+    // `ready` still has to be checked against the build state, `runnable` needs a job slot
+    std::deque<size_t> ready, runnable;
+    std::unordered_map<size_t, size_t> next_command;
+    std::unordered_map<size_t, std::string> outputs;
+
+    // Inputs that changed while their action ran aren't recorded
+    std::unordered_map<size_t, InputSnapshot> snapshots;
+
+    // Cache lookups may go over the network, so they run as executor tasks
+    std::unordered_map<size_t, CacheHit> lookups;
+
+    // Compiles on a worker are preprocessed in a local slot, then sent from the event loop.
+    // Sources a busy worker turned away wait in `resend` for the next free worker slot.
+    enum class RemotePhase { Preprocessing, Waiting, Sent };
+    struct RemoteCompile {
+        size_t worker = 0;
+        RemotePhase phase = RemotePhase::Preprocessing;
+        std::string source;
+        std::chrono::steady_clock::time_point busy_since;
+    };
+    std::unordered_map<size_t, RemoteCompile> remotes;
+    std::deque<size_t> resend;
+
+    // Compiles a worker couldn't do, they wait for a local slot like any other
+    std::unordered_set<size_t> local_only;
+
+    size_t remaining = count;
+    bool failed = false;
+
+    for (size_t id = 0; id < count; ++id) {
+        if (pending[id] == 0) ready.push_back(id);
+    }
+
+    Executor executor(m_Jobs);
+
+    auto finish = [&](size_t id) {
+        --remaining;
+        for (size_t next : dependents[id]) {
+            if (--pending[next] == 0) ready.push_back(next);
+        }
+    };
+
+    auto start = [&](size_t id, const std::vector<std::string> &argv) {
+        const Action &action = m_Graph[id];
+        std::string error;
+
+        // Shell commands keep running where weld was started
+        bool command_action = action.kind == ActionKind::Command;
+        std::filesystem::path cwd = command_action ? std::filesystem::path() : action.cwd;
+
+        // Headers the last build read stay visible, new ones have to be in an include dir
+        SandboxMounts mounts;
+        if (m_Sandbox && !command_action) {
+            std::vector<std::string_view> headers;
+            if (!action.depfile.empty()) m_DepsLog.find(action.outputs.front().string(), headers);
+            mounts = m_Sandbox->mounts(action, headers);
+        }
+
+        if (!executor.start(id, argv, error, cwd, mounts.root.empty() ? nullptr : &mounts)) {
+            std::cerr << error << std::flush;
+            failed = true;
+            return false;
+        }
+
+        return true;
+    };
+
+    auto run_locally = [&](size_t id, const char *reason) {
+        std::cerr << "warning: worker " << m_Distributed->address(remotes.at(id).worker) << " " << reason
+            << ", compiling locally" << std::endl;
+        remotes.erase(id);
+        local_only.insert(id);
+        runnable.push_front(id);
+    };
+
+    auto send = [&](size_t id) {
+        RemoteCompile &remote = remotes.at(id);
+        std::unique_ptr<HttpExchange> exchange = m_Distributed->send(remote.worker, m_Graph[id], remote.source);
+
+        if (!exchange) {
+            m_Distributed->release(remote.worker, true);
+            run_locally(id, "is not reachable");
+            return;
+        }
+
+        remote.phase = RemotePhase::Sent;
+        executor.start_exchange(id, std::move(exchange));
+    };
+
+    // Remote compiles are of no use once the build failed, preprocessing ones are
+    // left to finish like any local child unless they were killed
+    auto drop_remotes = [&](bool killed) {
+        executor.cancel_exchanges();
+        resend.clear();
+
+        for (auto it = remotes.begin(); it != remotes.end(); ) {
+            if (it->second.phase == RemotePhase::Preprocessing && !killed) {
+                ++it;
+                continue;
+            }
+
+            if (it->second.phase != RemotePhase::Waiting) m_Distributed->release(it->second.worker, false);
+            DistributedCompiler::take_preprocessed(m_Graph[it->first], nullptr);
+            it = remotes.erase(it);
+        }
+    };
+
+    while (true) {
+        while (!failed && !ready.empty()) {
+            size_t id = ready.front();
+            ready.pop_front();
+
+            const Action &action = m_Graph[id];
+
+            if (!needs_process(action) || up_to_date(action)) {
+                finish(id);
+                continue;
+            }
+
+            invalidate_outputs(action);
+            snapshots[id] = snapshot_inputs(action);
+
+            if (m_Cache && is_cached(action)) {
+                CacheHit &hit = lookups[id];
+                executor.start_task(id, [this, &action, &hit](std::string &) {
+                    return m_Cache->lookup(action, hit) ? 0 : 1;
+                });
+            } else {
+                runnable.push_back(id);
+            }
+        }
+
+        while (!failed && !resend.empty() && m_Distributed->acquire(remotes.at(resend.front()).worker)) {
+            size_t id = resend.front();
+            resend.pop_front();
+            send(id);
+        }
+
+        while (!failed && !runnable.empty() && executor.can_start()) {
+            size_t id = runnable.front();
+            const Action &action = m_Graph[id];
+
+            runnable.pop_front();
+            if (!action.start_message.empty() && !local_only.count(id)) {
+                std::cout << action.start_message + "\n" << std::flush;
+            }
+
+            // The old output may be a hardlink into the cache, never write through it.
+            // `ar r` would also keep members that were dropped since.
+            if (is_cached(action)) {
+                std::error_code ec;
+                std::filesystem::remove(action.outputs.front(), ec);
+            }
+
+            // Only preprocessing takes the local slot, the compile runs on the worker
+            size_t worker = 0;
+            bool distributed = m_Distributed && action.kind == ActionKind::Compile && !local_only.count(id)
+                && m_Distributed->accepts(action);
+            if (distributed && m_Distributed->acquire(worker)) {
+                remotes[id].worker = worker;
+                if (!start(id, DistributedCompiler::preprocess_argv(action))) {
+                    m_Distributed->release(worker, false);
+                    remotes.erase(id);
+                }
+                continue;
+            }
+
+            next_command[id] = 1;
+            start(id, process_argv(action, 0));
+        }
+
+        if (executor.running() == 0 && resend.empty()) break;
+
+        // Wakes up when a worker may have a slot again for the sources waiting on one
+        int timeout_ms = -1;
+        if (!resend.empty()) {
+            auto retry = m_Distributed->next_retry();
+            if (retry != std::chrono::steady_clock::time_point::max()) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(retry - std::chrono::steady_clock::now());
+                timeout_ms = static_cast<int>(std::max<long long>(left.count(), 1));
+            }
+        }
+
+        std::vector<Completion> completed;
+        executor.wait(completed, timeout_ms);
+
+        if (executor.interrupted()) {
+            std::cerr << "error: interrupted, stopping running actions" << std::endl;
+            executor.cancel();
+            drop_remotes(true);
+            failed = true;
+            break;
+        }
+
+        for (auto &completion : completed) {
+            size_t id = completion.id;
+            const Action &action = m_Graph[id];
+
+            if (auto lookup = lookups.find(id); lookup != lookups.end()) {
+                if (completion.exit_code == 0) {
+                    restore_from_cache(action, lookup->second, snapshots[id]);
+                    snapshots.erase(id);
+                    finish(id);
+                } else {
+                    runnable.push_back(id);
+                }
+                lookups.erase(lookup);
+                continue;
+            }
+
+            if (auto it = remotes.find(id); it != remotes.end()) {
+                RemoteCompile &remote = it->second;
+
+                if (remote.phase == RemotePhase::Preprocessing) {
+                    // A failed -E is reported like the failed compile it would have been
+                    bool preprocessed = completion.exit_code == 0 && !failed;
+                    bool taken = DistributedCompiler::take_preprocessed(action, preprocessed ? &remote.source : nullptr);
+
+                    if (preprocessed && taken) {
+                        send(id);
+                        continue;
+                    }
+
+                    m_Distributed->release(remote.worker, false);
+                    remotes.erase(it);
+                    if (failed) continue;
+
+                    if (preprocessed) {
+                        local_only.insert(id);
+                        runnable.push_front(id);
+                        continue;
+                    }
+                } else {
+                    HttpResponse response = { completion.exit_code, std::move(completion.output) };
+                    completion.output.clear();
+
+                    switch (m_Distributed->receive(remote.worker, action, response, completion.output, completion.exit_code)) {
+                        case RemoteOutcome::Done:
+                            remotes.erase(it);
+                            break;
+                        case RemoteOutcome::Busy:
+                            if (remote.busy_since == std::chrono::steady_clock::time_point()) {
+                                remote.busy_since = std::chrono::steady_clock::now();
+                            } else if (std::chrono::steady_clock::now() - remote.busy_since > REMOTE_BUSY_LIMIT) {
+                                run_locally(id, "stayed busy");
+                                continue;
+                            }
+
+                            remote.phase = RemotePhase::Waiting;
+                            resend.push_back(id);
+                            continue;
+                        case RemoteOutcome::Refused:
+                            run_locally(id, "refused the compile");
+                            continue;
+                        case RemoteOutcome::Failed:
+                            run_locally(id, "failed");
+                            continue;
+                    }
+                }
+            }
+
+            outputs[id] += completion.output;
+
+            m_Stats.actions += 1;
+            m_Stats.user_time += completion.usage.ru_utime.tv_sec + completion.usage.ru_utime.tv_usec / 1e6;
+            m_Stats.system_time += completion.usage.ru_stime.tv_sec + completion.usage.ru_stime.tv_usec / 1e6;
+            m_Stats.max_rss_kb = std::max(m_Stats.max_rss_kb, static_cast<long>(completion.usage.ru_maxrss));
+
+            bool ok = completion.exit_code == 0;
+
+            if (ok && action.kind == ActionKind::Command && next_command[id] < action.commands.size()) {
+                start(id, process_argv(action, next_command[id]++));
+                continue;
+            }
+
+            std::string output = std::move(outputs[id]);
+            outputs.erase(id);
+
+            // Print the whole output of an action at once, so parallel actions don't interleave
+            if (!output.empty()) {
+                (ok ? std::cout : std::cerr) << output << std::flush;
+            }
+
+            if (!ok) {
+                if (action.kind == ActionKind::Command) {
+                    std::cerr << "error: command `" << action.commands[next_command[id] - 1] << "` failed" << std::endl;
+                } else {
+                    std::cerr << "error: " << action.start_message << " failed" << std::endl;
+                    if (m_Sandbox) {
+                        std::string notes = explain_sandbox_failure(action, output);
+                        std::cerr << (notes.empty() ? "note: it ran sandboxed, files that aren't declared inputs don't exist for it\n" : notes)
+                            << std::flush;
+                    }
+                }
+                failed = true;
+                continue;
+            }
+
+            std::vector<std::string> headers = take_depfile(action);
+            bool recorded = record(action, headers, snapshots[id]);
+            snapshots.erase(id);
+
+            // Its inputs may not be the ones the object was built from
+            if (recorded && m_Cache && is_cached(action)) {
+                m_Cache->store(action, output, headers);
+            }
+
+            if (!action.finish_message.empty()) {
+                std::cout << action.finish_message + "\n" << std::flush;
+            }
+
+            finish(id);
+        }
+
+        if (failed) drop_remotes(false);
+    }
+
+    // Keep whatever finished, even when the build failed
+    m_State.save();
+
+    if (!failed && remaining != 0) {
+        std::cerr << "error: dependency cycle in build graph" << std::endl;
+        return false;
+    }
+
+    return !failed;
+}
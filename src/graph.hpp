@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "build_state.hpp"
+#include "deps_log.hpp"
+
+class CompileCache;
+class DistributedCompiler;
+class Sandbox;
+struct CacheHit;
+
+enum class ActionKind {
+    Compile,
+    Archive,
+    Link,
+    Command,
+    Phony
+};
+
+struct Action {
+    ActionKind kind = ActionKind::Phony;
+
+    // Printed when the action starts and when it finishes
+    std::string start_message, finish_message;
+
+    // Compile, Archive and Link run `argv`, Command runs each shell command in order
+    std::vector<std::string> argv;
+    std::vector<std::string> commands;
+
+    std::vector<std::filesystem::path> inputs, outputs;
+
+    // Where `argv` runs, its relative paths keep the command the same across checkouts.
+    // Empty runs it in weld's own working dir.
+    std::filesystem::path cwd;
+
+    // Identity of the compiler, linker or archiver, so replacing it in place reruns the action
+    uint64_t toolchain = 0;
+
+    // Compile only, the compiler writes the headers of the TU into `depfile`,
+    // which is moved into the deps log once the compile finished
+    std::string depfile;
+
+    // Actions that have to finish before this one can start
+    std::vector<size_t> deps;
+};
+
+class BuildGraph {
+public:
+    size_t add(Action action);
+    void depend(size_t action, size_t on);
+public:
+    inline Action &operator[](size_t id) { return m_Actions[id]; }
+    inline const Action &operator[](size_t id) const { return m_Actions[id]; }
+    inline size_t size() const { return m_Actions.size(); }
+private:
+    std::vector<Action> m_Actions;
+};
+
+// Paths the compiler reported for `action` are relative to its cwd
+std::filesystem::path resolve_path(const Action &action, const std::string &path);
+
+// Hash over the environment variables that change what the compiler produces
+uint64_t toolchain_environment();
+
+struct BuildStats {
+    // Summed over every child that ran, from wait4
+    size_t actions = 0;
+    double user_time = 0, system_time = 0;
+    long max_rss_kb = 0;
+};
+
+// Runs every action of a graph from a single event loop, an action becomes
+// ready as soon as all of its deps have finished. Actions whose recorded
+// state still matches are skipped.
+class Scheduler {
+public:
+    Scheduler(BuildGraph &graph, BuildState &state, DepsLog &deps_log, size_t jobs);
+public:
+    bool run();
+    inline const BuildStats &stats() const { return m_Stats; }
+
+    // Compiles are looked up in and stored to `cache` when set
+    inline void use_cache(CompileCache *cache) { m_Cache = cache; }
+
+    // Compiles run on remote workers when set, only their preprocessing takes a local job slot
+    inline void use_distributed(DistributedCompiler *distributed) { m_Distributed = distributed; }
+
+    // Outputs of other actions are compared by content, so one that was rebuilt
+    // byte-identical doesn't rerun what depends on it, like ninja's restat.
+    // Sources are compared as `sources` says.
+    inline void use_digests(DigestTable *digests, SourceCheck sources) {
+        m_Digests = digests;
+        m_Sources = sources;
+    }
+
+    // Compiles, archives and links run inside `sandbox` when set, shell commands never do
+    inline void use_sandbox(const Sandbox *sandbox) { m_Sandbox = sandbox; }
+
+    // The stat data of every input and output is fetched into `stats` before the
+    // first action is checked
+    inline void use_stat_cache(StatCache *stats) { m_StatCache = stats; }
+private:
+    void prefetch_stats();
+    void invalidate_outputs(const Action &action);
+    bool up_to_date(const Action &action);
+    uint64_t hash_inputs(const Action &action, const std::vector<std::string_view> &inputs);
+    // The inputs of an action as they were when it started
+    struct InputSnapshot {
+        uint64_t started = 0;
+        std::unordered_map<std::string, FileStat> stats;
+    };
+
+    InputSnapshot snapshot_inputs(const Action &action);
+    void restore_from_cache(const Action &action, const CacheHit &hit, const InputSnapshot &snapshot);
+    std::vector<std::string> take_depfile(const Action &action);
+    bool record(const Action &action, const std::vector<std::string> &headers, const InputSnapshot &snapshot);
+private:
+    BuildGraph &m_Graph;
+    BuildState &m_State;
+    DepsLog &m_DepsLog;
+    CompileCache *m_Cache = nullptr;
+    DistributedCompiler *m_Distributed = nullptr;
+    const Sandbox *m_Sandbox = nullptr;
+    DigestTable *m_Digests = nullptr;
+    SourceCheck m_Sources = SourceCheck::Stamps;
+    StatCache *m_StatCache = nullptr;
+
+    // Every output of a tracked action
+    std::unordered_set<std::string> m_Generated;
+    size_t m_Jobs;
+    BuildStats m_Stats;
+};
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+// FNV-1a, used for signatures of command lines and input stamps
+class Hasher {
+public:
+    inline Hasher &update(const void *data, size_t size) {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; ++i) {
+            m_Hash ^= bytes[i];
+            m_Hash *= 0x100000001b3ull;
+        }
+        return *this;
+    }
+
+    inline Hasher &update(std::string_view str) {
+        update(str.data(), str.size());
+        // Terminate every string so {"ab", "c"} and {"a", "bc"} differ
+        return update("\0", 1);
+    }
+
+    template<typename T>
+    inline Hasher &update_value(const T &value) {
+        return update(&value, sizeof(value));
+    }
+
+    inline uint64_t digest() const { return m_Hash; }
+private:
+    uint64_t m_Hash = 0xcbf29ce484222325ull;
+};
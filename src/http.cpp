@@ -0,0 +1,340 @@
+#include "http.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <strings.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "threadpool.hpp"
+
+static constexpr int HTTP_SERVER_BACKLOG = 128;
+static constexpr int HTTP_SERVER_TIMEOUT_SECONDS = 30;
+
+HttpClient::HttpClient(const std::string &url, int timeout_seconds) : m_Timeout(timeout_seconds) {
+    const std::string scheme = "http://";
+    std::string rest = url;
+
+    if (url.compare(0, scheme.size(), scheme) == 0) {
+        rest = url.substr(scheme.size());
+    } else if (url.find("://") != std::string::npos) {
+        return;
+    }
+
+    size_t slash = rest.find('/');
+    std::string authority = rest.substr(0, slash);
+    m_Prefix = slash == std::string::npos ? "" : rest.substr(slash);
+    while (!m_Prefix.empty() && m_Prefix.back() == '/') m_Prefix.pop_back();
+
+    size_t colon = authority.rfind(':');
+    if (colon == std::string::npos) {
+        m_Host = authority;
+        m_Port = "80";
+    } else {
+        m_Host = authority.substr(0, colon);
+        m_Port = authority.substr(colon + 1);
+    }
+
+    m_Address = m_Host + ":" + m_Port;
+}
+
+bool http_write_all(int fd, const std::string &data) {
+    size_t written = 0;
+
+    while (written < data.size()) {
+        ssize_t size = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+        if (size < 0 && errno == EINTR) continue;
+        if (size <= 0) return false;
+        written += size;
+    }
+
+    return true;
+}
+
+// Finds the end of the headers in `buffer`, false while they aren't complete
+static bool parse_head(const std::string &buffer, std::string &start_line, size_t &header_end, size_t &content_length) {
+    header_end = buffer.find("\r\n\r\n");
+    if (header_end == std::string::npos) return false;
+
+    start_line = buffer.substr(0, buffer.find("\r\n"));
+
+    content_length = 0;
+    size_t line_start = buffer.find("\r\n") + 2;
+
+    while (line_start < header_end) {
+        size_t line_end = buffer.find("\r\n", line_start);
+        std::string line = buffer.substr(line_start, line_end - line_start);
+        line_start = line_end + 2;
+
+        size_t colon = line.find(':');
+        if (colon != std::string::npos && strncasecmp(line.c_str(), "Content-Length", colon) == 0 && colon == 14) {
+            content_length = std::strtoull(line.c_str() + colon + 1, nullptr, 10);
+        }
+    }
+
+    return true;
+}
+
+// HTTP/1.1 200 OK, 0 when the line isn't a status line
+static int parse_status(const std::string &start_line) {
+    size_t space = start_line.find(' ');
+    return space == std::string::npos ? 0 : std::atoi(start_line.c_str() + space + 1);
+}
+
+bool http_read_message(int fd, std::string &start_line, std::string &body) {
+    std::string buffer;
+    char chunk[64 * 1024];
+    size_t header_end, content_length;
+
+    while (!parse_head(buffer, start_line, header_end, content_length)) {
+        ssize_t size = recv(fd, chunk, sizeof(chunk), 0);
+        if (size < 0 && errno == EINTR) continue;
+        if (size <= 0) return false;
+        buffer.append(chunk, size);
+    }
+
+    body = buffer.substr(header_end + 4);
+
+    while (body.size() < content_length) {
+        ssize_t size = recv(fd, chunk, sizeof(chunk), 0);
+        if (size < 0 && errno == EINTR) continue;
+        if (size <= 0) return false;
+        body.append(chunk, size);
+    }
+
+    body.resize(content_length);
+    return true;
+}
+
+HttpExchange::HttpExchange(int fd, std::string message, int timeout_seconds)
+    : m_Fd(fd), m_Message(std::move(message)),
+      m_Deadline(std::chrono::steady_clock::now() + std::chrono::seconds(timeout_seconds)) {}
+
+HttpExchange::~HttpExchange() {
+    if (m_Fd >= 0) close(m_Fd);
+}
+
+bool HttpExchange::advance() {
+    // A failed connect shows up as the first send failing
+    while (sending()) {
+        ssize_t size = send(m_Fd, m_Message.data() + m_Sent, m_Message.size() - m_Sent, MSG_NOSIGNAL);
+        if (size < 0 && errno == EINTR) continue;
+        if (size < 0 && errno == EAGAIN) return true;
+        if (size <= 0) return false;
+        m_Sent += size;
+    }
+
+    char chunk[64 * 1024];
+
+    while (true) {
+        ssize_t size = recv(m_Fd, chunk, sizeof(chunk), 0);
+        if (size < 0 && errno == EINTR) continue;
+        if (size < 0 && errno == EAGAIN) return true;
+        if (size <= 0) return false;
+        m_Buffer.append(chunk, size);
+
+        std::string start_line;
+        size_t header_end, content_length;
+        if (!parse_head(m_Buffer, start_line, header_end, content_length)) continue;
+        if (m_Buffer.size() - header_end - 4 < content_length) continue;
+
+        m_Response.status = parse_status(start_line);
+        m_Response.body = m_Buffer.substr(header_end + 4, content_length);
+        return false;
+    }
+}
+
+static int connect_to(const std::string &host, const std::string &port, int timeout_seconds) {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *addresses;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) return -1;
+
+    int fd = -1;
+    for (struct addrinfo *address = addresses; address; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (fd < 0) continue;
+
+        // A slow or dead server must never hang the build
+        struct timeval timeout = { timeout_seconds, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) break;
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(addresses);
+    return fd;
+}
+
+std::string HttpClient::format(const HttpRequest &request) const {
+    return request.method + " " + m_Prefix + request.path + " HTTP/1.1\r\n"
+        + "Host: " + m_Address + "\r\n"
+        + "Connection: close\r\n"
+        + "Content-Length: " + std::to_string(request.body.size()) + "\r\n\r\n";
+}
+
+bool HttpClient::request(const HttpRequest &request, HttpResponse &response) {
+    if (!valid()) return false;
+
+    int fd = connect_to(m_Host, m_Port, m_Timeout);
+    if (fd < 0) return false;
+
+    std::string start_line;
+    bool ok = http_write_all(fd, format(request))
+        && http_write_all(fd, request.body)
+        && http_read_message(fd, start_line, response.body);
+
+    close(fd);
+
+    response.status = ok ? parse_status(start_line) : 0;
+    return response.status != 0;
+}
+
+std::unique_ptr<HttpExchange> HttpClient::start(const HttpRequest &request) {
+    if (!valid()) return nullptr;
+
+    if (m_ResolvedSize == 0) {
+        struct addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        struct addrinfo *addresses;
+        if (getaddrinfo(m_Host.c_str(), m_Port.c_str(), &hints, &addresses) != 0) return nullptr;
+
+        std::memcpy(&m_Resolved, addresses->ai_addr, addresses->ai_addrlen);
+        m_ResolvedSize = addresses->ai_addrlen;
+        freeaddrinfo(addresses);
+    }
+
+    int fd = socket(m_Resolved.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) return nullptr;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&m_Resolved), m_ResolvedSize) != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return nullptr;
+    }
+
+    return std::make_unique<HttpExchange>(fd, format(request) + request.body, m_Timeout);
+}
+
+bool HttpClient::get(const std::string &path, std::string &body) {
+    HttpResponse response;
+    if (!request({ "GET", path, "" }, response) || response.status != 200) return false;
+
+    body = std::move(response.body);
+    return true;
+}
+
+bool HttpClient::put(const std::string &path, const std::string &body) {
+    HttpResponse response;
+    return request({ "PUT", path, body }, response)
+        && response.status >= 200 && response.status < 300;
+}
+
+bool HttpClient::post(const std::string &path, const std::string &body, HttpResponse &response) {
+    return request({ "POST", path, body }, response);
+}
+
+static const char *status_reason(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 503: return "Service Unavailable";
+        default: return "Internal Server Error";
+    }
+}
+
+int http_listen(const std::string &host, const std::string &port) {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo *addresses;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+        std::cerr << "error: invalid address " << host << ":" << port << std::endl;
+        return -1;
+    }
+
+    int server = -1;
+    for (struct addrinfo *address = addresses; address; address = address->ai_next) {
+        server = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (server < 0) continue;
+
+        int one = 1;
+        setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        if (bind(server, address->ai_addr, address->ai_addrlen) == 0 && listen(server, HTTP_SERVER_BACKLOG) == 0) break;
+
+        close(server);
+        server = -1;
+    }
+
+    freeaddrinfo(addresses);
+
+    if (server < 0) {
+        std::cerr << "error: failed to listen on " << host << ":" << port << std::endl;
+    }
+
+    return server;
+}
+
+static void handle_connection(int fd, const HttpHandler &handler) {
+    std::string start_line;
+    HttpRequest request;
+
+    request.fd = fd;
+
+    if (http_read_message(fd, start_line, request.body)) {
+        std::istringstream line(start_line);
+        line >> request.method >> request.path;
+
+        HttpResponse response;
+        handler(request, response);
+
+        std::string message = "HTTP/1.1 " + std::to_string(response.status) + " " + status_reason(response.status) + "\r\n"
+            + "Connection: close\r\n"
+            + "Content-Length: " + std::to_string(response.body.size()) + "\r\n\r\n";
+
+        if (http_write_all(fd, message)) http_write_all(fd, response.body);
+    }
+
+    close(fd);
+}
+
+void http_serve(int server, size_t threads, const HttpHandler &handler) {
+    ThreadPool pool(threads);
+
+    while (true) {
+        int fd = accept4(server, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) continue;
+
+        struct timeval timeout = { HTTP_SERVER_TIMEOUT_SECONDS, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        pool.enqueue([&handler, fd]() { handle_connection(fd, handler); });
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <sys/socket.h>
+
+struct HttpRequest {
+    std::string method, path;
+    std::string body;
+
+    // The connection on the server side, so long handlers notice the client going away
+    int fd = -1;
+};
+
+struct HttpResponse {
+    int status = 0;
+    std::string body;
+};
+
+// One request driven by an event loop instead of a blocking call. The socket
+// is non-blocking, `advance` is called whenever it's ready for `sending()`.
+class HttpExchange {
+public:
+    HttpExchange(int fd, std::string message, int timeout_seconds);
+    ~HttpExchange();
+
+    HttpExchange(const HttpExchange &) = delete;
+    HttpExchange &operator=(const HttpExchange &) = delete;
+public:
+    inline int fd() const { return m_Fd; }
+    inline bool sending() const { return m_Sent < m_Message.size(); }
+    inline std::chrono::steady_clock::time_point deadline() const { return m_Deadline; }
+
+    // Set once `advance` returned false, the status stays 0 when no response came back
+    inline HttpResponse &response() { return m_Response; }
+
+    // Sends or receives what the socket takes without blocking, false once the exchange is over
+    bool advance();
+private:
+    int m_Fd;
+    std::string m_Message, m_Buffer;
+    size_t m_Sent = 0;
+    std::chrono::steady_clock::time_point m_Deadline;
+    HttpResponse m_Response;
+};
+
+// Just enough HTTP/1.1 for GET and PUT of blobs, one request per connection
+class HttpClient {
+public:
+    // `url` looks like http://host:port/prefix, a bare host:port works as well
+    HttpClient(const std::string &url, int timeout_seconds = 10);
+public:
+    inline bool valid() const { return !m_Host.empty(); }
+    inline const std::string &address() const { return m_Address; }
+
+    bool get(const std::string &path, std::string &body);
+    bool put(const std::string &path, const std::string &body);
+
+    // Fails only when no response came back, any status is handed to the caller
+    bool post(const std::string &path, const std::string &body, HttpResponse &response);
+
+    // Connects without blocking, nullptr when the server can't be reached. The address is
+    // resolved by the first call and reused, so only one thread may start exchanges.
+    std::unique_ptr<HttpExchange> start(const HttpRequest &request);
+private:
+    bool request(const HttpRequest &request, HttpResponse &response);
+    std::string format(const HttpRequest &request) const;
+private:
+    std::string m_Host, m_Port, m_Prefix, m_Address;
+    int m_Timeout;
+
+    struct sockaddr_storage m_Resolved = {};
+    socklen_t m_ResolvedSize = 0;
+};
+
+// Answers a single request, the connection is closed afterwards
+using HttpHandler = std::function<void(const HttpRequest &request, HttpResponse &response)>;
+
+// Returns the listening socket, or -1 after printing an error
+int http_listen(const std::string &host, const std::string &port);
+
+// Hands every connection on `server` to `handler` on one of `threads` threads, never returns
+[[noreturn]] void http_serve(int server, size_t threads, const HttpHandler &handler);
+
+// Reads one request or response from `fd`, headers up to the blank line and `Content-Length` bytes of body
+bool http_read_message(int fd, std::string &start_line, std::string &body);
+bool http_write_all(int fd, const std::string &data);
@@ -1,20 +1,26 @@
+#include "cache.hpp"
+#include "cache_server.hpp"
 #include "command.hpp"
+#include "options.hpp"
 #include "toml_reader.hpp"
 #include "weld.hpp"
+#include "worker.hpp"
 #include <cstdlib>
 #include <filesystem>
+#include <sstream>
+#include <thread>
 
-void build_project(TOMLData data) {
+void build_project(const TOMLData &data, const BuildOptions &options) {
     if (data.toolset == "gcc" || data.toolset == "g++") {
-        build_project_gnuc(data);
+        build_project_gnuc(data, options);
     } else {
         std::cerr << "error: invalid toolset in " + data.project_name << std::endl;
         exit(1);
     }
 }
 
-void build_workspace(TOMLData data) {
-    build_workspace_gnuc(data);
+void build_workspace(const TOMLData &data, const BuildOptions &options) {
+    build_workspace_gnuc(data, options);
 }
 
 char *shift(int &argc, char ***argv) {
@@ -23,16 +29,237 @@ char *shift(int &argc, char ***argv) {
     return *(*argv)++;
 }
 
+// Sizes like 500M or 10G, plain numbers are bytes
+uint64_t parse_size(const std::string &value) {
+    char *end;
+    uint64_t size = std::strtoull(value.c_str(), &end, 10);
+    
+    switch (*end) {
+        case 'K': case 'k': size <<= 10; ++end; break;
+        case 'M': case 'm': size <<= 20; ++end; break;
+        case 'G': case 'g': size <<= 30; ++end; break;
+        case 'T': case 't': size <<= 40; ++end; break;
+    }
+    
+    if (end == value.c_str() || *end != '\0') {
+        std::cerr << "error: invalid size `" << value << "`" << std::endl;
+        exit(1);
+    }
+    
+    return size;
+}
+
+CacheLimits cache_limits_from_env() {
+    CacheLimits limits;
+    
+    if (const char *size = std::getenv("WELD_CACHE_MAX_SIZE"); size && *size) {
+        limits.max_size = parse_size(size);
+    }
+    if (const char *entries = std::getenv("WELD_CACHE_MAX_ENTRIES"); entries && *entries) {
+        limits.max_entries = std::strtoull(entries, nullptr, 10);
+    }
+    
+    return limits;
+}
+
+BuildOptions parse_build_options(int &argc, char ***argv) {
+    BuildOptions options;
+    
+    if (const char *cache = std::getenv("WELD_CACHE"); cache && std::string(cache) == "1") {
+        options.cache = true;
+    }
+    if (const char *hardlinks = std::getenv("WELD_CACHE_HARDLINKS"); hardlinks && std::string(hardlinks) == "1") {
+        options.cache_hardlinks = true;
+    }
+    options.cache_dir = CompileCache::default_dir();
+    
+    auto parse_backend = [&options](const std::string &backend) {
+        if (backend == "files") {
+            options.cache_backend = CacheBackend::Files;
+        } else if (backend == "pack") {
+            options.cache_backend = CacheBackend::Pack;
+        } else {
+            std::cerr << "error: invalid cache backend `" << backend << "`" << std::endl;
+            exit(1);
+        }
+    };
+    
+    if (const char *backend = std::getenv("WELD_CACHE_BACKEND"); backend && *backend) {
+        parse_backend(backend);
+    }
+    
+    auto parse_sources = [&options](const std::string &sources) {
+        if (sources == "walk") {
+            options.sources = SourceDiscovery::Walk;
+        } else if (sources == "git") {
+            options.sources = SourceDiscovery::GitIndex;
+        } else {
+            std::cerr << "error: invalid source discovery `" << sources << "`" << std::endl;
+            exit(1);
+        }
+    };
+    
+    if (const char *sources = std::getenv("WELD_SOURCES"); sources && *sources) {
+        parse_sources(sources);
+    }
+    
+    auto parse_stat_batching = [&options](const std::string &batching) {
+        if (batching == "auto") {
+            options.stat_batching = StatBatching::Auto;
+        } else if (batching == "io-uring") {
+            options.stat_batching = StatBatching::IoUring;
+        } else if (batching == "threads") {
+            options.stat_batching = StatBatching::Threads;
+        } else if (batching == "off") {
+            options.stat_batching = StatBatching::Off;
+        } else {
+            std::cerr << "error: invalid stat batching `" << batching << "`" << std::endl;
+            exit(1);
+        }
+    };
+    
+    if (const char *batching = std::getenv("WELD_STAT_BATCHING"); batching && *batching) {
+        parse_stat_batching(batching);
+    }
+    options.cache_limits = cache_limits_from_env();
+    
+    // Remote entries are restored through the local cache, so it's needed too
+    if (const char *remote = std::getenv("WELD_REMOTE_CACHE"); remote && *remote) {
+        options.cache = true;
+        options.remote_cache = remote;
+    }
+    
+    auto split_workers = [&options](const std::string &list) {
+        std::stringstream workers(list);
+        for (std::string worker; std::getline(workers, worker, ','); ) {
+            if (!worker.empty()) options.workers.push_back(worker);
+        }
+    };
+    
+    if (const char *workers = std::getenv("WELD_WORKERS")) {
+        split_workers(workers);
+    }
+    
+    if (const char *digests = std::getenv("WELD_CONTENT_DIGESTS"); digests && std::string(digests) == "1") {
+        options.content_digests = true;
+    }
+    
+    if (const char *tokens = std::getenv("WELD_TOKEN_FINGERPRINTS"); tokens && std::string(tokens) == "1") {
+        options.token_fingerprints = true;
+    }
+    
+    if (const char *sandbox = std::getenv("WELD_SANDBOX"); sandbox && std::string(sandbox) == "1") {
+        options.sandbox = true;
+    }
+    
+    while (argc > 0 && (*argv)[0][0] == '-') {
+        std::string flag = shift(argc, argv);
+        
+        if (flag == "-j" || flag == "--jobs") {
+            if (argc < 1) {
+                std::cerr << "error: missing value for `" << flag << "`" << std::endl;
+                exit(1);
+            }
+            options.jobs = std::strtoul(shift(argc, argv), nullptr, 10);
+        } else if (flag == "--cache") {
+            options.cache = true;
+        } else if (flag == "--no-cache") {
+            options.cache = false;
+        } else if (flag == "--cache-hardlinks") {
+            options.cache_hardlinks = true;
+        } else if (flag == "--no-cache-hardlinks") {
+            options.cache_hardlinks = false;
+        } else if (flag == "--content-digests") {
+            options.content_digests = true;
+        } else if (flag == "--no-content-digests") {
+            options.content_digests = false;
+        } else if (flag == "--token-fingerprints") {
+            options.token_fingerprints = true;
+        } else if (flag == "--no-token-fingerprints") {
+            options.token_fingerprints = false;
+        } else if (flag == "--sandbox") {
+            options.sandbox = true;
+        } else if (flag == "--no-sandbox") {
+            options.sandbox = false;
+        } else if (flag == "--sources") {
+            if (argc < 1) {
+                std::cerr << "error: missing value for `" << flag << "`" << std::endl;
+                exit(1);
+            }
+            parse_sources(shift(argc, argv));
+        } else if (flag == "--stat-batching") {
+            if (argc < 1) {
+                std::cerr << "error: missing value for `" << flag << "`" << std::endl;
+                exit(1);
+            }
+            parse_stat_batching(shift(argc, argv));
+        } else if (flag == "--cache-backend") {
+            if (argc < 1) {
+                std::cerr << "error: missing value for `" << flag << "`" << std::endl;
+                exit(1);
+            }
+            parse_backend(shift(argc, argv));
+        } else if (flag == "--cache-max-size" || flag == "--cache-max-entries") {
+            if (argc < 1) {
+                std::cerr << "error: missing value for `" << flag << "`" << std::endl;
+                exit(1);
+            }
+            
+            std::string value = shift(argc, argv);
+            if (flag == "--cache-max-size") {
+                options.cache_limits.max_size = parse_size(value);
+            } else {
+                options.cache_limits.max_entries = std::strtoull(value.c_str(), nullptr, 10);
+            }
+        } else if (flag == "--remote-cache") {
+            if (argc < 1) {
+                std::cerr << "error: missing value for `" << flag << "`" << std::endl;
+                exit(1);
+            }
+            options.cache = true;
+            options.remote_cache = shift(argc, argv);
+        } else if (flag == "--workers") {
+            if (argc < 1) {
+                std::cerr << "error: missing value for `" << flag << "`" << std::endl;
+                exit(1);
+            }
+            options.workers.clear();
+            split_workers(shift(argc, argv));
+        } else if (flag == "--remote-cache-mode") {
+            if (argc < 1) {
+                std::cerr << "error: missing value for `" << flag << "`" << std::endl;
+                exit(1);
+            }
+            
+            std::string mode = shift(argc, argv);
+            if (mode == "read-only") {
+                options.remote_cache_mode = RemoteCacheMode::ReadOnly;
+            } else if (mode == "read-write") {
+                options.remote_cache_mode = RemoteCacheMode::ReadWrite;
+            } else {
+                std::cerr << "error: invalid remote cache mode `" << mode << "`" << std::endl;
+                exit(1);
+            }
+        } else {
+            std::cerr << "error: invalid flag `" << flag << "`" << std::endl;
+            exit(1);
+        }
+    }
+    
+    return options;
+}
+
 int main(int argc, char **argv) {
     char *program = shift(argc, &argv);
     
-    if (argc < 1) {
-        TOMLReader toml_reader(std::filesystem::current_path());
-        if (toml_reader.get_data().is_workspace) {
-            TOMLData data = toml_reader.get_data();
-            build_workspace(data);
+    if (argc < 1 || argv[0][0] == '-') {
+        BuildOptions options = parse_build_options(argc, &argv);
+        
+        const TOMLData &data = load_manifest(std::filesystem::current_path());
+        if (data.is_workspace) {
+            build_workspace(data, options);
         } else {
-            build_project(toml_reader.get_data());
+            build_project(data, options);
         }
     } else {
         if (argc < 1) {
@@ -42,15 +269,15 @@ int main(int argc, char **argv) {
         char *subcommand = shift(argc, &argv);
         
         if (std::string(subcommand) == "install") {
-            TOMLReader toml_reader(std::filesystem::current_path());
-            TOMLData data = toml_reader.get_data();
+            BuildOptions options = parse_build_options(argc, &argv);
+            const TOMLData &data = load_manifest(std::filesystem::current_path());
             
             if (data.can_install) {
-                if (toml_reader.get_data().is_workspace) {
+                if (data.is_workspace) {
                     std::cout << "error: install for workspaces isn't supported yet!" << std::endl;
                     exit(1);
                 } else {
-                    build_project(data);
+                    build_project(data, options);
                 }
                 
                 #ifdef __linux__
@@ -87,5 +314,116 @@ int main(int argc, char **argv) {
             
             create_project(toolset, project_name);
         }
+        
+        if (std::string(subcommand) == "cache") {
+            if (argc < 1) {
+                std::cerr << "error: missing cache command!" << std::endl;
+                exit(1);
+            }
+            
+            std::string command = shift(argc, &argv);
+            
+            if (command == "stats") {
+                CompileCache::print_stats(CompileCache::default_dir());
+            } else if (command == "gc") {
+                CacheLimits limits = cache_limits_from_env();
+                
+                while (argc > 0 && argv[0][0] == '-') {
+                    std::string flag = shift(argc, &argv);
+                    
+                    if (argc < 1) {
+                        std::cerr << "error: missing value for `" << flag << "`" << std::endl;
+                        exit(1);
+                    }
+                    
+                    if (flag == "--max-size") {
+                        limits.max_size = parse_size(shift(argc, &argv));
+                    } else if (flag == "--max-entries") {
+                        limits.max_entries = std::strtoull(shift(argc, &argv), nullptr, 10);
+                    } else {
+                        std::cerr << "error: invalid flag `" << flag << "`" << std::endl;
+                        exit(1);
+                    }
+                }
+                
+                if (!limits.bounded()) {
+                    std::cerr << "error: missing cache limit, pass --max-size or --max-entries" << std::endl;
+                    exit(1);
+                }
+                
+                GarbageStats stats = CompileCache::collect_garbage(CompileCache::default_dir(), limits);
+                std::printf(
+                    "Removed %llu entries (%.1f MB), %llu objects in %.1f MB left\n",
+                    static_cast<unsigned long long>(stats.removed), stats.freed / (1024.0 * 1024.0),
+                    static_cast<unsigned long long>(stats.entries), stats.size / (1024.0 * 1024.0)
+                );
+            } else {
+                std::cerr << "error: invalid cache command `" << command << "`" << std::endl;
+                exit(1);
+            }
+        }
+        
+        if (std::string(subcommand) == "cache-server") {
+            std::string host = "127.0.0.1";
+            std::string port = "8377";
+            
+            while (argc > 0 && argv[0][0] == '-') {
+                std::string flag = shift(argc, &argv);
+                
+                if (argc < 1) {
+                    std::cerr << "error: missing value for `" << flag << "`" << std::endl;
+                    exit(1);
+                }
+                
+                if (flag == "--host") {
+                    host = shift(argc, &argv);
+                } else if (flag == "--port") {
+                    port = shift(argc, &argv);
+                } else {
+                    std::cerr << "error: invalid flag `" << flag << "`" << std::endl;
+                    exit(1);
+                }
+            }
+            
+            if (argc < 1) {
+                std::cerr << "error: missing cache server dir!" << std::endl;
+                exit(1);
+            }
+            
+            return run_cache_server(shift(argc, &argv), host, port);
+        }
+        
+        if (std::string(subcommand) == "worker") {
+            std::string host = "127.0.0.1";
+            std::string port = "8378";
+            size_t slots = std::thread::hardware_concurrency();
+            
+            while (argc > 0 && argv[0][0] == '-') {
+                std::string flag = shift(argc, &argv);
+                
+                if (argc < 1) {
+                    std::cerr << "error: missing value for `" << flag << "`" << std::endl;
+                    exit(1);
+                }
+                
+                if (flag == "--host") {
+                    host = shift(argc, &argv);
+                } else if (flag == "--port") {
+                    port = shift(argc, &argv);
+                } else if (flag == "-j" || flag == "--jobs") {
+                    slots = std::strtoul(shift(argc, &argv), nullptr, 10);
+                } else {
+                    std::cerr << "error: invalid flag `" << flag << "`" << std::endl;
+                    exit(1);
+                }
+            }
+            
+            if (slots == 0) {
+                std::cerr << "error: a worker needs at least one job" << std::endl;
+                exit(1);
+            }
+            
+            return run_worker(host, port, slots);
+        }
     }
 }
\ No newline at end of file
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cache.hpp"
+#include "git_index.hpp"
+#include "remote_cache.hpp"
+#include "stat_batch.hpp"
+
+// Settings of a single weld invocation, from command line flags and the environment
+struct BuildOptions {
+    size_t jobs = std::thread::hardware_concurrency();
+
+    // Local compile cache, `--cache` or WELD_CACHE=1
+    bool cache = false;
+    std::filesystem::path cache_dir;
+    CacheBackend cache_backend = CacheBackend::Files;
+
+    // Hardlink cache hits that can't be reflinked instead of copying them, `--cache-hardlinks`
+    // or WELD_CACHE_HARDLINKS=1. The restored objects are read-only then, since they are the cache entry.
+    bool cache_hardlinks = false;
+
+    // `--cache-max-size 10G` and `--cache-max-entries N`, or WELD_CACHE_MAX_SIZE and WELD_CACHE_MAX_ENTRIES
+    CacheLimits cache_limits;
+
+    // Shared cache server, `--remote-cache URL` or WELD_REMOTE_CACHE
+    std::string remote_cache;
+    RemoteCacheMode remote_cache_mode = RemoteCacheMode::ReadWrite;
+
+    // `weld worker` addresses to compile on, `--workers host:port,...` or WELD_WORKERS
+    std::vector<std::string> workers;
+
+    // Compare inputs by content instead of mtime, `--content-digests` or WELD_CONTENT_DIGESTS=1
+    bool content_digests = false;
+
+    // Compare sources and headers by their tokens, so comment and whitespace edits rebuild
+    // nothing, `--token-fingerprints` or WELD_TOKEN_FINGERPRINTS=1
+    bool token_fingerprints = false;
+
+    // Where sources are found, `--sources walk|git` or WELD_SOURCES
+    SourceDiscovery sources = SourceDiscovery::Walk;
+
+    // How inputs are stat'ed before actions are checked,
+    // `--stat-batching auto|io-uring|threads|off` or WELD_STAT_BATCHING
+    StatBatching stat_batching = StatBatching::Auto;
+
+    // Run compiles and links in a namespace sandbox, `--sandbox` or WELD_SANDBOX=1
+    bool sandbox = false;
+};
@@ -0,0 +1,606 @@
+#include "pack_store.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compress.hpp"
+
+static constexpr char INDEX_MAGIC[8] = { 'W', 'E', 'L', 'D', 'P', 'I', 'D', 'X' };
+static constexpr char SEGMENT_MAGIC[8] = { 'W', 'E', 'L', 'D', 'P', 'A', 'C', 'K' };
+static constexpr uint32_t PACK_VERSION = 1;
+
+// "WREC", in front of every blob so the index can be rebuilt from the segments
+static constexpr uint32_t RECORD_MAGIC = 0x43455257;
+
+static constexpr uint64_t SEGMENT_LIMIT = 256ull << 20;
+static constexpr uint64_t INITIAL_CAPACITY = 1 << 12;
+static constexpr uint8_t FLAG_COMPRESSED = 1;
+
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t active_segment;
+    uint64_t capacity, count;
+};
+
+// A slot is free while `kind` is 0, it is set last when a blob is published
+struct PackStore::Slot {
+    uint64_t digest;
+    uint64_t offset;
+    uint32_t segment;
+    uint32_t size, stored_size;
+    uint8_t flags, kind;
+    uint16_t reserved;
+};
+
+struct SegmentHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct RecordHeader {
+    uint32_t magic;
+    uint8_t kind, flags;
+    uint16_t reserved;
+    uint32_t size, stored_size;
+    uint64_t digest;
+};
+
+static inline IndexHeader *index_header(char *data) {
+    return reinterpret_cast<IndexHeader *>(data);
+}
+
+template<typename Slot>
+static inline Slot *index_slots(char *data) {
+    return reinterpret_cast<Slot *>(data + sizeof(IndexHeader));
+}
+
+static inline uint64_t probe_start(char kind, uint64_t digest, uint64_t capacity) {
+    return (digest ^ (static_cast<uint8_t>(kind) * 0x9e3779b97f4a7c15ull)) & (capacity - 1);
+}
+
+static uint64_t index_capacity(uint64_t entries) {
+    uint64_t capacity = INITIAL_CAPACITY;
+    while (capacity * 7 < entries * 10) capacity *= 2;
+    return capacity * 2;
+}
+
+static std::string segment_name(uint32_t segment) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%06u.pack", segment);
+    return buffer;
+}
+
+template<typename Slot>
+static void place(char *data, const Slot &slot) {
+    IndexHeader *header = index_header(data);
+    Slot *slots = index_slots<Slot>(data);
+
+    for (uint64_t i = probe_start(slot.kind, slot.digest, header->capacity); ; i = (i + 1) & (header->capacity - 1)) {
+        Slot &target = slots[i];
+        uint8_t kind = __atomic_load_n(&target.kind, __ATOMIC_ACQUIRE);
+
+        if (kind == slot.kind && target.digest == slot.digest) return;
+        if (kind != 0) continue;
+
+        Slot copy = slot;
+        copy.kind = 0;
+        std::memcpy(&target, &copy, sizeof(Slot));
+        __atomic_store_n(&target.kind, slot.kind, __ATOMIC_RELEASE);
+
+        ++header->count;
+        return;
+    }
+}
+
+static bool write_all(int fd, const std::string &data, uint64_t offset) {
+    size_t written = 0;
+
+    while (written < data.size()) {
+        ssize_t size = pwrite(fd, data.data() + written, data.size() - written, offset + written);
+        if (size <= 0) return false;
+        written += size;
+    }
+
+    return true;
+}
+
+// Opens a segment for appending and returns its end, new segments get their header first
+static int open_segment(const std::filesystem::path &path, uint64_t &end) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    end = st.st_size;
+    if (end == 0) {
+        SegmentHeader header = {};
+        std::memcpy(header.magic, SEGMENT_MAGIC, sizeof(header.magic));
+        header.version = PACK_VERSION;
+
+        if (!write_all(fd, std::string(reinterpret_cast<const char *>(&header), sizeof(header)), 0)) {
+            close(fd);
+            return -1;
+        }
+        end = sizeof(header);
+    }
+
+    return fd;
+}
+
+static std::string make_record(char kind, uint64_t digest, uint8_t flags, uint32_t size, const std::string &stored) {
+    RecordHeader header = {};
+    header.magic = RECORD_MAGIC;
+    header.kind = kind;
+    header.flags = flags;
+    header.size = size;
+    header.stored_size = stored.size();
+    header.digest = digest;
+
+    std::string record(reinterpret_cast<const char *>(&header), sizeof(header));
+    record += stored;
+    return record;
+}
+
+PackStore::PackStore(std::filesystem::path dir)
+    : m_Dir(std::move(dir)) {
+    std::error_code ec;
+    std::filesystem::create_directories(m_Dir, ec);
+
+    m_LockFd = open((m_Dir / "lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (!map_index() && m_LockFd >= 0) {
+        lock();
+        if (!map_index()) rebuild_index();
+        unlock();
+    }
+}
+
+PackStore::~PackStore() {
+    unmap(m_Index);
+    for (auto &[segment, mapping] : m_Segments) unmap(mapping);
+    if (m_LockFd >= 0) close(m_LockFd);
+}
+
+void PackStore::lock() {
+    flock(m_LockFd, LOCK_EX);
+}
+
+void PackStore::unlock() {
+    flock(m_LockFd, LOCK_UN);
+}
+
+void PackStore::unmap(Mapping &mapping) {
+    if (mapping.data) munmap(mapping.data, mapping.size);
+    if (mapping.fd >= 0) close(mapping.fd);
+    mapping = {};
+}
+
+bool PackStore::map_index() {
+    unmap(m_Index);
+
+    std::filesystem::path path = m_Dir / "index";
+    bool writable = true;
+
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0 && errno == EACCES) {
+        // A cache on a read-only mount can still be looked up
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        writable = false;
+    }
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(IndexHeader)) {
+        close(fd);
+        return false;
+    }
+
+    int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *data = mmap(nullptr, st.st_size, protection, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    m_Index = { fd, static_cast<char *>(data), static_cast<size_t>(st.st_size) };
+    m_IndexInode = st.st_ino;
+
+    IndexHeader *header = index_header(m_Index.data);
+    bool valid = std::memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) == 0
+        && header->version == PACK_VERSION
+        && header->capacity != 0 && (header->capacity & (header->capacity - 1)) == 0
+        && m_Index.size == sizeof(IndexHeader) + header->capacity * sizeof(Slot);
+
+    if (!valid) unmap(m_Index);
+    return valid;
+}
+
+bool PackStore::index_replaced() {
+    struct stat st;
+    return stat((m_Dir / "index").c_str(), &st) != 0 || st.st_ino != m_IndexInode;
+}
+
+const PackStore::Slot *PackStore::find(char kind, uint64_t digest) const {
+    if (!m_Index.data) return nullptr;
+
+    IndexHeader *header = index_header(m_Index.data);
+    const Slot *slots = index_slots<Slot>(m_Index.data);
+
+    for (uint64_t i = probe_start(kind, digest, header->capacity), probes = 0; probes < header->capacity; i = (i + 1) & (header->capacity - 1), ++probes) {
+        uint8_t slot_kind = __atomic_load_n(&slots[i].kind, __ATOMIC_ACQUIRE);
+
+        if (slot_kind == 0) return nullptr;
+        if (slot_kind == static_cast<uint8_t>(kind) && slots[i].digest == digest) return &slots[i];
+    }
+
+    return nullptr;
+}
+
+bool PackStore::map_segment(uint32_t segment, uint64_t end) {
+    Mapping &mapping = m_Segments[segment];
+    if (mapping.data && mapping.size >= end) return true;
+
+    // Segments only grow, so a mapping that's too short is simply redone
+    unmap(mapping);
+
+    int fd = open((m_Dir / segment_name(segment)).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < end) {
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    mapping = { fd, static_cast<char *>(data), static_cast<size_t>(st.st_size) };
+    return true;
+}
+
+bool PackStore::read_record(const Slot &slot, std::string &stored) {
+    if (!map_segment(slot.segment, slot.offset + sizeof(RecordHeader) + slot.stored_size)) return false;
+
+    const char *data = m_Segments[slot.segment].data + slot.offset;
+    RecordHeader header;
+    std::memcpy(&header, data, sizeof(header));
+
+    if (header.magic != RECORD_MAGIC || header.digest != slot.digest || header.kind != slot.kind
+        || header.stored_size != slot.stored_size || header.size != slot.size) {
+        return false;
+    }
+
+    stored.assign(data + sizeof(header), header.stored_size);
+    return true;
+}
+
+bool PackStore::get(char kind, uint64_t digest, std::string &blob) {
+    Slot slot;
+    std::string stored;
+
+    {
+        std::lock_guard<std::mutex> guard(m_Mutex);
+        bool found = false;
+
+        for (int attempt = 0; attempt < 2 && !found; ++attempt) {
+            const Slot *entry = find(kind, digest);
+            if (entry) {
+                slot = *entry;
+                found = read_record(slot, stored);
+            }
+
+            // Another process may have grown or compacted the index since it was mapped
+            if (!found && (attempt > 0 || !index_replaced() || !map_index())) return false;
+        }
+
+        if (!found) return false;
+    }
+
+    if (!(slot.flags & FLAG_COMPRESSED)) {
+        blob = std::move(stored);
+        return true;
+    }
+
+    return decompress_block(stored, slot.size, blob);
+}
+
+bool PackStore::contains(char kind, uint64_t digest) {
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    if (find(kind, digest)) return true;
+    return index_replaced() && map_index() && find(kind, digest);
+}
+
+// Fills a fresh index at a temporary path and puts it in place of the old one
+template<typename Slot, typename Fill>
+static bool replace_index(const std::filesystem::path &dir, uint64_t capacity, uint32_t active_segment, Fill fill) {
+    std::filesystem::path path = dir / "index", tmp_path = dir / ("index.tmp." + std::to_string(getpid()));
+
+    int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+
+    size_t size = sizeof(IndexHeader) + capacity * sizeof(Slot);
+    void *data = ftruncate(fd, size) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        std::filesystem::remove(tmp_path);
+        return false;
+    }
+
+    char *index = static_cast<char *>(data);
+    IndexHeader *header = index_header(index);
+    std::memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+    header->version = PACK_VERSION;
+    header->active_segment = active_segment;
+    header->capacity = capacity;
+    header->count = 0;
+
+    bool ok = fill(index);
+    munmap(data, size);
+
+    std::error_code ec;
+    if (ok) std::filesystem::rename(tmp_path, path, ec);
+    if (!ok || ec) {
+        std::filesystem::remove(tmp_path, ec);
+        return false;
+    }
+
+    return true;
+}
+
+bool PackStore::insert(const Slot &slot) {
+    IndexHeader *header = index_header(m_Index.data);
+    if ((header->count + 1) * 10 > header->capacity * 7 && !grow()) return false;
+
+    place(m_Index.data, slot);
+    return true;
+}
+
+bool PackStore::grow() {
+    IndexHeader *header = index_header(m_Index.data);
+    Slot *slots = index_slots<Slot>(m_Index.data);
+    uint64_t capacity = header->capacity;
+
+    bool ok = replace_index<Slot>(m_Dir, capacity * 2, header->active_segment, [&](char *index) {
+        for (uint64_t i = 0; i < capacity; ++i) {
+            if (slots[i].kind != 0) place(index, slots[i]);
+        }
+        return true;
+    });
+
+    return ok && map_index();
+}
+
+static std::vector<uint32_t> list_segments(const std::filesystem::path &dir) {
+    std::vector<uint32_t> segments;
+    std::error_code ec;
+
+    for (auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+        if (entry.path().extension() != ".pack") continue;
+
+        std::string stem = entry.path().stem().string();
+        if (stem.empty() || stem.find_first_not_of("0123456789") != std::string::npos) continue;
+
+        segments.push_back(std::stoul(stem));
+    }
+
+    std::sort(segments.begin(), segments.end());
+    return segments;
+}
+
+bool PackStore::rebuild_index() {
+    std::vector<uint32_t> segments = list_segments(m_Dir);
+    std::vector<Slot> slots;
+
+    for (uint32_t segment : segments) {
+        std::filesystem::path path = m_Dir / segment_name(segment);
+
+        uint64_t end;
+        int fd = open_segment(path, end);
+        if (fd < 0) continue;
+
+        uint64_t offset = sizeof(SegmentHeader);
+        RecordHeader header;
+
+        while (offset + sizeof(header) <= end && pread(fd, &header, sizeof(header), offset) == sizeof(header)) {
+            if (header.magic != RECORD_MAGIC || header.kind == 0
+                || offset + sizeof(header) + header.stored_size > end) {
+                break;
+            }
+
+            slots.push_back({ header.digest, offset, segment, header.size, header.stored_size, header.flags, header.kind, 0 });
+            offset += sizeof(header) + header.stored_size;
+        }
+
+        // A writer died in the middle of a blob, cut the segment back to its last whole record
+        if (offset < end && ftruncate(fd, offset) != 0) {
+            close(fd);
+            continue;
+        }
+
+        close(fd);
+    }
+
+    uint32_t active = segments.empty() ? 0 : segments.back();
+
+    bool ok = replace_index<Slot>(m_Dir, index_capacity(slots.size()), active, [&](char *index) {
+        for (const auto &slot : slots) place(index, slot);
+        return true;
+    });
+
+    return ok && map_index();
+}
+
+bool PackStore::put(char kind, uint64_t digest, const std::string &blob) {
+    std::string stored = compress_block(blob);
+    uint8_t flags = FLAG_COMPRESSED;
+
+    // Already compressed data is kept as it is
+    if (stored.size() >= blob.size()) {
+        stored = blob;
+        flags = 0;
+    }
+
+    std::string record = make_record(kind, digest, flags, blob.size(), stored);
+
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    if (m_LockFd < 0) return false;
+
+    lock();
+
+    if ((index_replaced() || !m_Index.data) && !map_index() && !rebuild_index()) {
+        unlock();
+        return false;
+    }
+
+    if (find(kind, digest)) {
+        unlock();
+        return true;
+    }
+
+    IndexHeader *header = index_header(m_Index.data);
+    uint32_t segment = header->active_segment;
+
+    uint64_t end;
+    int fd = open_segment(m_Dir / segment_name(segment), end);
+
+    if (fd >= 0 && end > sizeof(SegmentHeader) && end + record.size() > SEGMENT_LIMIT) {
+        close(fd);
+        fd = open_segment(m_Dir / segment_name(++segment), end);
+    }
+
+    bool ok = fd >= 0 && write_all(fd, record, end);
+
+    if (ok) {
+        header->active_segment = segment;
+        ok = insert({ digest, end, segment, static_cast<uint32_t>(blob.size()), static_cast<uint32_t>(stored.size()), flags, static_cast<uint8_t>(kind), 0 });
+    } else if (fd >= 0) {
+        (void)!ftruncate(fd, end);
+    }
+
+    if (fd >= 0) close(fd);
+    unlock();
+    return ok;
+}
+
+void PackStore::compact(const std::function<bool(char kind, uint64_t digest)> &keep) {
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    if (m_LockFd < 0) return;
+
+    lock();
+
+    if ((index_replaced() || !m_Index.data) && !map_index()) {
+        unlock();
+        return;
+    }
+
+    IndexHeader *header = index_header(m_Index.data);
+    Slot *slots = index_slots<Slot>(m_Index.data);
+
+    std::vector<Slot> kept;
+    for (uint64_t i = 0; i < header->capacity; ++i) {
+        if (slots[i].kind != 0 && keep(slots[i].kind, slots[i].digest)) kept.push_back(slots[i]);
+    }
+
+    // Live blobs are copied to new segments as they are, without recompressing them
+    std::vector<uint32_t> old_segments = list_segments(m_Dir);
+    uint32_t segment = (old_segments.empty() ? header->active_segment : std::max(old_segments.back(), header->active_segment)) + 1;
+
+    uint64_t end;
+    int fd = open_segment(m_Dir / segment_name(segment), end);
+    bool ok = fd >= 0;
+
+    std::vector<Slot> moved;
+
+    for (Slot slot : kept) {
+        std::string stored;
+        if (!ok) break;
+        if (!read_record(slot, stored)) continue;
+
+        std::string record = make_record(slot.kind, slot.digest, slot.flags, slot.size, stored);
+
+        if (end > sizeof(SegmentHeader) && end + record.size() > SEGMENT_LIMIT) {
+            close(fd);
+            fd = open_segment(m_Dir / segment_name(++segment), end);
+            if (fd < 0) {
+                ok = false;
+                break;
+            }
+        }
+
+        ok = write_all(fd, record, end);
+        slot.segment = segment;
+        slot.offset = end;
+        end += record.size();
+        moved.push_back(slot);
+    }
+
+    if (fd >= 0) close(fd);
+
+    ok = ok && replace_index<Slot>(m_Dir, index_capacity(moved.size()), segment, [&](char *index) {
+        for (const auto &slot : moved) place(index, slot);
+        return true;
+    });
+
+    // On failure the old index still points into the old segments
+    if (ok) {
+        map_index();
+
+        for (uint32_t old : old_segments) {
+            unmap(m_Segments[old]);
+            m_Segments.erase(old);
+            std::filesystem::remove(m_Dir / segment_name(old));
+        }
+    }
+
+    unlock();
+}
+
+void PackStore::for_each(const std::function<void(char kind, uint64_t digest, uint64_t size)> &callback) {
+    std::lock_guard<std::mutex> guard(m_Mutex);
+    if (index_replaced()) map_index();
+    if (!m_Index.data) return;
+
+    IndexHeader *header = index_header(m_Index.data);
+    const Slot *slots = index_slots<Slot>(m_Index.data);
+
+    for (uint64_t i = 0; i < header->capacity; ++i) {
+        uint8_t kind = __atomic_load_n(&slots[i].kind, __ATOMIC_ACQUIRE);
+        if (kind != 0) callback(kind, slots[i].digest, slots[i].stored_size);
+    }
+}
+
+PackStats PackStore::stats() {
+    PackStats stats;
+
+    for_each([&stats](char, uint64_t, uint64_t size) {
+        ++stats.entries;
+        stats.live_bytes += sizeof(RecordHeader) + size;
+    });
+
+    std::error_code ec;
+    for (uint32_t segment : list_segments(m_Dir)) {
+        stats.total_bytes += std::filesystem::file_size(m_Dir / segment_name(segment), ec);
+    }
+
+    return stats;
+}
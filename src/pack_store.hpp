@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <sys/types.h>
+
+struct PackStats {
+    uint64_t entries = 0;
+
+    // Bytes of blobs still referenced by the index and the size of every segment
+    uint64_t live_bytes = 0, total_bytes = 0;
+};
+
+// Blob store made of a few large files instead of one file per blob.
+// Blobs are compressed and appended to segment files, and an open
+// addressing hash index maps (kind, digest) to segment and offset. Both
+// are memory-mapped, so a lookup is a hash probe and a copy.
+//
+// Layout of the pack dir:
+//   index         the hash index, replaced as a whole when it grows
+//   <n>.pack      append-only segments, a new one is started at 256 MiB
+//   lock          held while writing, readers never take it
+//
+// Any number of processes may read while one of them writes: slots are
+// published after their blob is written, and a replaced index is noticed
+// on the next miss.
+class PackStore {
+public:
+    PackStore(std::filesystem::path dir);
+    ~PackStore();
+public:
+    bool get(char kind, uint64_t digest, std::string &blob);
+    bool contains(char kind, uint64_t digest);
+    bool put(char kind, uint64_t digest, const std::string &blob);
+
+    // Rewrites the segments with only the blobs `keep` returns true for
+    void compact(const std::function<bool(char kind, uint64_t digest)> &keep);
+
+    void for_each(const std::function<void(char kind, uint64_t digest, uint64_t size)> &callback);
+    PackStats stats();
+private:
+    struct Slot;
+    struct Mapping {
+        int fd = -1;
+        char *data = nullptr;
+        size_t size = 0;
+    };
+
+    bool map_index();
+    void unmap(Mapping &mapping);
+    bool index_replaced();
+    const Slot *find(char kind, uint64_t digest) const;
+    bool read_record(const Slot &slot, std::string &stored);
+    bool map_segment(uint32_t segment, uint64_t end);
+
+    void lock();
+    void unlock();
+
+    // Only called while holding the writer lock
+    bool insert(const Slot &slot);
+    bool grow();
+    bool rebuild_index();
+private:
+    std::filesystem::path m_Dir;
+    int m_LockFd = -1;
+
+    // Guards the mappings between the threads of this process, and serializes them as writers
+    std::mutex m_Mutex;
+
+    Mapping m_Index;
+    ino_t m_IndexInode = 0;
+    std::unordered_map<uint32_t, Mapping> m_Segments;
+};
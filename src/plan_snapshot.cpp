@@ -0,0 +1,334 @@
+#include "plan_snapshot.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr char PLAN_MAGIC[8] = { 'W', 'E', 'L', 'D', 'P', 'L', 'A', 'N' };
+static constexpr uint32_t PLAN_VERSION = 2;
+
+// Same as the digest table, an mtime this close to now may not change with the next edit
+static constexpr uint64_t RACY_WINDOW_NS = 2000000000ull;
+
+// The running weld, a new build of it may plan differently
+static constexpr const char *SELF_PATH = "/proc/self/exe";
+
+static void stat_input(PlanInput &input) {
+    struct stat st;
+    input.exists = stat(input.path.c_str(), &st) == 0;
+    if (!input.exists || !input.exact) return;
+
+    input.inode = st.st_ino;
+    input.size = st.st_size;
+    input.mtime = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ull + st.st_mtim.tv_nsec;
+}
+
+void PlanInputs::add(const std::string &path, bool exact) {
+    if (!m_Paths.insert(path).second) return;
+
+    PlanInput input;
+    input.path = path;
+    input.exact = exact;
+    stat_input(input);
+    m_Entries.push_back(std::move(input));
+}
+
+void PlanInputs::watch(const std::string &path) {
+    add(path, true);
+}
+
+void PlanInputs::require(const std::string &path) {
+    add(path, false);
+}
+
+static void append_bytes(std::string &buffer, const void *data, size_t size) {
+    buffer.append(static_cast<const char *>(data), size);
+}
+
+template<typename T>
+static void append_value(std::string &buffer, const T &value) {
+    append_bytes(buffer, &value, sizeof(value));
+}
+
+static void append_string(std::string &buffer, std::string_view str) {
+    append_value(buffer, static_cast<uint32_t>(str.size()));
+    append_bytes(buffer, str.data(), str.size());
+}
+
+static void append_strings(std::string &buffer, const std::vector<std::string> &strings) {
+    append_value(buffer, static_cast<uint32_t>(strings.size()));
+    for (const auto &str : strings) append_string(buffer, str);
+}
+
+static void append_paths(std::string &buffer, const std::vector<std::filesystem::path> &paths) {
+    append_value(buffer, static_cast<uint32_t>(paths.size()));
+    for (const auto &path : paths) append_string(buffer, path.native());
+}
+
+static void append_input(std::string &buffer, const PlanInput &input) {
+    append_string(buffer, input.path);
+    append_value(buffer, static_cast<uint8_t>(input.exact));
+    append_value(buffer, static_cast<uint8_t>(input.exists));
+    append_value(buffer, input.inode);
+    append_value(buffer, input.size);
+    append_value(buffer, input.mtime);
+}
+
+// Reads values in the order they were appended from the mapped snapshot, every
+// read fails once one ran past the end
+class SnapshotCursor {
+public:
+    SnapshotCursor(const char *data, size_t size)
+        : m_Data(data), m_Size(size) {}
+public:
+    template<typename T>
+    bool read(T &value) {
+        if (m_Size - m_Offset < sizeof(value)) return false;
+        std::memcpy(&value, m_Data + m_Offset, sizeof(value));
+        m_Offset += sizeof(value);
+        return true;
+    }
+
+    bool read(std::string &str) {
+        uint32_t size;
+        if (!read(size) || m_Size - m_Offset < size) return false;
+        str.assign(m_Data + m_Offset, size);
+        m_Offset += size;
+        return true;
+    }
+
+    // Every string takes at least its size, so a corrupt count can't make the vector huge
+    bool read(std::vector<std::string> &strings) {
+        uint32_t count;
+        if (!read(count) || count > remaining() / sizeof(uint32_t)) return false;
+        strings.resize(count);
+
+        for (auto &str : strings) {
+            if (!read(str)) return false;
+        }
+        return true;
+    }
+
+    bool read(std::vector<std::filesystem::path> &paths) {
+        uint32_t count;
+        if (!read(count) || count > remaining() / sizeof(uint32_t)) return false;
+        paths.resize(count);
+
+        std::string path;
+        for (auto &entry : paths) {
+            if (!read(path)) return false;
+            entry = path;
+        }
+        return true;
+    }
+
+    inline size_t remaining() const { return m_Size - m_Offset; }
+private:
+    const char *m_Data;
+    size_t m_Size, m_Offset = 0;
+};
+
+static bool read_input(SnapshotCursor &cursor, PlanInput &input) {
+    uint8_t exact, exists;
+    if (!cursor.read(input.path) || !cursor.read(exact) || !cursor.read(exists)) return false;
+
+    input.exact = exact;
+    input.exists = exists;
+    return cursor.read(input.inode) && cursor.read(input.size) && cursor.read(input.mtime);
+}
+
+static bool unchanged(const PlanInput &recorded) {
+    PlanInput current;
+    current.path = recorded.path;
+    current.exact = recorded.exact;
+    stat_input(current);
+
+    return current.exists == recorded.exists
+        && current.inode == recorded.inode
+        && current.size == recorded.size
+        && current.mtime == recorded.mtime;
+}
+
+static bool read_action(SnapshotCursor &cursor, Action &action) {
+    uint8_t kind;
+    std::string cwd;
+    uint64_t dep_count;
+
+    if (!cursor.read(kind)
+        || !cursor.read(action.start_message)
+        || !cursor.read(action.finish_message)
+        || !cursor.read(action.argv)
+        || !cursor.read(action.commands)
+        || !cursor.read(action.inputs)
+        || !cursor.read(action.outputs)
+        || !cursor.read(action.depfile)
+        || !cursor.read(action.toolchain)
+        || !cursor.read(cwd)
+        || !cursor.read(dep_count)
+        || dep_count > cursor.remaining() / sizeof(uint64_t)) {
+        return false;
+    }
+
+    action.cwd = cwd;
+    action.kind = static_cast<ActionKind>(kind);
+
+    action.deps.resize(dep_count);
+    for (auto &dep : action.deps) {
+        uint64_t id;
+        if (!cursor.read(id)) return false;
+        dep = id;
+    }
+    return true;
+}
+
+static std::string path_env() {
+    const char *path = std::getenv("PATH");
+    return path ? path : "";
+}
+
+static bool read_snapshot(
+    SnapshotCursor &cursor,
+    const std::string &root,
+    const std::string &settings,
+    BuildGraph &graph
+) {
+    char magic[sizeof(PLAN_MAGIC)];
+    uint32_t version;
+    std::string snapshot_root, snapshot_settings, snapshot_path_env;
+    uint64_t input_count, action_count;
+
+    if (!cursor.read(magic)
+        || std::memcmp(magic, PLAN_MAGIC, sizeof(PLAN_MAGIC)) != 0
+        || !cursor.read(version) || version != PLAN_VERSION
+        || !cursor.read(snapshot_root) || snapshot_root != root
+        || !cursor.read(snapshot_settings) || snapshot_settings != settings
+        || !cursor.read(snapshot_path_env) || snapshot_path_env != path_env()
+        || !cursor.read(input_count)) {
+        return false;
+    }
+
+    // Everything the plan came from is checked before a single action is read
+    for (uint64_t i = 0; i < input_count; ++i) {
+        PlanInput input;
+        if (!read_input(cursor, input) || !unchanged(input)) return false;
+    }
+
+    if (!cursor.read(action_count)) return false;
+
+    for (uint64_t i = 0; i < action_count; ++i) {
+        Action action;
+        if (!read_action(cursor, action)) return false;
+
+        for (size_t dep : action.deps) {
+            if (dep >= action_count) return false;
+        }
+        graph.add(std::move(action));
+    }
+
+    return cursor.remaining() == 0;
+}
+
+bool load_plan_snapshot(
+    const std::filesystem::path &path,
+    const std::string &root,
+    const std::string &settings,
+    BuildGraph &graph
+) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    BuildGraph loaded;
+    SnapshotCursor cursor(static_cast<const char *>(map), size);
+    bool ok = read_snapshot(cursor, root, settings, loaded);
+    munmap(map, size);
+
+    if (ok) graph = std::move(loaded);
+    return ok;
+}
+
+bool save_plan_snapshot(
+    const std::filesystem::path &path,
+    const std::string &root,
+    const std::string &settings,
+    const BuildGraph &graph,
+    const PlanInputs &inputs
+) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t now_ns = static_cast<uint64_t>(now.tv_sec) * 1000000000ull + now.tv_nsec;
+
+    PlanInput self;
+    self.path = SELF_PATH;
+    stat_input(self);
+
+    std::string buffer;
+    append_bytes(buffer, PLAN_MAGIC, sizeof(PLAN_MAGIC));
+    append_value(buffer, PLAN_VERSION);
+    append_string(buffer, root);
+    append_string(buffer, settings);
+    append_string(buffer, path_env());
+
+    append_value(buffer, static_cast<uint64_t>(inputs.entries().size() + 1));
+    append_input(buffer, self);
+
+    for (const auto &input : inputs.entries()) {
+        if (input.exact && input.exists && input.mtime + RACY_WINDOW_NS >= now_ns) {
+            // Planned again next time, by then the mtime can be trusted
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+            return false;
+        }
+        append_input(buffer, input);
+    }
+
+    append_value(buffer, static_cast<uint64_t>(graph.size()));
+
+    for (size_t id = 0; id < graph.size(); ++id) {
+        const Action &action = graph[id];
+
+        append_value(buffer, static_cast<uint8_t>(action.kind));
+        append_string(buffer, action.start_message);
+        append_string(buffer, action.finish_message);
+        append_strings(buffer, action.argv);
+        append_strings(buffer, action.commands);
+        append_paths(buffer, action.inputs);
+        append_paths(buffer, action.outputs);
+        append_string(buffer, action.depfile);
+        append_value(buffer, action.toolchain);
+        append_string(buffer, action.cwd.native());
+        append_value(buffer, static_cast<uint64_t>(action.deps.size()));
+
+        for (size_t dep : action.deps) append_value(buffer, static_cast<uint64_t>(dep));
+    }
+
+    std::filesystem::path tmp_path = path;
+    tmp_path += ".tmp";
+
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) return false;
+        out.write(buffer.data(), buffer.size());
+        if (!out) return false;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, path, ec);
+    return !ec;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "graph.hpp"
+
+struct PlanInput {
+    std::string path;
+
+    // False for a dir that only has to exist, like an out dir every build writes to
+    bool exact = true;
+
+    // All zero when the path didn't exist
+    bool exists = false;
+    uint64_t inode = 0, size = 0, mtime = 0;
+};
+
+// What a plan was resolved from: the manifests, the dirs sources were listed
+// from, the tools found in PATH and the dirs the plan created
+class PlanInputs {
+public:
+    // Has to keep its stat data. A dir gets a new mtime whenever one of its
+    // entries is added, removed or renamed, which covers new and deleted sources.
+    void watch(const std::string &path);
+
+    // Has to exist
+    void require(const std::string &path);
+public:
+    inline const std::vector<PlanInput> &entries() const { return m_Entries; }
+private:
+    void add(const std::string &path, bool exact);
+private:
+    std::vector<PlanInput> m_Entries;
+    std::unordered_set<std::string> m_Paths;
+};
+
+// Loads the graph of the plan snapshot at `path` when it was made for `root`
+// with the same `settings`, PATH and weld binary, and every input it was
+// resolved from is unchanged. The snapshot is mapped, not read.
+bool load_plan_snapshot(
+    const std::filesystem::path &path,
+    const std::string &root,
+    const std::string &settings,
+    BuildGraph &graph
+);
+
+// False when the snapshot can't be written, or an input changed too recently
+// for its mtime to tell the next change apart
+bool save_plan_snapshot(
+    const std::filesystem::path &path,
+    const std::string &root,
+    const std::string &settings,
+    const BuildGraph &graph,
+    const PlanInputs &inputs
+);
@@ -0,0 +1,253 @@
+#include "process.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// Leave room for the environment, which shares ARG_MAX with argv
+static size_t argv_limit() {
+    static const size_t limit = []() {
+        long arg_max = sysconf(_SC_ARG_MAX);
+        if (arg_max <= 0) arg_max = 128 * 1024;
+
+        size_t env_size = 0;
+        for (char **env = environ; *env; ++env) {
+            env_size += std::strlen(*env) + 1 + sizeof(char *);
+        }
+
+        size_t available = static_cast<size_t>(arg_max) > env_size ? arg_max - env_size : 0;
+        return available / 2;
+    }();
+
+    return limit;
+}
+
+// Quotes an argument the way gcc, ld and ar read them back from a response file
+static std::string quote_response_arg(const std::string &arg) {
+    std::string quoted;
+    quoted.reserve(arg.size());
+
+    for (char c : arg) {
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\'' || c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+
+    return quoted;
+}
+
+static bool write_response_file(
+    std::vector<std::string>::const_iterator begin,
+    std::vector<std::string>::const_iterator end,
+    const std::filesystem::path &dir,
+    std::string &path
+) {
+    path = (dir / "weld-XXXXXX.rsp").string();
+
+    int fd = mkstemps(path.data(), 4);
+    if (fd < 0) {
+        path.clear();
+        return false;
+    }
+    close(fd);
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    for (auto it = begin; it != end; ++it) {
+        out << quote_response_arg(*it) << '\n';
+    }
+
+    return static_cast<bool>(out);
+}
+
+int Process::exit_code(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 1;
+}
+
+static void read_pipes(int out_fd, int err_fd, std::string &output) {
+    struct pollfd fds[2] = {
+        { out_fd, POLLIN, 0 },
+        { err_fd, POLLIN, 0 }
+    };
+    int open_fds = 2;
+    char buffer[16 * 1024];
+
+    while (open_fds > 0) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (auto &pfd : fds) {
+            if (pfd.fd < 0 || pfd.revents == 0) continue;
+
+            ssize_t size = read(pfd.fd, buffer, sizeof(buffer));
+            if (size > 0) {
+                output.append(buffer, size);
+            } else if (size == 0 || (errno != EINTR && errno != EAGAIN)) {
+                close(pfd.fd);
+                pfd.fd = -1;
+                --open_fds;
+            }
+        }
+    }
+}
+
+bool Process::start(
+    const std::vector<std::string> &argv,
+    bool capture,
+    ChildProcess &child,
+    std::string &error,
+    const std::filesystem::path &cwd,
+    const SandboxMounts *sandbox
+) {
+    if (argv.empty()) {
+        error = "error: empty command\n";
+        return false;
+    }
+
+    size_t size = 0;
+    for (const auto &arg : argv) size += arg.size() + 1 + sizeof(char *);
+
+    std::string response_arg;
+    std::vector<char *> args;
+
+    if (size > argv_limit()) {
+        // A sandboxed child has its own /tmp, but it sees its output dirs
+        std::filesystem::path dir = sandbox && !sandbox->writable.empty()
+            ? sandbox->writable.front()
+            : std::filesystem::temp_directory_path();
+
+        if (!write_response_file(argv.begin() + 1, argv.end(), dir, child.response_file)) {
+            error = "error: failed to write response file for " + argv[0] + "\n";
+            finish(child);
+            return false;
+        }
+
+        response_arg = "@" + child.response_file;
+        args = { const_cast<char *>(argv[0].c_str()), response_arg.data() };
+    } else {
+        for (const auto &arg : argv) args.push_back(const_cast<char *>(arg.c_str()));
+    }
+    args.push_back(nullptr);
+
+    int out_pipe[2] = { -1, -1 }, err_pipe[2] = { -1, -1 };
+
+    if (capture && (pipe2(out_pipe, O_CLOEXEC | O_NONBLOCK) != 0 || pipe2(err_pipe, O_CLOEXEC | O_NONBLOCK) != 0)) {
+        for (int fd : { out_pipe[0], out_pipe[1], err_pipe[0], err_pipe[1] }) {
+            if (fd >= 0) close(fd);
+        }
+
+        error = "error: failed to create pipes for " + argv[0] + "\n";
+        finish(child);
+        return false;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+
+    if (!cwd.empty()) {
+        posix_spawn_file_actions_addchdir_np(&actions, cwd.c_str());
+    }
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    #ifdef POSIX_SPAWN_USEVFORK
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_USEVFORK);
+    #endif
+
+    if (capture) {
+        // The child gets blocking ends, O_NONBLOCK is shared through the open file description
+        posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO);
+        fcntl(out_pipe[1], F_SETFL, 0);
+        fcntl(err_pipe[1], F_SETFL, 0);
+    }
+
+    int result = 0;
+    if (sandbox) {
+        child.pid = sandbox_spawn(*sandbox, args.data(), cwd, capture ? out_pipe[1] : -1, capture ? err_pipe[1] : -1);
+        if (child.pid < 0) result = errno;
+    } else {
+        result = posix_spawnp(&child.pid, args[0], &actions, &attr, args.data(), environ);
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (capture) {
+        close(out_pipe[1]);
+        close(err_pipe[1]);
+        child.out_fd = out_pipe[0];
+        child.err_fd = err_pipe[0];
+    }
+
+    if (result != 0) {
+        error = "error: failed to start " + argv[0] + ": " + std::strerror(result) + "\n";
+        child.pid = -1;
+        finish(child);
+        return false;
+    }
+
+    return true;
+}
+
+void Process::finish(ChildProcess &child) {
+    if (child.out_fd >= 0) close(child.out_fd);
+    if (child.err_fd >= 0) close(child.err_fd);
+    child.out_fd = child.err_fd = -1;
+
+    if (!child.response_file.empty()) {
+        std::filesystem::remove(child.response_file);
+        child.response_file.clear();
+    }
+}
+
+static ProcessResult spawn(
+    const std::vector<std::string> &argv,
+    bool capture,
+    const std::filesystem::path &cwd,
+    const SandboxMounts *sandbox
+) {
+    ProcessResult result;
+    ChildProcess child;
+
+    if (!Process::start(argv, capture, child, result.output, cwd, sandbox)) return result;
+
+    if (capture) {
+        read_pipes(child.out_fd, child.err_fd, result.output);
+        child.out_fd = child.err_fd = -1;
+    }
+
+    int status;
+    pid_t waited;
+    while ((waited = waitpid(child.pid, &status, 0)) < 0 && errno == EINTR) {}
+
+    Process::finish(child);
+
+    if (waited == child.pid) result.exit_code = Process::exit_code(status);
+    return result;
+}
+
+int Process::run(const std::vector<std::string> &argv) {
+    ProcessResult result = spawn(argv, false, {}, nullptr);
+    if (!result.output.empty()) std::cerr << result.output;
+    return result.exit_code;
+}
+
+ProcessResult Process::capture(const std::vector<std::string> &argv, const std::filesystem::path &cwd, const SandboxMounts *sandbox) {
+    return spawn(argv, true, cwd, sandbox);
+}
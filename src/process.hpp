@@ -0,0 +1,46 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "sandbox.hpp"
+
+struct ProcessResult {
+    // The exit status, 128 + signal when the child was killed and 127 when it couldn't be started
+    int exit_code = 127;
+
+    // stdout and stderr of the child, in the order they were written
+    std::string output;
+};
+
+// A started child, its pipes are only open when its output is captured
+struct ChildProcess {
+    pid_t pid = -1;
+    int out_fd = -1, err_fd = -1;
+
+    // Has to outlive the child, remove it with Process::finish
+    std::string response_file;
+};
+
+// Starts programs directly from an argv with posix_spawn, without a shell in
+// between. Command lines close to ARG_MAX are passed through a response file.
+class Process {
+public:
+    // The child shares stdin, stdout and stderr with weld
+    static int run(const std::vector<std::string> &argv);
+
+    // The child's stdout and stderr are captured through pipes, it runs in `cwd` when set
+    // and inside a sandbox set up from `sandbox` when that is set
+    static ProcessResult capture(const std::vector<std::string> &argv, const std::filesystem::path &cwd = {},
+                                 const SandboxMounts *sandbox = nullptr);
+
+    // Starts a child without waiting for it, the pipes are non-blocking
+    static bool start(const std::vector<std::string> &argv, bool capture, ChildProcess &child, std::string &error,
+                      const std::filesystem::path &cwd = {}, const SandboxMounts *sandbox = nullptr);
+    static void finish(ChildProcess &child);
+
+    static int exit_code(int status);
+};
@@ -0,0 +1,28 @@
+#include "remote_cache.hpp"
+
+#include <iostream>
+
+// Uploads are network bound, a couple of connections keep up with any build
+static constexpr size_t REMOTE_UPLOAD_THREADS = 4;
+
+RemoteCache::RemoteCache(const std::string &url, RemoteCacheMode mode)
+    : m_Client(url), m_Mode(mode), m_Uploads(REMOTE_UPLOAD_THREADS) {
+    if (!m_Client.valid()) {
+        std::cerr << "warning: ignoring invalid remote cache url `" << url << "`" << std::endl;
+    }
+}
+
+bool RemoteCache::get(const std::string &kind, const std::string &digest, std::string &blob) {
+    return m_Client.get("/" + kind + "/" + digest, blob);
+}
+
+void RemoteCache::put_async(std::vector<RemoteBlob> blobs) {
+    if (!writable() || !valid()) return;
+
+    m_Uploads.enqueue([this, blobs = std::move(blobs)]() {
+        // A failed upload only costs a future cache hit
+        for (const auto &blob : blobs) {
+            if (!m_Client.put("/" + blob.kind + "/" + blob.digest, blob.blob)) break;
+        }
+    });
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "http.hpp"
+#include "threadpool.hpp"
+
+struct RemoteBlob {
+    std::string kind;
+    std::string digest;
+    std::string blob;
+};
+
+enum class RemoteCacheMode {
+    ReadOnly,
+    // Results are written to the local and the remote cache
+    ReadWrite
+};
+
+// Content-addressed store behind a plain HTTP server: blobs are read with
+// `GET <url>/<kind>/<digest>` and written with `PUT`. Uploads run in the
+// background, so they never hold up a build.
+class RemoteCache {
+public:
+    RemoteCache(const std::string &url, RemoteCacheMode mode);
+    // Waits for the uploads still in flight
+    ~RemoteCache() = default;
+public:
+    inline bool valid() const { return m_Client.valid(); }
+    inline bool writable() const { return m_Mode == RemoteCacheMode::ReadWrite; }
+
+    bool get(const std::string &kind, const std::string &digest, std::string &blob);
+    // Uploads `blobs` one after another and stops at the first that fails, so
+    // a blob is only put once everything it refers to is on the server
+    void put_async(std::vector<RemoteBlob> blobs);
+private:
+    HttpClient m_Client;
+    RemoteCacheMode m_Mode;
+    ThreadPool m_Uploads;
+};
@@ -0,0 +1,374 @@
+#include "sandbox.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "graph.hpp"
+
+extern char **environ;
+
+// The base system every compiler and linker needs, the compiler's own prefix is added per action
+static const char *const TOOLCHAIN_DIRS[] = {
+    "/usr", "/bin", "/sbin", "/lib", "/lib32", "/lib64", "/libx32", "/etc"
+};
+
+// Whether `path` is `dir` or somewhere below it
+static bool is_within(const std::filesystem::path &path, const std::filesystem::path &dir) {
+    return std::mismatch(dir.begin(), dir.end(), path.begin(), path.end()).first == dir.end();
+}
+
+static void add_path(std::vector<std::filesystem::path> &paths, const std::filesystem::path &path) {
+    // Binding / would hand the whole machine to the action
+    if (path.empty() || path == path.root_path()) return;
+    paths.push_back(path.lexically_normal());
+}
+
+static bool is_header(const std::filesystem::path &path) {
+    static const char *const extensions[] = { ".h", ".hh", ".hpp", ".hxx", ".h++", ".inl", ".ipp", ".tcc", ".inc" };
+
+    std::string extension = path.extension().string();
+    return std::find(std::begin(extensions), std::end(extensions), extension) != std::end(extensions);
+}
+
+static bool takes_dir(const std::string &arg) {
+    return arg == "-I" || arg == "-isystem" || arg == "-iquote" || arg == "-idirafter" || arg == "-L";
+}
+
+Sandbox::Sandbox() {
+    for (const char *dir : TOOLCHAIN_DIRS) {
+        if (std::filesystem::exists(dir)) m_Toolchain.emplace_back(dir);
+    }
+
+    m_Root = std::filesystem::temp_directory_path() / ("weld-sandbox-" + std::to_string(getpid()));
+
+    std::error_code error;
+    std::filesystem::create_directories(m_Root, error);
+    if (error) return;
+
+    // Kernels and containers may forbid unprivileged user namespaces, find out before any action runs
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (unshare(CLONE_NEWUSER | CLONE_NEWNS | CLONE_NEWNET) != 0) _exit(1);
+        if (mount("none", "/", nullptr, MS_REC | MS_PRIVATE, nullptr) != 0) _exit(1);
+        if (mount("tmpfs", m_Root.c_str(), "tmpfs", MS_NOSUID | MS_NODEV, nullptr) != 0) _exit(1);
+        _exit(0);
+    }
+
+    int status;
+    if (pid > 0 && waitpid(pid, &status, 0) == pid) {
+        m_Valid = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+}
+
+Sandbox::~Sandbox() {
+    std::error_code error;
+    std::filesystem::remove(m_Root, error);
+}
+
+SandboxMounts Sandbox::mounts(const Action &action, const std::vector<std::string_view> &headers) const {
+    SandboxMounts mounts;
+    mounts.root = m_Root;
+    mounts.read_only = m_Toolchain;
+
+    if (!action.argv.empty()) {
+        // A compiler in /opt/gcc/bin needs /opt/gcc for its headers and libraries
+        std::error_code error;
+        std::filesystem::path program = std::filesystem::canonical(action.argv.front(), error);
+        if (!error) add_path(mounts.read_only, program.parent_path().parent_path());
+    }
+
+    // Single files, so `#include "../secret.h"` doesn't find anything next to a declared input
+    auto add_file = [&](const std::string &path) {
+        std::error_code error;
+        add_path(mounts.read_only, std::filesystem::absolute(resolve_path(action, path), error));
+    };
+
+    for (const auto &input : action.inputs) add_file(input.string());
+    for (const auto &header : headers) add_file(std::string(header));
+
+    if (action.kind == ActionKind::Compile && !action.inputs.empty()) {
+        std::error_code error;
+        std::filesystem::path dir = std::filesystem::absolute(resolve_path(action, action.inputs.front().string()), error).parent_path();
+
+        for (std::filesystem::directory_iterator it(dir, error), end; !error && it != end; it.increment(error)) {
+            if (is_header(it->path()) && it->is_regular_file(error)) add_path(mounts.read_only, it->path());
+        }
+    }
+
+    for (size_t i = 1; i < action.argv.size(); ++i) {
+        const std::string &arg = action.argv[i];
+        std::string dir;
+
+        if (takes_dir(arg) && i + 1 < action.argv.size()) {
+            dir = action.argv[++i];
+        } else if (arg.size() > 2 && (arg.compare(0, 2, "-I") == 0 || arg.compare(0, 2, "-L") == 0)) {
+            dir = arg.substr(2);
+        } else {
+            continue;
+        }
+
+        add_path(mounts.read_only, resolve_path(action, dir));
+    }
+
+    for (const auto &output : action.outputs) add_path(mounts.writable, output.parent_path());
+    if (!action.depfile.empty()) add_path(mounts.writable, resolve_path(action, action.depfile).parent_path());
+
+    for (auto *paths : { &mounts.read_only, &mounts.writable }) {
+        std::sort(paths->begin(), paths->end());
+        paths->erase(std::unique(paths->begin(), paths->end()), paths->end());
+    }
+
+    // A dir below another read-only dir is already visible, sorted order puts parents first
+    std::vector<std::filesystem::path> read_only;
+    for (auto &path : mounts.read_only) {
+        if (read_only.empty() || !is_within(path, read_only.back())) read_only.push_back(std::move(path));
+    }
+    mounts.read_only = std::move(read_only);
+
+    return mounts;
+}
+
+std::string explain_sandbox_failure(const Action &action, const std::string &output) {
+    static const std::string missing = ": No such file or directory";
+
+    std::string notes;
+    std::istringstream lines(output);
+
+    for (std::string line; std::getline(lines, line); ) {
+        if (line.size() <= missing.size() || line.compare(line.size() - missing.size(), missing.size(), missing) != 0) continue;
+        line.resize(line.size() - missing.size());
+
+        // `src/main.cpp:1:10: fatal error: ../secret.h` from compilers, `ld: cannot find foo.o` from linkers
+        std::string path = line.substr(line.rfind(": ") == std::string::npos ? 0 : line.rfind(": ") + 2);
+        if (path.compare(0, 12, "cannot find ") == 0) path = path.substr(12);
+
+        // Not a path but the rest of a message, like `linker input file not found`
+        if (path.empty() || path.find(' ') != std::string::npos) continue;
+
+        // Quoted includes are relative to the including file
+        std::vector<std::filesystem::path> candidates = { resolve_path(action, path) };
+        size_t colon = line.find(':');
+        if (colon != std::string::npos && !std::filesystem::path(path).is_absolute()) {
+            candidates.push_back(resolve_path(action, (std::filesystem::path(line.substr(0, colon)).parent_path() / path).string()));
+        }
+
+        std::string note = "note: `" + path + "` couldn't be opened in the sandbox\n";
+        for (const auto &candidate : candidates) {
+            std::error_code error;
+            if (!std::filesystem::exists(candidate, error)) continue;
+
+            note = "note: `" + candidate.lexically_normal().string() + "` exists but isn't visible in the sandbox,"
+                " it's neither a declared input nor in an include dir\n";
+            break;
+        }
+
+        if (notes.find(note) == std::string::npos) notes += note;
+    }
+
+    return notes;
+}
+
+// Flags the kernel locked on the original mount, a read-only remount has to repeat them
+static unsigned long locked_flags(const char *path) {
+    struct statvfs info;
+    if (statvfs(path, &info) != 0) return 0;
+
+    unsigned long flags = 0;
+    if (info.f_flag & ST_NOSUID) flags |= MS_NOSUID;
+    if (info.f_flag & ST_NODEV) flags |= MS_NODEV;
+    if (info.f_flag & ST_NOEXEC) flags |= MS_NOEXEC;
+    if (info.f_flag & ST_NOATIME) flags |= MS_NOATIME;
+    if (info.f_flag & ST_NODIRATIME) flags |= MS_NODIRATIME;
+    if (info.f_flag & ST_RELATIME) flags |= MS_RELATIME;
+    return flags;
+}
+
+namespace {
+    struct Bind {
+        std::string source, target;
+        bool read_only;
+        unsigned long flags;
+    };
+
+    // Everything the child needs, built before the fork since the child may not allocate
+    struct SandboxPlan {
+        std::string root, tmp, dev, proc;
+        std::vector<std::string> dirs, files;
+        std::vector<Bind> binds;
+        std::string uid_map, gid_map;
+        std::string cwd;
+        std::vector<std::string> env;
+        std::vector<char *> envp;
+    };
+}
+
+// Only async-signal-safe calls from here on, the parent may have had other threads
+static void write_message(int fd, const char *message, const char *detail) {
+    (void)!write(fd, message, std::strlen(message));
+    if (detail) {
+        (void)!write(fd, " ", 1);
+        (void)!write(fd, detail, std::strlen(detail));
+    }
+    (void)!write(fd, "\n", 1);
+}
+
+[[noreturn]] static void fail(int fd, const char *message, const char *detail = nullptr) {
+    write_message(fd, message, detail);
+    _exit(127);
+}
+
+static bool write_file(const char *path, const char *data) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    size_t size = std::strlen(data);
+    bool ok = write(fd, data, size) == static_cast<ssize_t>(size);
+    close(fd);
+    return ok;
+}
+
+[[noreturn]] static void enter_sandbox(const SandboxPlan &plan, char *const *args, int out_fd, int err_fd) {
+    int report = err_fd >= 0 ? err_fd : STDERR_FILENO;
+
+    if (unshare(CLONE_NEWUSER | CLONE_NEWNS | CLONE_NEWNET) != 0) {
+        fail(report, "error: sandbox: failed to create namespaces");
+    }
+
+    // Keep the same ids inside, so outputs are owned by the user running weld
+    if (!write_file("/proc/self/setgroups", "deny")
+        || !write_file("/proc/self/uid_map", plan.uid_map.c_str())
+        || !write_file("/proc/self/gid_map", plan.gid_map.c_str())) {
+        fail(report, "error: sandbox: failed to map user ids");
+    }
+
+    if (mount("none", "/", nullptr, MS_REC | MS_PRIVATE, nullptr) != 0
+        || mount("tmpfs", plan.root.c_str(), "tmpfs", MS_NOSUID | MS_NODEV, "mode=0755") != 0) {
+        fail(report, "error: sandbox: failed to mount the root");
+    }
+
+    // /tmp goes first, so sources that live below /tmp are bound on top of it instead of hidden
+    mkdir(plan.tmp.c_str(), 0755);
+    mkdir(plan.dev.c_str(), 0755);
+    mkdir(plan.proc.c_str(), 0755);
+
+    if (mount("tmpfs", plan.tmp.c_str(), "tmpfs", MS_NOSUID | MS_NODEV, nullptr) != 0
+        || mount("/dev", plan.dev.c_str(), nullptr, MS_BIND | MS_REC, nullptr) != 0) {
+        fail(report, "error: sandbox: failed to mount /dev and /tmp");
+    }
+
+    // Some tools look at /proc/self, a container may not allow binding it
+    mount("/proc", plan.proc.c_str(), nullptr, MS_BIND | MS_REC, nullptr);
+
+    for (const auto &dir : plan.dirs) mkdir(dir.c_str(), 0755);
+
+    // A file is bound onto an empty one, unless a dir bound before it already has it
+    for (const auto &file : plan.files) {
+        int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd >= 0) close(fd);
+    }
+
+    for (const auto &bind : plan.binds) {
+        if (mount(bind.source.c_str(), bind.target.c_str(), nullptr, MS_BIND | MS_REC, nullptr) != 0) {
+            fail(report, "error: sandbox: failed to bind", bind.source.c_str());
+        }
+
+        if (bind.read_only
+            && mount(nullptr, bind.target.c_str(), nullptr, MS_BIND | MS_REMOUNT | MS_RDONLY | bind.flags, nullptr) != 0) {
+            fail(report, "error: sandbox: failed to make read-only", bind.source.c_str());
+        }
+    }
+
+    if (mount(nullptr, plan.root.c_str(), nullptr, MS_BIND | MS_REMOUNT | MS_RDONLY | MS_NOSUID | MS_NODEV, nullptr) != 0) {
+        fail(report, "error: sandbox: failed to make the root read-only");
+    }
+
+    if (chroot(plan.root.c_str()) != 0 || chdir(plan.cwd.c_str()) != 0) {
+        fail(report, "error: sandbox: failed to enter", plan.cwd.c_str());
+    }
+
+    if (out_fd >= 0) dup2(out_fd, STDOUT_FILENO);
+    if (err_fd >= 0) dup2(err_fd, STDERR_FILENO);
+
+    execvpe(args[0], args, plan.envp.data());
+    fail(STDERR_FILENO, "error: sandbox: failed to start", args[0]);
+}
+
+pid_t sandbox_spawn(
+    const SandboxMounts &mounts,
+    char *const *args,
+    const std::filesystem::path &cwd,
+    int out_fd,
+    int err_fd
+) {
+    SandboxPlan plan;
+    plan.root = mounts.root.string();
+    plan.tmp = plan.root + "/tmp";
+    plan.dev = plan.root + "/dev";
+    plan.proc = plan.root + "/proc";
+    plan.cwd = cwd.empty() ? "/" : cwd.string();
+
+    plan.uid_map = std::to_string(getuid()) + " " + std::to_string(getuid()) + " 1";
+    plan.gid_map = std::to_string(getgid()) + " " + std::to_string(getgid()) + " 1";
+
+    // The dirs leading to every bind target and the cwd, a file target is created inside its dir
+    std::vector<std::filesystem::path> dirs = { cwd.empty() ? std::filesystem::path("/") : cwd };
+
+    for (const auto &path : mounts.read_only) {
+        std::error_code error;
+        auto status = std::filesystem::status(path, error);
+
+        if (std::filesystem::is_directory(status)) {
+            dirs.push_back(path);
+        } else if (std::filesystem::is_regular_file(status)) {
+            dirs.push_back(path.parent_path());
+            plan.files.push_back(plan.root + path.string());
+        } else {
+            continue;
+        }
+
+        plan.binds.push_back({ path.string(), plan.root + path.string(), true, locked_flags(path.c_str()) });
+    }
+
+    for (const auto &path : mounts.writable) {
+        if (!std::filesystem::is_directory(path)) continue;
+        plan.binds.push_back({ path.string(), plan.root + path.string(), false, 0 });
+        dirs.push_back(path);
+    }
+
+    // Parents are bound first, so a writable output dir can sit inside a read-only source dir
+    std::sort(plan.binds.begin(), plan.binds.end(), [](const Bind &a, const Bind &b) { return a.target < b.target; });
+
+    for (const auto &target : dirs) {
+        std::filesystem::path dir = "/";
+        for (const auto &part : target.relative_path()) {
+            dir /= part;
+            plan.dirs.push_back(plan.root + dir.string());
+        }
+    }
+    std::sort(plan.dirs.begin(), plan.dirs.end());
+    plan.dirs.erase(std::unique(plan.dirs.begin(), plan.dirs.end()), plan.dirs.end());
+
+    // A TMPDIR outside of /tmp wouldn't exist in the sandbox
+    for (char **env = environ; *env; ++env) {
+        if (std::strncmp(*env, "TMPDIR=", 7) != 0) plan.env.emplace_back(*env);
+    }
+    plan.env.emplace_back("TMPDIR=/tmp");
+    for (auto &env : plan.env) plan.envp.push_back(env.data());
+    plan.envp.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid == 0) enter_sandbox(plan, args, out_fd, err_fd);
+    return pid;
+}
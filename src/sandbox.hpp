@@ -0,0 +1,61 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/types.h>
+
+struct Action;
+
+// Everything a sandboxed child gets to see, paths are absolute
+struct SandboxMounts {
+    // An empty dir the root of the namespace is mounted on
+    std::filesystem::path root;
+
+    // Dirs and single files, writable ones are dirs
+    std::vector<std::filesystem::path> read_only, writable;
+};
+
+// Runs actions in their own user, mount and network namespace, which works
+// without privileges on most Linux kernels. The namespace starts from an
+// empty read-only root, and only gets the toolchain, the include and library
+// dirs and the declared and discovered input files of an action bound into
+// it read-only, its output dirs writable and a private /tmp. Reading any
+// other file fails as if it didn't exist, writing outside the output dirs
+// fails with EROFS, and the only network device is a loopback that is down.
+class Sandbox {
+public:
+    Sandbox();
+    ~Sandbox();
+public:
+    // False when the kernel doesn't let weld create the namespaces
+    inline bool valid() const { return m_Valid; }
+
+    // The toolchain and the -I and -L dirs of `action` read-only, as well as its
+    // inputs, the `headers` the last build of it read and the headers next to a
+    // compiled source, since quoted includes look there first. The dirs of its
+    // outputs are writable.
+    SandboxMounts mounts(const Action &action, const std::vector<std::string_view> &headers = {}) const;
+private:
+    std::filesystem::path m_Root;
+    std::vector<std::filesystem::path> m_Toolchain;
+    bool m_Valid = false;
+};
+
+// Notes on the files a failed sandboxed action couldn't open, from its output.
+// Empty when the output names none.
+std::string explain_sandbox_failure(const Action &action, const std::string &output);
+
+// Forks a child that enters new namespaces set up from `mounts` and execs `args`
+// with stdout and stderr on `out_fd` and `err_fd` when they are set. Returns -1
+// with errno set when the fork failed, failures inside the child are written to
+// its stderr and end it with exit code 127.
+pid_t sandbox_spawn(
+    const SandboxMounts &mounts,
+    char *const *args,
+    const std::filesystem::path &cwd,
+    int out_fd,
+    int err_fd
+);
@@ -0,0 +1,341 @@
+#include "stat_batch.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <thread>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "threadpool.hpp"
+
+// Below this a batch costs more than it saves
+static constexpr size_t MIN_BATCH = 64;
+
+// Requests in flight at once, io_uring rounds it up to a power of two
+static constexpr unsigned RING_ENTRIES = 256;
+
+// Paths each thread pool task stats
+static constexpr size_t THREAD_CHUNK = 512;
+
+static constexpr unsigned STATX_WANTED = STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME;
+
+// statfs magic numbers of file systems where a stat goes over the network:
+// NFS, CIFS, SMB2, SMB, FUSE, Ceph, AFS, 9p and Lustre
+static constexpr long NETWORK_FS_MAGIC[] = {
+    0x6969, 0xFF534D42, 0xFE534D42, 0x517B, 0x65735546, 0x00C36400, 0x5346414F, 0x01021997, 0x0BD00BD0
+};
+
+static void stat_into(const std::string &path, FileStat &stat_data) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return;
+
+    stat_data.exists = true;
+    stat_data.inode = st.st_ino;
+    stat_data.size = st.st_size;
+    stat_data.mtime_sec = st.st_mtim.tv_sec;
+    stat_data.mtime_nsec = st.st_mtim.tv_nsec;
+}
+
+// A submission and a completion queue shared with the kernel, set up with
+// raw syscalls so weld doesn't need liburing
+class StatRing {
+public:
+    StatRing(unsigned entries);
+    ~StatRing();
+public:
+    inline bool valid() const { return m_Fd >= 0; }
+
+    // False when the kernel can't run statx requests, nothing in `stats` is set then
+    bool stat(const std::vector<std::string> &paths, std::vector<FileStat> &stats);
+private:
+    bool enter(unsigned submit, unsigned wait);
+    unsigned reap(std::vector<FileStat> &results, std::vector<unsigned> &free_slots, bool &supported);
+    void drain(size_t in_flight);
+private:
+    int m_Fd = -1;
+    unsigned m_Entries = 0;
+
+    // A statx buffer per slot in flight, the kernel writes them until the
+    // request completes. Leaked with the ring when that can't be waited for.
+    std::unique_ptr<struct statx[]> m_Buffers;
+    bool m_Leaked = false;
+
+    void *m_SqRing = MAP_FAILED, *m_CqRing = MAP_FAILED;
+    size_t m_SqRingSize = 0, m_CqRingSize = 0;
+
+    struct io_uring_sqe *m_Sqes = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+    size_t m_SqesSize = 0;
+
+    unsigned *m_SqHead = nullptr, *m_SqTail = nullptr, *m_SqMask = nullptr, *m_SqArray = nullptr;
+    unsigned *m_CqHead = nullptr, *m_CqTail = nullptr, *m_CqMask = nullptr;
+    struct io_uring_cqe *m_Cqes = nullptr;
+};
+
+StatRing::StatRing(unsigned entries) {
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) return;
+
+    m_SqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_CqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) m_SqRingSize = m_CqRingSize = std::max(m_SqRingSize, m_CqRingSize);
+
+    m_SqRing = mmap(nullptr, m_SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (m_SqRing == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+
+    m_CqRing = single_mmap ? m_SqRing
+        : mmap(nullptr, m_CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+
+    m_SqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, m_SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    m_Sqes = static_cast<struct io_uring_sqe *>(sqes);
+
+    if (m_CqRing == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+
+    char *sq = static_cast<char *>(m_SqRing);
+    m_SqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    m_SqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    m_SqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    m_SqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+    char *cq = static_cast<char *>(m_CqRing);
+    m_CqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    m_CqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    m_CqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    m_Cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    m_Entries = params.sq_entries;
+    m_Buffers.reset(new struct statx[m_Entries]);
+    m_Fd = fd;
+}
+
+StatRing::~StatRing() {
+    if (m_Leaked) m_Buffers.release();
+
+    if (m_Sqes != MAP_FAILED) munmap(m_Sqes, m_SqesSize);
+    if (m_CqRing != MAP_FAILED && m_CqRing != m_SqRing) munmap(m_CqRing, m_CqRingSize);
+    if (m_SqRing != MAP_FAILED) munmap(m_SqRing, m_SqRingSize);
+    if (m_Fd >= 0) close(m_Fd);
+}
+
+bool StatRing::enter(unsigned submit, unsigned wait) {
+    while (submit > 0 || wait > 0) {
+        long ret = syscall(__NR_io_uring_enter, m_Fd, submit, wait, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        // Every completion waited for is reaped by the caller, only unsubmitted requests go again
+        submit -= std::min<unsigned>(submit, ret);
+        wait = 0;
+    }
+    return true;
+}
+
+// Takes every completion there is, false in `supported` when one says statx isn't
+unsigned StatRing::reap(std::vector<FileStat> &results, std::vector<unsigned> &free_slots, bool &supported) {
+    unsigned head = *m_CqHead;
+    unsigned completed = __atomic_load_n(m_CqTail, __ATOMIC_ACQUIRE);
+    unsigned count = completed - head;
+
+    for (; head != completed; ++head) {
+        const struct io_uring_cqe *cqe = &m_Cqes[head & *m_CqMask];
+        unsigned slot = cqe->user_data >> 32;
+        size_t path = cqe->user_data & 0xffffffffu;
+
+        // Kernels before 5.6 know io_uring but not its statx
+        if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) supported = false;
+
+        if (cqe->res == 0 && path < results.size()) {
+            const struct statx &stx = m_Buffers[slot];
+            FileStat &result = results[path];
+            result.exists = true;
+            result.inode = stx.stx_ino;
+            result.size = stx.stx_size;
+            result.mtime_sec = stx.stx_mtime.tv_sec;
+            result.mtime_nsec = stx.stx_mtime.tv_nsec;
+        }
+
+        free_slots.push_back(slot);
+    }
+
+    __atomic_store_n(m_CqHead, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+// After a failed enter, waits for the requests the kernel took so it's done
+// with the buffers before the ring goes, requests it didn't take are dropped
+void StatRing::drain(size_t in_flight) {
+    __atomic_store_n(m_SqTail, __atomic_load_n(m_SqHead, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+
+    std::vector<FileStat> ignored;
+    std::vector<unsigned> slots;
+    bool supported = true;
+
+    while (true) {
+        in_flight -= std::min<size_t>(in_flight, reap(ignored, slots, supported));
+        if (in_flight == 0) return;
+
+        long ret = syscall(__NR_io_uring_enter, m_Fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (ret < 0 && errno != EINTR) {
+            m_Leaked = true;
+            return;
+        }
+    }
+}
+
+bool StatRing::stat(const std::vector<std::string> &paths, std::vector<FileStat> &stats) {
+    // Completions come back in any order, each says the slot its buffer is in
+    std::vector<unsigned> free_slots(m_Entries);
+    for (unsigned slot = 0; slot < m_Entries; ++slot) free_slots[slot] = m_Entries - 1 - slot;
+
+    std::vector<FileStat> results(paths.size());
+    size_t next = 0, done = 0;
+    bool supported = true;
+
+    while (done < paths.size()) {
+        unsigned tail = *m_SqTail;
+        unsigned submit = 0;
+
+        while (next < paths.size() && !free_slots.empty()) {
+            unsigned slot = free_slots.back();
+            free_slots.pop_back();
+
+            unsigned index = tail & *m_SqMask;
+            struct io_uring_sqe *sqe = &m_Sqes[index];
+            std::memset(sqe, 0, sizeof(*sqe));
+
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(paths[next].c_str());
+            sqe->len = STATX_WANTED;
+            sqe->off = reinterpret_cast<uint64_t>(&m_Buffers[slot]);
+            sqe->user_data = static_cast<uint64_t>(slot) << 32 | next;
+
+            m_SqArray[index] = index;
+            ++tail;
+            ++next;
+            ++submit;
+        }
+
+        __atomic_store_n(m_SqTail, tail, __ATOMIC_RELEASE);
+
+        if (!enter(submit, 1)) {
+            // Queued but not yet taken by the kernel, those never started
+            unsigned waiting = tail - __atomic_load_n(m_SqHead, __ATOMIC_ACQUIRE);
+            drain(next - done - waiting);
+            return false;
+        }
+
+        done += reap(results, free_slots, supported);
+    }
+
+    if (supported) stats = std::move(results);
+    return supported;
+}
+
+static void stat_on_threads(const std::vector<std::string> &paths, std::vector<FileStat> &stats) {
+    size_t threads = std::min<size_t>(
+        std::max(2u, std::thread::hardware_concurrency()),
+        (paths.size() + THREAD_CHUNK - 1) / THREAD_CHUNK
+    );
+    ThreadPool pool(threads);
+
+    std::vector<std::future<void>> chunks;
+    for (size_t begin = 0; begin < paths.size(); begin += THREAD_CHUNK) {
+        size_t end = std::min(paths.size(), begin + THREAD_CHUNK);
+
+        chunks.push_back(pool.enqueue([&paths, &stats, begin, end]() {
+            for (size_t i = begin; i < end; ++i) stat_into(paths[i], stats[i]);
+        }));
+    }
+
+    for (auto &chunk : chunks) chunk.get();
+}
+
+// Only the file system of the first path, or of the cwd when it's missing, is
+// asked. Both are mostly the one of the project.
+static bool on_network_fs(const std::vector<std::string> &paths) {
+    struct statfs fs;
+    if ((paths.empty() || statfs(paths.front().c_str(), &fs) != 0) && statfs(".", &fs) != 0) return false;
+    return std::find(std::begin(NETWORK_FS_MAGIC), std::end(NETWORK_FS_MAGIC), static_cast<long>(fs.f_type))
+        != std::end(NETWORK_FS_MAGIC);
+}
+
+std::vector<FileStat> stat_paths(const std::vector<std::string> &paths, StatBatching batching) {
+    std::vector<FileStat> stats(paths.size());
+
+    if (batching == StatBatching::Auto) {
+        batching = on_network_fs(paths) ? StatBatching::IoUring : StatBatching::Off;
+    }
+
+    if (batching == StatBatching::Off || paths.size() < MIN_BATCH) {
+        for (size_t i = 0; i < paths.size(); ++i) stat_into(paths[i], stats[i]);
+        return stats;
+    }
+
+    if (batching == StatBatching::IoUring) {
+        StatRing ring(RING_ENTRIES);
+        if (ring.valid() && ring.stat(paths, stats)) return stats;
+    }
+
+    stat_on_threads(paths, stats);
+    return stats;
+}
+
+void StatCache::prefetch(const std::vector<std::string> &paths) {
+    if (m_Batching == StatBatching::Off) return;
+
+    std::vector<FileStat> stats = stat_paths(paths, m_Batching);
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Stats.reserve(m_Stats.size() + paths.size());
+    for (size_t i = 0; i < paths.size(); ++i) m_Stats[paths[i]] = stats[i];
+}
+
+bool StatCache::find(const std::string &path, FileStat &stat) const {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    auto it = m_Stats.find(path);
+    if (it == m_Stats.end()) return false;
+
+    stat = it->second;
+    return true;
+}
+
+void StatCache::invalidate(const std::string &path) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Stats.erase(path);
+}
+
+void StatCache::clear() {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Stats.clear();
+}
+
+FileStat stat_file(const std::string &path, const StatCache *cache) {
+    FileStat stat;
+    if (cache && cache->find(path, stat)) return stat;
+
+    stat_into(path, stat);
+    return stat;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// What up-to-date checks need from a stat, all zero when the path doesn't exist
+struct FileStat {
+    bool exists = false;
+    uint64_t inode = 0, size = 0;
+    int64_t mtime_sec = 0, mtime_nsec = 0;
+
+    inline uint64_t mtime() const {
+        return static_cast<uint64_t>(mtime_sec) * 1000000000ull + mtime_nsec;
+    }
+};
+
+// How the stat data of a build's inputs is fetched before its actions are checked
+enum class StatBatching {
+    // Prefetched one stat call after another, which is quickest while the
+    // inode cache has them, through io_uring on network file systems
+    Auto,
+
+    // statx requests submitted through io_uring, thread pool when the kernel doesn't allow it
+    IoUring,
+
+    // stat calls split across a thread pool
+    Threads,
+
+    // One stat call per input while actions are checked
+    Off
+};
+
+// Stats every path, in batches as `batching` says, following symlinks like stat
+std::vector<FileStat> stat_paths(const std::vector<std::string> &paths, StatBatching batching);
+
+// Stat data of the inputs a build is about to check, fetched all at once so
+// the checks don't wait on one stat after another. Entries stay until the
+// file is about to be rewritten.
+class StatCache {
+public:
+    StatCache(StatBatching batching)
+        : m_Batching(batching) {}
+public:
+    void prefetch(const std::vector<std::string> &paths);
+
+    // False when `path` wasn't prefetched or was invalidated since
+    bool find(const std::string &path, FileStat &stat) const;
+
+    // For outputs of an action that is about to run
+    void invalidate(const std::string &path);
+
+    // For actions that may write anywhere, like shell commands
+    void clear();
+private:
+    StatBatching m_Batching;
+    std::unordered_map<std::string, FileStat> m_Stats;
+    mutable std::mutex m_Mutex;
+};
+
+// The prefetched stat data of `path` when `cache` has it, a stat call otherwise
+FileStat stat_file(const std::string &path, const StatCache *cache);
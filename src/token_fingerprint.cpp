@@ -0,0 +1,498 @@
+#include "token_fingerprint.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+    #define WELD_TOKENS_SSE2 1
+#elif defined(__aarch64__) && defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    #include <arm_neon.h>
+    #define WELD_TOKENS_NEON 1
+#endif
+
+// Bytes that end a run of token characters: whitespace and control bytes, and
+// the ones that may start a comment, a literal, a splice or a directive
+static inline bool is_plain(uint8_t c) {
+    return c > ' ' && c != '/' && c != '"' && c != '\'' && c != '\\' && c != '#';
+}
+
+static inline bool is_blank(uint8_t c) {
+    return c == ' ' || c == '\t';
+}
+
+static inline bool is_identifier(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static inline bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Both scans take 16 bytes at a time, the tail goes byte by byte. SSE2 is part
+// of x86-64 and NEON of aarch64, so there is nothing to pick at runtime.
+#if defined(WELD_TOKENS_SSE2)
+static size_t plain_run(const uint8_t *data, size_t size) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i apostrophe = _mm_set1_epi8('\'');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i hash = _mm_set1_epi8('#');
+
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+
+        // Unsigned bytes <= ' ' are the ones max(byte, ' ') leaves at ' '
+        __m128i special = _mm_cmpeq_epi8(_mm_max_epu8(bytes, space), space);
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, slash));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, quote));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, apostrophe));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, backslash));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, hash));
+
+        if (int mask = _mm_movemask_epi8(special)) return i + __builtin_ctz(mask);
+    }
+
+    while (i < size && is_plain(data[i])) ++i;
+    return i;
+}
+
+static size_t blank_run(const uint8_t *data, size_t size) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(bytes, space), _mm_cmpeq_epi8(bytes, tab));
+
+        if (int mask = ~_mm_movemask_epi8(blank) & 0xFFFF) return i + __builtin_ctz(mask);
+    }
+
+    while (i < size && is_blank(data[i])) ++i;
+    return i;
+}
+#elif defined(WELD_TOKENS_NEON)
+// NEON has no movemask, narrowing every 16-bit lane by 4 leaves 4 bits per byte
+static inline uint64_t byte_mask(uint8x16_t bytes) {
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(bytes), 4)), 0);
+}
+
+static size_t plain_run(const uint8_t *data, size_t size) {
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        uint8x16_t bytes = vld1q_u8(data + i);
+
+        uint8x16_t special = vcleq_u8(bytes, vdupq_n_u8(' '));
+        special = vorrq_u8(special, vceqq_u8(bytes, vdupq_n_u8('/')));
+        special = vorrq_u8(special, vceqq_u8(bytes, vdupq_n_u8('"')));
+        special = vorrq_u8(special, vceqq_u8(bytes, vdupq_n_u8('\'')));
+        special = vorrq_u8(special, vceqq_u8(bytes, vdupq_n_u8('\\')));
+        special = vorrq_u8(special, vceqq_u8(bytes, vdupq_n_u8('#')));
+
+        if (uint64_t mask = byte_mask(special)) return i + __builtin_ctzll(mask) / 4;
+    }
+
+    while (i < size && is_plain(data[i])) ++i;
+    return i;
+}
+
+static size_t blank_run(const uint8_t *data, size_t size) {
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        uint8x16_t bytes = vld1q_u8(data + i);
+        uint8x16_t blank = vorrq_u8(vceqq_u8(bytes, vdupq_n_u8(' ')), vceqq_u8(bytes, vdupq_n_u8('\t')));
+
+        if (uint64_t mask = ~byte_mask(blank)) return i + __builtin_ctzll(mask) / 4;
+    }
+
+    while (i < size && is_blank(data[i])) ++i;
+    return i;
+}
+#else
+static size_t plain_run(const uint8_t *data, size_t size) {
+    size_t i = 0;
+    while (i < size && is_plain(data[i])) ++i;
+    return i;
+}
+
+static size_t blank_run(const uint8_t *data, size_t size) {
+    size_t i = 0;
+    while (i < size && is_blank(data[i])) ++i;
+    return i;
+}
+#endif
+
+// Rewrites a file into its tokens: comments and whitespace become a single
+// space between tokens, literals are kept verbatim and directives are put on
+// lines of their own. `breaks` gets the offset into `text` of every line
+// break and `columns` the column every token starts at in the file, which is
+// all the position of a token depends on.
+class TokenStream {
+public:
+    TokenStream(const uint8_t *data, size_t size)
+        : m_Data(data), m_Size(size) {
+        text.reserve(size);
+    }
+public:
+    void run();
+public:
+    std::string text;
+    std::vector<uint32_t> breaks, columns;
+
+    // End of the last token in `text`, breaks after it don't move anything
+    size_t tokens_end = 0;
+private:
+    // `next` is where the line after the break starts in the file
+    inline void line_break(size_t next) {
+        breaks.push_back(static_cast<uint32_t>(text.size()));
+        m_LineBegin = next;
+    }
+    void line_breaks(size_t from, size_t to);
+
+    void begin_token(size_t i);
+    size_t splice(size_t i) const;
+    size_t token_start() const;
+    bool after_number() const;
+    bool after_raw_prefix() const;
+
+    size_t line_comment(size_t i);
+    size_t block_comment(size_t i);
+    size_t quoted(size_t i, char quote);
+    size_t raw_string(size_t i);
+private:
+    const uint8_t *m_Data;
+    size_t m_Size;
+    size_t m_LineBegin = 0;
+
+    // Whitespace or a comment since the last token
+    bool m_Space = false;
+
+    // Nothing but whitespace on the line so far
+    bool m_LineStart = true;
+    bool m_Directive = false;
+};
+
+void TokenStream::line_breaks(size_t from, size_t to) {
+    for (size_t i = from; i < to; ++i) {
+        if (m_Data[i] == '\n') line_break(i + 1);
+    }
+}
+
+void TokenStream::begin_token(size_t i) {
+    if (m_Space && !text.empty() && text.back() != '\n') text += ' ';
+    columns.push_back(static_cast<uint32_t>(i - m_LineBegin));
+    m_Space = false;
+    m_LineStart = false;
+}
+
+// Length of the backslash and line break at `i`, 0 when there is none
+size_t TokenStream::splice(size_t i) const {
+    if (m_Data[i] != '\\' || i + 1 >= m_Size) return 0;
+    if (m_Data[i + 1] == '\n') return 2;
+    if (m_Data[i + 1] == '\r' && i + 2 < m_Size && m_Data[i + 2] == '\n') return 3;
+    return 0;
+}
+
+size_t TokenStream::token_start() const {
+    size_t start = text.size();
+    while (start > 0 && (is_identifier(text[start - 1]) || text[start - 1] == '.')) --start;
+    return start;
+}
+
+// A ' right after a number is a digit separator, like in 1'000'000
+bool TokenStream::after_number() const {
+    if (m_Space) return false;
+
+    size_t start = token_start();
+    if (start == text.size()) return false;
+    return is_digit(text[start]) || (text[start] == '.' && start + 1 < text.size() && is_digit(text[start + 1]));
+}
+
+bool TokenStream::after_raw_prefix() const {
+    if (m_Space) return false;
+
+    std::string_view prefix = std::string_view(text).substr(token_start());
+    return prefix == "R" || prefix == "u8R" || prefix == "uR" || prefix == "UR" || prefix == "LR";
+}
+
+// Up to the line break, which still ends the line. A splice continues the comment.
+size_t TokenStream::line_comment(size_t i) {
+    size_t from = i + 2;
+
+    while (from < m_Size) {
+        const void *found = std::memchr(m_Data + from, '\n', m_Size - from);
+        if (!found) break;
+
+        size_t at = static_cast<const uint8_t *>(found) - m_Data;
+        size_t end = at > i + 2 && m_Data[at - 1] == '\r' ? at - 1 : at;
+
+        if (end <= i + 2 || m_Data[end - 1] != '\\') return at;
+
+        line_break(at + 1);
+        from = at + 1;
+    }
+
+    return m_Size;
+}
+
+size_t TokenStream::block_comment(size_t i) {
+    size_t from = i + 2, end = m_Size;
+
+    while (from < m_Size) {
+        const void *found = std::memchr(m_Data + from, '/', m_Size - from);
+        if (!found) break;
+
+        size_t at = static_cast<const uint8_t *>(found) - m_Data;
+        if (at > i + 2 && m_Data[at - 1] == '*') {
+            end = at + 1;
+            break;
+        }
+        from = at + 1;
+    }
+
+    line_breaks(i, end);
+    return end;
+}
+
+// A string or character literal up to its closing quote, or the end of the
+// line when it has none. Splices inside go, like in translation phase 2.
+size_t TokenStream::quoted(size_t i, char quote) {
+    text += static_cast<char>(m_Data[i++]);
+
+    while (i < m_Size) {
+        char c = static_cast<char>(m_Data[i]);
+
+        if (size_t length = splice(i)) {
+            line_break(i + length);
+            i += length;
+            continue;
+        }
+
+        if (c == '\n') break;
+
+        if (c == '\\' && i + 1 < m_Size) {
+            text += c;
+            text += static_cast<char>(m_Data[i + 1]);
+            i += 2;
+            continue;
+        }
+
+        text += c;
+        ++i;
+        if (c == quote) break;
+    }
+
+    return i;
+}
+
+// R"delim( ... )delim", everything in between is kept as is
+size_t TokenStream::raw_string(size_t i) {
+    size_t open = i + 1;
+    while (open < m_Size && open - i <= 17 && m_Data[open] != '(' && m_Data[open] > ' ') ++open;
+    if (open >= m_Size || m_Data[open] != '(') return quoted(i, '"');
+
+    std::string close = ")";
+    close.append(reinterpret_cast<const char *>(m_Data + i + 1), open - i - 1);
+    close += '"';
+
+    std::string_view rest(reinterpret_cast<const char *>(m_Data), m_Size);
+    size_t found = rest.find(close, open + 1);
+    size_t end = found == std::string_view::npos ? m_Size : found + close.size();
+
+    line_breaks(i, end);
+
+    text.append(reinterpret_cast<const char *>(m_Data + i), end - i);
+    return end;
+}
+
+void TokenStream::run() {
+    size_t i = 0;
+
+    while (i < m_Size) {
+        if (size_t run = plain_run(m_Data + i, m_Size - i)) {
+            begin_token(i);
+            text.append(reinterpret_cast<const char *>(m_Data + i), run);
+            tokens_end = text.size();
+            i += run;
+            continue;
+        }
+
+        char c = static_cast<char>(m_Data[i]);
+
+        if (c == ' ' || c == '\t') {
+            m_Space = true;
+            i += blank_run(m_Data + i, m_Size - i);
+        } else if (c == '\r' || c == '\v' || c == '\f') {
+            m_Space = true;
+            ++i;
+        } else if (c == '\n') {
+            line_break(i + 1);
+
+            // Only the line break that ends a directive means something
+            if (m_Directive) {
+                text += '\n';
+                m_Directive = false;
+                m_Space = false;
+            } else {
+                m_Space = true;
+            }
+
+            m_LineStart = true;
+            ++i;
+        } else if (c == '/' && i + 1 < m_Size && m_Data[i + 1] == '/') {
+            m_Space = true;
+            i = line_comment(i);
+        } else if (c == '/' && i + 1 < m_Size && m_Data[i + 1] == '*') {
+            m_Space = true;
+            i = block_comment(i);
+        } else if (size_t length = splice(i)) {
+            line_break(i + length);
+            i += length;
+        } else if (c == '#' && m_LineStart) {
+            if (!text.empty() && text.back() != '\n') text += '\n';
+            m_Space = false;
+            m_LineStart = false;
+            m_Directive = true;
+
+            columns.push_back(static_cast<uint32_t>(i - m_LineBegin));
+            text += '#';
+            tokens_end = text.size();
+            ++i;
+        } else if (c == '"') {
+            bool raw = after_raw_prefix();
+            begin_token(i);
+            i = raw ? raw_string(i) : quoted(i, '"');
+            tokens_end = text.size();
+        } else if (c == '\'' && !after_number()) {
+            begin_token(i);
+            i = quoted(i, '\'');
+            tokens_end = text.size();
+        } else {
+            begin_token(i);
+            text += c;
+            tokens_end = text.size();
+            ++i;
+        }
+    }
+
+    // A directive on the last line ends the same with or without a line break
+    if (m_Directive) text += '\n';
+}
+
+static bool is_macro_name(std::string_view name) {
+    if (name.size() < 2 || is_digit(name[0])) return false;
+
+    bool letter = false;
+    for (char c : name) {
+        if (c >= 'A' && c <= 'Z') {
+            letter = true;
+        } else if (!is_digit(c) && c != '_') {
+            return false;
+        }
+    }
+    return letter;
+}
+
+// Names that expand to the line they are used on, or likely do. A macro call
+// like LOG(...) or CHECK(...) usually ends in __FILE__ and __LINE__.
+static bool is_line_sensitive(const std::string &text) {
+    size_t i = 0, size = text.size();
+
+    while (i < size) {
+        if (!is_identifier(text[i])) {
+            ++i;
+            continue;
+        }
+
+        size_t start = i;
+        while (i < size && is_identifier(text[i])) ++i;
+        if (is_digit(text[start])) continue;
+
+        std::string_view name(text.data() + start, i - start);
+        if (name == "__LINE__" || name == "__builtin_LINE" || name == "assert" || name == "source_location") {
+            return true;
+        }
+
+        if (!is_macro_name(name)) continue;
+
+        size_t next = i < size && text[i] == ' ' ? i + 1 : i;
+        if (next >= size || text[next] != '(') continue;
+
+        // Defining a macro doesn't use it
+        std::string_view before(text.data(), start);
+        if (before.size() >= 7 && before.substr(before.size() - 7) == "define ") continue;
+
+        return true;
+    }
+
+    return false;
+}
+
+TokenFingerprint fingerprint_tokens(const char *data, size_t size) {
+    TokenStream stream(reinterpret_cast<const uint8_t *>(data), size);
+    stream.run();
+
+    std::vector<uint32_t> &breaks = stream.breaks;
+    while (!breaks.empty() && breaks.back() >= stream.tokens_end) breaks.pop_back();
+
+    TokenFingerprint fingerprint;
+    fingerprint.tokens = hash_content(stream.text.data(), stream.text.size());
+
+    ContentHash parts[3] = {
+        fingerprint.tokens,
+        hash_content(breaks.data(), breaks.size() * sizeof(uint32_t)),
+        hash_content(stream.columns.data(), stream.columns.size() * sizeof(uint32_t))
+    };
+    fingerprint.lines = hash_content(parts, sizeof(parts));
+
+    fingerprint.line_sensitive = is_line_sensitive(stream.text);
+    return fingerprint;
+}
+
+bool fingerprint_file(const std::string &path, TokenFingerprint &fingerprint) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    std::string content;
+    if (fstat(fd, &st) == 0) content.reserve(st.st_size);
+
+    char buffer[64 * 1024];
+    while (true) {
+        ssize_t size = read(fd, buffer, sizeof(buffer));
+        if (size == 0) break;
+        if (size < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return false;
+        }
+        content.append(buffer, size);
+    }
+
+    close(fd);
+    fingerprint = fingerprint_tokens(content.data(), content.size());
+    return true;
+}
+
+bool has_token_syntax(std::string_view path) {
+    static const std::string_view EXTENSIONS[] = {
+        ".c", ".cc", ".cpp", ".cxx", ".c++", ".C",
+        ".h", ".hh", ".hpp", ".hxx", ".h++", ".H",
+        ".inl", ".ipp", ".tcc", ".tpp"
+    };
+
+    size_t dot = path.find_last_of("./");
+    if (dot == std::string_view::npos || path[dot] != '.') return false;
+
+    std::string_view extension = path.substr(dot);
+    return std::find(std::begin(EXTENSIONS), std::end(EXTENSIONS), extension) != std::end(EXTENSIONS);
+}
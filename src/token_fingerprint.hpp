@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "content_hash.hpp"
+
+// What a C or C++ file says to the compiler, with comments and the amount of
+// whitespace left out. Whether whitespace separates two tokens is kept, since
+// stringizing and `#define F (x)` depend on it, and so are the line breaks
+// that end preprocessor directives.
+struct TokenFingerprint {
+    ContentHash tokens;
+
+    // `tokens` plus the line and column every token is on
+    ContentHash lines;
+
+    // The file uses __LINE__, assert, source_location or an ALL_CAPS macro call,
+    // any of which may put line numbers into the object. A macro can expand
+    // __LINE__ in another file, so whether this decides the hash of a file is
+    // up to the caller, see hash_input_contents.
+    bool line_sensitive = false;
+
+    // `lines` when the file or one it's compiled with is line sensitive, or
+    // the object gets debug info
+    inline const ContentHash &select(bool lines_matter) const {
+        return lines_matter || line_sensitive ? lines : tokens;
+    }
+};
+
+TokenFingerprint fingerprint_tokens(const char *data, size_t size);
+
+// False when the file can't be read
+bool fingerprint_file(const std::string &path, TokenFingerprint &fingerprint);
+
+// Sources and headers by extension, other files have no token syntax weld knows
+bool has_token_syntax(std::string_view path);
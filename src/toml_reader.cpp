@@ -1,12 +1,19 @@
 #include "toml_reader.hpp"
 
+#include <algorithm>
 #include <cstdlib>
 #include <filesystem>
+#include <future>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "toml.hpp"
 #include "dependencies.hpp"
+#include "threadpool.hpp"
 
 TOMLReader::TOMLReader(std::filesystem::path path) {
     auto weld_build_data = toml::parse(path.string() + "/weld.toml", toml::spec::v(1, 1, 0));
@@ -130,9 +137,9 @@ TOMLReader::TOMLReader(std::filesystem::path path) {
             }
             
             if (gnuc_settings.contains("lflags")) {
-                std::vector<std::string> lflags = toml::find<std::vector<std::string>>(gnuc_settings, "cflags");
+                std::vector<std::string> lflags = toml::find<std::vector<std::string>>(gnuc_settings, "lflags");
                 for (auto lflag : lflags) {
-                    m_Data.cflags.push_back(lflag);
+                    m_Data.lflags.push_back(lflag);
                 }
             }
         } else {
@@ -157,6 +164,60 @@ TOMLReader::TOMLReader(std::filesystem::path path) {
             exit(1);
         }
         
-        m_Data.deps.read(path);
+        m_Data.deps.read(weld_build_data);
     }
-}
\ No newline at end of file
+}
+
+// Every manifest parsed so far, keyed by its canonical dir. Entries are never
+// erased, so the references handed out stay valid for the whole invocation.
+static std::unordered_map<std::string, TOMLData> manifests;
+static std::mutex manifests_mutex;
+
+static std::string manifest_key(const std::filesystem::path &dir) {
+    return std::filesystem::weakly_canonical(dir).string();
+}
+
+const TOMLData &load_manifest(const std::filesystem::path &dir) {
+    std::string key = manifest_key(dir);
+    
+    {
+        std::lock_guard<std::mutex> lock(manifests_mutex);
+        if (auto it = manifests.find(key); it != manifests.end()) return it->second;
+    }
+    
+    TOMLReader reader(key);
+    
+    std::lock_guard<std::mutex> lock(manifests_mutex);
+    return manifests.try_emplace(key, std::move(reader.get_data())).first->second;
+}
+
+void preload_manifests(const std::vector<std::filesystem::path> &dirs) {
+    std::unordered_set<std::string> seen;
+    std::vector<std::string> wave;
+    
+    for (const auto &dir : dirs) {
+        std::string key = manifest_key(dir);
+        if (seen.insert(key).second) wave.push_back(key);
+    }
+    
+    ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    
+    // Each wave is the deps of the last one nobody asked for yet
+    while (!wave.empty()) {
+        std::vector<std::future<void>> parses;
+        for (const auto &key : wave) {
+            parses.push_back(pool.enqueue([&key]() { load_manifest(key); }));
+        }
+        for (auto &parse : parses) parse.get();
+        
+        std::vector<std::string> next;
+        for (const auto &key : wave) {
+            for (const auto &dep : load_manifest(key).deps.m_Dependencies) {
+                std::string dep_key = manifest_key(key + "/" + std::get<0>(dep));
+                if (seen.insert(dep_key).second) next.push_back(dep_key);
+            }
+        }
+        
+        wave = std::move(next);
+    }
+}
@@ -42,3 +42,11 @@ public:
 private:
     TOMLData m_Data;
 };
+
+// Parses the weld.toml in `dir` once per invocation, every later call for the
+// same dir returns the same data. The project path of the data is canonical.
+const TOMLData &load_manifest(const std::filesystem::path &dir);
+
+// Parses the manifests in `dirs` and everything they depend on, the manifests
+// of a wave of deps in parallel
+void preload_manifests(const std::vector<std::filesystem::path> &dirs);
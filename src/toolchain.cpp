@@ -0,0 +1,244 @@
+#include "toolchain.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.hpp"
+#include "hash.hpp"
+#include "process.hpp"
+
+static constexpr char PROBE_MAGIC[8] = { 'W', 'E', 'L', 'D', 'T', 'O', 'O', 'L' };
+static constexpr uint32_t PROBE_VERSION = 2;
+
+template<typename T>
+static void write_value(std::ostream &out, const T &value) {
+    out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void write_string(std::ostream &out, const std::string &str) {
+    write_value(out, static_cast<uint32_t>(str.size()));
+    out.write(str.data(), str.size());
+}
+
+static void write_strings(std::ostream &out, const std::vector<std::string> &strings) {
+    write_value(out, static_cast<uint32_t>(strings.size()));
+    for (const auto &str : strings) write_string(out, str);
+}
+
+template<typename T>
+static bool read_value(std::istream &in, T &value) {
+    return static_cast<bool>(in.read(reinterpret_cast<char *>(&value), sizeof(value)));
+}
+
+static bool read_string(std::istream &in, std::string &str) {
+    uint32_t size;
+    if (!read_value(in, size)) return false;
+    str.resize(size);
+    return static_cast<bool>(in.read(str.data(), size));
+}
+
+static bool read_strings(std::istream &in, std::vector<std::string> &strings) {
+    uint32_t count;
+    if (!read_value(in, count)) return false;
+    strings.resize(count);
+
+    for (auto &str : strings) {
+        if (!read_string(in, str)) return false;
+    }
+    return true;
+}
+
+uint64_t ToolProbe::identity() const {
+    if (digest == ContentHash()) return 0;
+
+    Hasher hasher;
+    hasher.update_value(digest);
+    hasher.update(version);
+    hasher.update(target);
+
+    for (const auto &dir : include_dirs) hasher.update(dir);
+    hasher.update("");
+    for (const auto &dir : library_dirs) hasher.update(dir);
+
+    return hasher.digest();
+}
+
+Toolchain::Toolchain(std::filesystem::path path)
+    : m_Path(std::move(path)) {
+    load();
+}
+
+std::filesystem::path Toolchain::default_path() {
+    return CompileCache::default_dir() / "toolchains";
+}
+
+void Toolchain::load() {
+    std::ifstream in(m_Path, std::ios::binary);
+    if (!in.is_open()) return;
+
+    char magic[sizeof(PROBE_MAGIC)];
+    uint32_t version;
+    uint64_t count;
+
+    if (!in.read(magic, sizeof(magic))
+        || std::string_view(magic, sizeof(magic)) != std::string_view(PROBE_MAGIC, sizeof(PROBE_MAGIC))
+        || !read_value(in, version) || version != PROBE_VERSION
+        || !read_value(in, count)) {
+        // Tools are probed again
+        return;
+    }
+
+    for (uint64_t i = 0; i < count; ++i) {
+        std::string path;
+        ToolProbe probe;
+
+        if (!read_string(in, path)
+            || !read_value(in, probe.inode)
+            || !read_value(in, probe.size)
+            || !read_value(in, probe.mtime)
+            || !read_value(in, probe.digest)
+            || !read_string(in, probe.version)
+            || !read_string(in, probe.target)
+            || !read_strings(in, probe.include_dirs)
+            || !read_strings(in, probe.library_dirs)) {
+            m_Probes.clear();
+            return;
+        }
+
+        m_Probes[path] = std::move(probe);
+    }
+}
+
+bool Toolchain::save() {
+    if (!m_Changed) return true;
+
+    std::error_code ec;
+    std::filesystem::create_directories(m_Path.parent_path(), ec);
+
+    // Other builds may save at the same time, the last rename wins
+    std::filesystem::path tmp_path = m_Path;
+    tmp_path += "." + std::to_string(getpid()) + ".tmp";
+
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) return false;
+
+        out.write(PROBE_MAGIC, sizeof(PROBE_MAGIC));
+        write_value(out, PROBE_VERSION);
+        write_value(out, static_cast<uint64_t>(m_Probes.size()));
+
+        for (const auto &[path, probe] : m_Probes) {
+            write_string(out, path);
+            write_value(out, probe.inode);
+            write_value(out, probe.size);
+            write_value(out, probe.mtime);
+            write_value(out, probe.digest);
+            write_string(out, probe.version);
+            write_string(out, probe.target);
+            write_strings(out, probe.include_dirs);
+            write_strings(out, probe.library_dirs);
+        }
+    }
+
+    std::filesystem::rename(tmp_path, m_Path, ec);
+    if (ec) {
+        std::filesystem::remove(tmp_path, ec);
+        return false;
+    }
+
+    m_Changed = false;
+    return true;
+}
+
+static bool is_compiler(const std::string &name) {
+    return name == "cc" || name == "c++"
+        || name.find("gcc") != std::string::npos
+        || name.find("g++") != std::string::npos
+        || name.find("clang") != std::string::npos;
+}
+
+static std::string first_line(const std::string &output) {
+    return output.substr(0, output.find('\n'));
+}
+
+// The lines between "#include <...> search starts here:" and "End of search list."
+static std::vector<std::string> parse_include_dirs(const std::string &output) {
+    std::vector<std::string> dirs;
+    std::istringstream lines(output);
+    bool in_list = false;
+
+    for (std::string line; std::getline(lines, line); ) {
+        if (line.rfind("#include <...>", 0) == 0) {
+            in_list = true;
+        } else if (line.rfind("End of search list", 0) == 0) {
+            break;
+        } else if (in_list && !line.empty() && line[0] == ' ') {
+            std::string dir = line.substr(1);
+
+            // Darwin marks framework dirs
+            if (size_t suffix = dir.find(" (framework directory)"); suffix != std::string::npos) dir.erase(suffix);
+            dirs.push_back(std::filesystem::path(dir).lexically_normal().string());
+        }
+    }
+
+    return dirs;
+}
+
+// `libraries: =dir:dir:...` from -print-search-dirs
+static std::vector<std::string> parse_library_dirs(const std::string &output) {
+    std::vector<std::string> dirs;
+    std::istringstream lines(output);
+
+    for (std::string line; std::getline(lines, line); ) {
+        if (line.rfind("libraries: =", 0) != 0) continue;
+
+        std::istringstream list(line.substr(12));
+        for (std::string dir; std::getline(list, dir, ':'); ) {
+            if (!dir.empty()) dirs.push_back(std::filesystem::path(dir).lexically_normal().string());
+        }
+    }
+
+    return dirs;
+}
+
+const ToolProbe &Toolchain::probe(const std::string &path) {
+    static const ToolProbe missing;
+
+    struct stat st;
+    if (path.empty() || stat(path.c_str(), &st) != 0) return missing;
+
+    uint64_t mtime = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ull + st.st_mtim.tv_nsec;
+
+    auto it = m_Probes.find(path);
+    if (it != m_Probes.end()
+        && it->second.inode == st.st_ino
+        && it->second.size == static_cast<uint64_t>(st.st_size)
+        && it->second.mtime == mtime) {
+        return it->second;
+    }
+
+    ToolProbe probe;
+    probe.inode = st.st_ino;
+    probe.size = st.st_size;
+    probe.mtime = mtime;
+    hash_file(path, probe.digest);
+    probe.version = first_line(Process::capture({ path, "--version" }).output);
+
+    std::string name = std::filesystem::path(path).filename().string();
+
+    if (is_compiler(name)) {
+        ProcessResult machine = Process::capture({ path, "-dumpmachine" });
+        if (machine.exit_code == 0) probe.target = first_line(machine.output);
+
+        const char *language = name.find("++") != std::string::npos ? "c++" : "c";
+        probe.include_dirs = parse_include_dirs(Process::capture({ path, "-E", "-x", language, "-v", "/dev/null" }).output);
+        probe.library_dirs = parse_library_dirs(Process::capture({ path, "-print-search-dirs" }).output);
+    }
+
+    m_Changed = true;
+    return m_Probes[path] = std::move(probe);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "content_hash.hpp"
+
+// What a compiler, linker or archiver is, as far as its outputs are concerned
+struct ToolProbe {
+    // The stat data of the binary the probe was taken from
+    uint64_t inode = 0, size = 0, mtime = 0;
+
+    // Content hash of the binary
+    ContentHash digest;
+
+    // First line of `--version`, and for compilers `-dumpmachine` and the
+    // dirs searched for system headers and libraries
+    std::string version, target;
+    std::vector<std::string> include_dirs, library_dirs;
+
+    // 0 for a tool that couldn't be found
+    uint64_t identity() const;
+};
+
+// Probes each tool once. Probes are persisted in a file keyed by the path
+// of the tool and reused while its inode, size and mtime stay the same, so
+// a warm build doesn't start a single tool just to look at it.
+class Toolchain {
+public:
+    Toolchain(std::filesystem::path path = default_path());
+public:
+    const ToolProbe &probe(const std::string &path);
+    bool save();
+
+    // Next to the compile cache, probes are shared by every build of the user
+    static std::filesystem::path default_path();
+private:
+    void load();
+private:
+    std::filesystem::path m_Path;
+    std::unordered_map<std::string, ToolProbe> m_Probes;
+    bool m_Changed = false;
+};
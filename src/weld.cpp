@@ -1,31 +1,29 @@
 #include <algorithm>
+#include <cstdio>
 #include <cstdlib>
 #include <filesystem>
-#include <future>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "weld.hpp"
+#include "cache.hpp"
+#include "dir_walker.hpp"
+#include "distributed.hpp"
+#include "git_index.hpp"
 #include "command.hpp"
-#include "threadpool.hpp"
+#include "graph.hpp"
+#include "plan_snapshot.hpp"
+#include "sandbox.hpp"
 #include "toml_reader.hpp"
-
-std::vector<std::filesystem::path> get_args_with_extensions(const std::filesystem::path& dir, const std::vector<std::string>& extensions) {
-    std::vector<std::filesystem::path> result;
-
-    for (const auto& entry : std::filesystem::recursive_directory_iterator(dir)) {
-        if (std::filesystem::is_regular_file(entry)) {
-            std::string ext = entry.path().extension().string();
-
-            if (std::find(extensions.begin(), extensions.end(), ext) != extensions.end()) {
-                result.push_back(entry.path());
-            }
-        }
-    }
-
-    return result;
-}
+#include "toolchain.hpp"
 
 std::string find_exec_path(std::string name) {
-    std::string path;
+    // PATH doesn't change while weld runs, so every tool is looked up once
+    static std::unordered_map<std::string, std::string> found;
+    if (auto it = found.find(name); it != found.end()) return it->second;
+    
+    std::string &path = found[name];
     try {
         const char* path_env = std::getenv("PATH");
         if (!path_env) {
@@ -41,174 +39,255 @@ std::string find_exec_path(std::string name) {
         #endif
         
         size_t pos = 0;
-        while ((pos = path_list.find(path_seperator)) != std::string::npos) {
+        while (!path_list.empty()) {
+            pos = path_list.find(path_seperator);
             std::string dir = path_list.substr(0, pos);
-            path_list.erase(0, pos + 1);
+            path_list.erase(0, pos == std::string::npos ? pos : pos + 1);
             std::filesystem::path exec_path = std::filesystem::path(dir) / name;
             if (std::filesystem::exists(exec_path) && std::filesystem::is_regular_file(exec_path)) {
-                return exec_path;
+                path = exec_path.string();
+                return path;
             }
         }
     } catch (const std::exception& e) {
         std::cerr << "Error: failed to find executable " + name + " in path: " << e.what() << std::endl;
     }
 
-    return "";
+    return path;
 }
 
-void exclude_files_and_folders(
-    const std::filesystem::path &root_dir, 
-    std::vector<std::filesystem::path> &files, 
-    const std::vector<std::string> &exclude
-) {
-    std::filesystem::path root_path(root_dir);
-    
-    for (auto it = files.begin(); it != files.end(); ) {
-        bool should_exclude = false;
-        
-        for (const auto &excluded : exclude) {
-            std::filesystem::path excluded_path = root_path / excluded;
-            
-            if (excluded_path.has_filename() == false) {
-                excluded_path = excluded_path.parent_path();
-            }
-            
-            excluded_path = excluded_path.lexically_normal();
-            
-            std::filesystem::path current_path = *it;
-            
-            current_path = current_path.lexically_normal(); 
-            
-            if (current_path == excluded_path) {
-                should_exclude = true;
-                break;
-            }
-            
-            if (current_path.string().find(excluded_path.string() + std::filesystem::path::preferred_separator) == 0) {
-                should_exclude = true;
-                break;
-            }
-        }
-        
-        if (should_exclude) {
-            it = files.erase(it);
-        } else {
-            ++it;
-        }
-    }
+// `path` as seen from `base`, so command lines stay the same wherever the tree is checked out
+std::string relative_path(const std::string &path, const std::string &base) {
+    std::filesystem::path relative = std::filesystem::path(path).lexically_normal()
+        .lexically_relative(std::filesystem::path(base).lexically_normal());
+    return relative.empty() ? path : relative.string();
 }
 
-void build_and_add_dep(std::tuple<std::string, bool> &dep, TOMLData &data, TOMLData &dep_data) {
+// The flags of a project plus the ones its deps add, manifests themselves stay as parsed
+struct ProjectFlags {
+    std::vector<std::string> cflags, lflags;
+};
+
+// Commands run inside the project dir, `out_path` is where the project itself is linked
+void build_and_add_dep(
+    const std::tuple<std::string, bool> &dep,
+    const std::string &project_path,
+    const TOMLData &dep_data,
+    ProjectFlags &flags,
+    const std::string &out_path
+) {
     #ifdef __linux__
+        std::string dep_path = project_path + "/" + std::get<0>(dep);
+        std::string include_dir = relative_path(dep_path + "/" + dep_data.include_dir, project_path);
+        std::string dep_out_path = dep_path + "/" + dep_data.out_dir;
+        
         if (dep_data.project_type == "SharedLib") {
             if (std::get<1>(dep)) {
-                data.cflags.push_back("-I" + data.project_path + "/" + std::get<0>(dep) + "/" + dep_data.include_dir);
-                data.lflags.push_back("-I" + data.project_path + "/" + std::get<0>(dep) + "/" + dep_data.include_dir);
+                flags.cflags.push_back("-I" + include_dir);
+                flags.lflags.push_back("-I" + include_dir);
             }
             
-            data.lflags.push_back("-L" + data.project_path + "/" + std::get<0>(dep) + "/" + dep_data.out_dir);
-            data.lflags.push_back("-Wl,-rpath," + data.project_path + "/" + std::get<0>(dep) + "/" + dep_data.out_dir);
-            data.lflags.push_back("-l" + dep_data.project_name);
+            flags.lflags.push_back("-L" + relative_path(dep_out_path, project_path));
+            flags.lflags.push_back("-Wl,-rpath,$ORIGIN/" + relative_path(dep_out_path, out_path));
+            flags.lflags.push_back("-l" + dep_data.project_name);
         } else if (dep_data.project_type == "StaticLib") {
             if (std::get<1>(dep)) {
-                data.cflags.push_back("-I" + data.project_path + "/" + std::get<0>(dep) + "/" + dep_data.include_dir);
-                data.lflags.push_back("-I" + data.project_path + "/" + std::get<0>(dep) + "/" + dep_data.include_dir);
+                flags.cflags.push_back("-I" + include_dir);
+                flags.lflags.push_back("-I" + include_dir);
             }
             
-            data.lflags.push_back("-L" + data.project_path + "/" + std::get<0>(dep) + "/" + dep_data.out_dir);
-            data.lflags.push_back("-l" + dep_data.project_name);
+            flags.lflags.push_back("-L" + relative_path(dep_out_path, project_path));
+            flags.lflags.push_back("-l" + dep_data.project_name);
         } else if (dep_data.project_type == "Utility") {
             if (std::get<1>(dep)) {
-                data.cflags.push_back("-I" + data.project_path + "/" + std::get<0>(dep) + "/" + dep_data.include_dir);
-                data.lflags.push_back("-I" + data.project_path + "/" + std::get<0>(dep) + "/" + dep_data.include_dir);
+                flags.cflags.push_back("-I" + include_dir);
+                flags.lflags.push_back("-I" + include_dir);
             }
         }
     #endif
 }
 
 void build_and_add_dep_member(
-    std::tuple<std::string, bool> &dep,
-    TOMLData &member_data,
-    TOMLData &dep_data,
-    std::string &full_out_path
+    const std::tuple<std::string, bool> &dep,
+    const std::string &project_path,
+    const TOMLData &dep_data,
+    ProjectFlags &flags,
+    const std::string &full_out_path,
+    const std::string &out_path
 ) {
     #ifdef __linux__
+        std::string include_dir = relative_path(
+            project_path + "/" + std::get<0>(dep) + "/" + dep_data.include_dir, project_path);
+        std::string dep_out_path = full_out_path + "/" + dep_data.project_name;
+        
         if (dep_data.project_type == "SharedLib") {
             if (std::get<1>(dep)) {
-                member_data.cflags.push_back("-I" + member_data.project_path + "/" + std::get<0>(dep) + "/" + dep_data.include_dir);
-                member_data.lflags.push_back("-I" + member_data.project_path + "/" + std::get<0>(dep) + "/" + dep_data.include_dir);
+                flags.cflags.push_back("-I" + include_dir);
+                flags.lflags.push_back("-I" + include_dir);
             }
             
-            member_data.lflags.push_back("-L" + full_out_path + "/" + dep_data.project_name);
-            member_data.lflags.push_back("-Wl,-rpath," + full_out_path + "/" + dep_data.project_name);
-            member_data.lflags.push_back("-l" + dep_data.project_name);
+            flags.lflags.push_back("-L" + relative_path(dep_out_path, project_path));
+            flags.lflags.push_back("-Wl,-rpath,$ORIGIN/" + relative_path(dep_out_path, out_path));
+            flags.lflags.push_back("-l" + dep_data.project_name);
         } else if (dep_data.project_type == "StaticLib") {
             if (std::get<1>(dep)) {
-                member_data.cflags.push_back("-I" + member_data.project_path + "/" + std::get<0>(dep) + "/" + dep_data.include_dir);
-                member_data.lflags.push_back("-I" + member_data.project_path + "/" + std::get<0>(dep) + "/" + dep_data.include_dir);
+                flags.cflags.push_back("-I" + include_dir);
+                flags.lflags.push_back("-I" + include_dir);
             }
             
-            member_data.lflags.push_back("-L" + full_out_path + "/" + dep_data.project_name);
-            member_data.lflags.push_back("-l" + dep_data.project_name);
+            flags.lflags.push_back("-L" + relative_path(dep_out_path, project_path));
+            flags.lflags.push_back("-l" + dep_data.project_name);
         } else if (dep_data.project_type == "Utility") {
             if (std::get<1>(dep)) {
-                member_data.cflags.push_back("-I" + member_data.project_path + "/" + std::get<0>(dep) + "/" + dep_data.include_dir);
-                member_data.lflags.push_back("-I" + member_data.project_path + "/" + std::get<0>(dep) + "/" + dep_data.include_dir);
+                flags.cflags.push_back("-I" + include_dir);
+                flags.lflags.push_back("-I" + include_dir);
             }
         }
     #endif
 }
 
-inline void run_build_commands(const size_t stage, TOMLData data) {
+struct ProjectNodes {
+    // Consumers can start compiling once `headers` finished, and link once `done` finished
+    size_t headers, done;
+    
+    // The library consumers link against, empty for anything else
+    std::string library;
+};
+
+struct BuildPlan {
+    BuildGraph graph;
+
+    // Every planned project keyed by its canonical path, so each one is built once
+    std::unordered_map<std::string, ProjectNodes> projects;
+    std::unordered_set<std::string> planning;
+
+    // Workspace members and the workspace out dir they are built into
+    std::unordered_map<std::string, std::string> members;
+
+    // Nodes that have to finish before any project starts
+    std::vector<size_t> before;
+
+    Toolchain toolchain;
+
+    // Everything the plan was resolved from, for the snapshot
+    PlanInputs inputs;
+    
+    SourceDiscovery sources = SourceDiscovery::Walk;
+    
+    // Listings of the source dirs from the last time the plan was resolved
+    ListingCache *listings = nullptr;
+};
+
+inline std::string project_key(const std::string &path) {
+    return std::filesystem::weakly_canonical(path).string();
+}
+
+size_t add_build_commands(BuildGraph &graph, const size_t stage, const TOMLData &data) {
+    Action action;
+    
     auto bcmds = std::find_if(data.build_commands.begin(), data.build_commands.end(),
         [stage](const TOMLCommand& cmd) { return cmd.stage == stage; });
     
     if (bcmds != data.build_commands.end()) {
-        for (const auto& command : bcmds->cmds) {
-            Commands::run(command);
-        }
+        action.kind = ActionKind::Command;
+        action.commands = bcmds->cmds;
     }
+    
+    return graph.add(action);
 }
 
-void build_project_gnuc(TOMLData data) {
-    std::string full_src_path = data.project_path + "/" + data.src_dir;
-    std::string full_out_path = data.project_path + "/" + data.out_dir;
+ProjectNodes plan_project_gnuc(BuildPlan &plan, const TOMLData &data, const std::string &out_path) {
+    std::string key = project_key(data.project_path);
+    
+    if (auto planned = plan.projects.find(key); planned != plan.projects.end()) {
+        return planned->second;
+    }
+    
+    // The compiler sees the resolved dir as its cwd, so prefix maps and relative paths start from it
+    const std::string &project_path = key;
+    ProjectFlags flags = { data.cflags, data.lflags };
+    std::string full_out_path = project_key(out_path);
+    
+    if (!plan.planning.insert(key).second) {
+        std::cerr << "error: dependency cycle through " + data.project_name << std::endl;
+        exit(1);
+    }
+    
+    // Normal, so the walked paths and the objects named after them are too
+    std::string full_src_path = (std::filesystem::path(project_path) / data.src_dir).lexically_normal().string();
+    if (full_src_path.size() > 1 && full_src_path.back() == '/') full_src_path.pop_back();
+    plan.inputs.watch(project_path + "/weld.toml");
     
-    std::vector<std::filesystem::path> files 
-        = get_args_with_extensions(full_src_path, data.cextensions);
+    std::vector<std::string> source_dirs;
+    PathList files;
     
-    ThreadPool pool(std::thread::hardware_concurrency());
-    std::vector<std::future<void>> futures;
+    bool indexed = plan.sources == SourceDiscovery::GitIndex
+        && list_git_sources(full_src_path, data.cextensions, data.exclude, files, &source_dirs);
+    
+    if (!indexed) {
+        if (plan.sources == SourceDiscovery::GitIndex) {
+            std::cerr << "warning: no readable git index for " << full_src_path << ", listing it instead" << std::endl;
+        }
+        files = walk_sources(full_src_path, data.cextensions, data.exclude, &source_dirs, plan.listings);
+    }
+    for (auto &dir : source_dirs) plan.inputs.watch(dir);
     
     // Create the required output directory
     std::filesystem::create_directory(full_out_path);
     std::filesystem::create_directory(full_out_path + "/genobjs");
+    plan.inputs.require(full_out_path + "/genobjs");
     
     std::string gnuc_path = find_exec_path(data.toolset);
+    if (!gnuc_path.empty()) plan.inputs.watch(gnuc_path);
+    uint64_t gnuc_identity = plan.toolchain.probe(gnuc_path).identity();
     
-    exclude_files_and_folders(full_src_path, files, data.exclude);
+    std::vector<ProjectNodes> dep_nodes;
+    std::vector<std::string> dep_libraries;
     
-    for (std::tuple<std::string, bool> dep : data.deps.m_Dependencies) {
-        TOMLReader dep_reader(data.project_path + "/" + std::get<0>(dep));
-        TOMLData dep_data = dep_reader.get_data();
+    for (const auto &dep : data.deps.m_Dependencies) {
+        std::string dep_path = project_path + "/" + std::get<0>(dep);
+        const TOMLData &dep_data = load_manifest(dep_path);
+        plan.inputs.watch(dep_data.project_path + "/weld.toml");
+        
+        auto member = plan.members.find(project_key(dep_path));
         
-        if (dep_data.project_type != "Utility") {
-            if (dep_data.toolset == "gcc" || dep_data.toolset == "g++") {
-                build_project_gnuc(dep_data);
+        if (member != plan.members.end()) {
+            dep_nodes.push_back(plan_project_gnuc(plan, dep_data, member->second + "/" + dep_data.project_name));
+            build_and_add_dep_member(dep, project_path, dep_data, flags, member->second, full_out_path);
+        } else {
+            if (dep_data.project_type != "Utility") {
+                if (dep_data.toolset == "gcc" || dep_data.toolset == "g++") {
+                    dep_nodes.push_back(plan_project_gnuc(plan, dep_data, dep_data.project_path + "/" + dep_data.out_dir));
+                } else {
+                    std::cerr << "error: invalid toolset in " + dep_data.project_name << std::endl;
+                    exit(1);
+                }
             }
+            
+            build_and_add_dep(dep, project_path, dep_data, flags, full_out_path);
         }
-        
-        build_and_add_dep(dep, data, dep_data);
     }
     
-    run_build_commands(0, data);
-
+    for (auto &nodes : dep_nodes) {
+        if (!nodes.library.empty()) dep_libraries.push_back(nodes.library);
+    }
+    
+    BuildGraph &graph = plan.graph;
+    
+    size_t stage0 = add_build_commands(graph, 0, data);
+    for (size_t before : plan.before) graph.depend(stage0, before);
+    for (auto &nodes : dep_nodes) graph.depend(stage0, nodes.headers);
+    
+    size_t stage1 = add_build_commands(graph, 1, data);
+    size_t stage2 = add_build_commands(graph, 2, data);
+    graph.depend(stage1, stage0);
+    
     std::string out_name = data.project_name;
     #ifdef __linux__
         if (data.project_type == "SharedLib") {
-            data.cflags.push_back("-fPIC");
-            data.lflags.push_back("-fPIC");
-            data.lflags.push_back("-shared");
+            flags.cflags.push_back("-fPIC");
+            flags.lflags.push_back("-fPIC");
+            flags.lflags.push_back("-shared");
             out_name = "lib" + data.project_name + ".so";
         } else if (data.project_type == "StaticLib") {
             out_name = "lib" + data.project_name + ".a";
@@ -219,185 +298,262 @@ void build_project_gnuc(TOMLData data) {
             }
         }
         
-        for (auto &file : files) {
-            std::filesystem::path out_file = file.filename(); out_file.replace_extension(".o");
-            // if (std::filesystem::exists(data.project_path + "/" + data.out_dir)
-            //     && std::filesystem::exists(data.project_path + "/" + data.out_dir + "/genobjs")) {
-            //     if (std::filesystem::exists(
-            //         data.project_path + "/" + data.out_dir
-            //         + "/genobjs/" + out_file.string()
-            //     )) {
-            //         std::filesystem::path outf = data.project_path + "/" + data.out_dir
-            //             + "/genobjs/" + out_file.string();
-                    
-            //         if (std::filesystem::last_write_time(outf) > std::filesystem::last_write_time(file))
-            //             continue;
-            //     }
-            // }
+        // Sources quote their own headers from the include dir, that keeps it visible in the sandbox too
+        if (!data.include_dir.empty()) {
+            flags.cflags.insert(flags.cflags.end(), { "-iquote", std::filesystem::path(data.include_dir).lexically_normal().string() });
+        }
+        
+        std::vector<std::string> objects;
+        
+        for (size_t i = 0; i < files.size(); ++i) {
+            std::filesystem::path file = files[i];
             
-            std::cout << "Building ---> " + file.filename().string() + "\n";
-            pool.enqueue([=]() {
-                Commands::run(
-                    gnuc_path,
-                    data.cflags,
-                    "-c", file,
-                    "-o", full_out_path + "/genobjs/" + out_file.string()
-                );
-                
-                Commands::run(
-                    gnuc_path,
-                    "-MM",
-                    file,
-                    ">>", full_out_path + "/" + data.project_name + ".d"
-                );
-                
-                std::cout << "Finished ---> " << out_file.string() << std::endl;
+            // Objects mirror the source tree, so `a/util.cpp` and `b/util.cpp` don't collide
+            std::filesystem::path out_file = file.lexically_relative(full_src_path); out_file += ".o";
+            std::filesystem::path object = std::filesystem::path(full_out_path) / "genobjs" / out_file;
+            std::filesystem::create_directories(object.parent_path());
+            plan.inputs.require(object.parent_path().string());
+            
+            Action compile;
+            compile.kind = ActionKind::Compile;
+            compile.start_message = "Building ---> " + file.filename().string();
+            compile.finish_message = "Finished ---> " + out_file.string();
+            compile.cwd = project_path;
+            compile.toolchain = gnuc_identity;
+            compile.argv.push_back(gnuc_path);
+            compile.argv.insert(compile.argv.end(), flags.cflags.begin(), flags.cflags.end());
+            compile.depfile = object.string() + ".d";
+            
+            // Relative paths plus the prefix map keep the checkout dir out of the command and the object
+            compile.argv.insert(compile.argv.end(), {
+                "-ffile-prefix-map=" + project_path + "=.",
+                "-MD", "-MF", relative_path(compile.depfile, project_path),
+                "-c", relative_path(file.string(), project_path),
+                "-o", relative_path(object.string(), project_path)
             });
+            compile.inputs = { file };
+            compile.outputs = { object };
+            
+            size_t id = graph.add(compile);
+            graph.depend(id, stage0);
+            graph.depend(stage1, id);
+            
+            objects.push_back(object.string());
         }
         
-        pool.get();
+        std::vector<std::string> relative_objects;
+        for (auto &object : objects) relative_objects.push_back(relative_path(object, project_path));
         
-        run_build_commands(1, data);
-        
-        for (auto &file : files) {
-            file = std::filesystem::path(full_out_path + "/genobjs/").concat(file.filename().replace_extension(".o").string());
-        }
+        Action link;
+        link.cwd = project_path;
         
         if (data.project_type == "StaticLib") {
-            std::cout << "Creating ---> " << out_name << std::endl;
-            Commands::run(
-                find_exec_path("ar"),
-                "rcs",
-                full_out_path + "/" + out_name,
-                files
-            );
-            std::cout << "Finished Creating Static" << std::endl;
+            link.kind = ActionKind::Archive;
+            link.start_message = "Creating ---> " + out_name;
+            link.finish_message = "Finished Creating Static";
+            // D zeroes timestamps, uids and modes, so the archive only depends on the objects
+            std::string ar_path = find_exec_path("ar");
+            if (!ar_path.empty()) plan.inputs.watch(ar_path);
+            link.toolchain = plan.toolchain.probe(ar_path).identity();
+            link.argv = { ar_path, "rcsD", relative_path(full_out_path + "/" + out_name, project_path) };
+            link.argv.insert(link.argv.end(), relative_objects.begin(), relative_objects.end());
         } else {
-            std::cout << "Linking ---> " << data.project_name << std::endl;
-            Commands::run(
-                gnuc_path,
-                files,
-                data.lflags,
-                "-o", full_out_path + "/" + out_name
-            );
-            std::cout << "Finished Linking" << std::endl;
+            link.kind = ActionKind::Link;
+            link.start_message = "Linking ---> " + data.project_name;
+            link.finish_message = "Finished Linking";
+            link.toolchain = gnuc_identity;
+            link.argv = { gnuc_path };
+            link.argv.insert(link.argv.end(), relative_objects.begin(), relative_objects.end());
+            link.argv.insert(link.argv.end(), flags.lflags.begin(), flags.lflags.end());
+            link.argv.insert(link.argv.end(), { "-o", relative_path(full_out_path + "/" + out_name, project_path) });
+        }
+        
+        // Relink when an object or a linked library changed
+        link.inputs.assign(objects.begin(), objects.end());
+        if (link.kind == ActionKind::Link) {
+            link.inputs.insert(link.inputs.end(), dep_libraries.begin(), dep_libraries.end());
         }
+        link.outputs = { full_out_path + "/" + out_name };
+        
+        size_t link_id = graph.add(link);
+        graph.depend(link_id, stage1);
+        graph.depend(stage2, link_id);
+        
+        // Only a link needs the libraries of the deps, an archive just bundles objects
+        for (auto &nodes : dep_nodes) {
+            graph.depend(link.kind == ActionKind::Link ? link_id : stage2, nodes.done);
+        }
+    #else
+        graph.depend(stage2, stage1);
     #endif
     
-    run_build_commands(2, data);
+    ProjectNodes nodes = { stage0, stage2, "" };
+    
+    if (data.project_type == "SharedLib" || data.project_type == "StaticLib") {
+        nodes.library = full_out_path + "/" + out_name;
+    }
+    
+    plan.planning.erase(key);
+    plan.projects.emplace(key, nodes);
+    
+    return nodes;
 }
 
-void build_workspace_gnuc(TOMLData data) {
-    std::string full_src_path = data.project_path + "/" + data.src_dir;
-    std::string full_out_path = data.project_path + "/" + data.out_dir;
+// The options a plan depends on, a snapshot made with others is planned again
+std::string plan_settings(const BuildOptions &options) {
+    return options.sources == SourceDiscovery::GitIndex ? "sources=git" : "sources=walk";
+}
+
+void run_build_plan(BuildPlan &plan, const std::string &full_out_path, const BuildOptions &options) {
+    BuildState state(full_out_path + "/.weld_state");
+    DepsLog deps_log(full_out_path + "/.weld_deps");
     
-    std::filesystem::create_directory(full_out_path);
+    // Remote compiles are bound by the worker slots, the local jobs only by the CPUs here
+    std::unique_ptr<DistributedCompiler> distributed;
+    if (!options.workers.empty()) {
+        distributed = std::make_unique<DistributedCompiler>(options.workers);
+    }
     
-    ThreadPool pool(std::thread::hardware_concurrency());
-    std::vector<std::future<void>> futures;
+    // Probes are reused by the next invocation, even when this build fails
+    plan.toolchain.save();
     
-    for (std::string member : data.members) {
-        std::string full_member_path = data.project_path + "/" + member;
-        TOMLReader member_reader(full_member_path);
-        TOMLData member_data = member_reader.get_data();
-        
-        for (std::tuple<std::string, bool> dep : member_data.deps.m_Dependencies) {
-            TOMLReader dep_reader(member_data.project_path + "/" + std::get<0>(dep));
-            TOMLData dep_data = dep_reader.get_data();
-            
-            if (std::find(data.members.begin(), data.members.end(), dep_data.project_name) == data.members.end()) {
-                if (dep_data.project_type != "Utility") {
-                    if (dep_data.toolset == "gcc" || dep_data.toolset == "g++") {
-                        build_project_gnuc(dep_data);
-                    } else {
-                        std::cerr << "error: invalid toolset in " + dep_data.project_name << std::endl;
-                        exit(1);
-                    }
-                }
-                
-                build_and_add_dep(dep, member_data, dep_data);
-            } else {
-                build_and_add_dep_member(dep, member_data, dep_data, full_out_path);
-            }
+    Scheduler scheduler(plan.graph, state, deps_log, options.jobs);
+    if (distributed && distributed->slots() > 0) {
+        scheduler.use_distributed(distributed.get());
+    }
+    
+    // Objects and libraries are always compared by content, sources only when asked for
+    SourceCheck sources = SourceCheck::Stamps;
+    if (options.token_fingerprints) {
+        sources = SourceCheck::Tokens;
+    } else if (options.content_digests) {
+        sources = SourceCheck::Digests;
+    }
+    
+    DigestTable digests(full_out_path + "/.weld_digests");
+    scheduler.use_digests(&digests, sources);
+    
+    // One batch of stats up front instead of one stat per input during the checks
+    StatCache stat_cache(options.stat_batching);
+    scheduler.use_stat_cache(&stat_cache);
+    digests.use_stats(&stat_cache);
+    
+    std::unique_ptr<Sandbox> sandbox;
+    if (options.sandbox) {
+        sandbox = std::make_unique<Sandbox>();
+        if (!sandbox->valid()) {
+            std::cerr << "error: the sandbox needs unprivileged user namespaces, which this system doesn't allow" << std::endl;
+            exit(1);
         }
+        scheduler.use_sandbox(sandbox.get());
+    }
+    
+    // The remote cache outlives the local one, which may still hand it uploads
+    std::unique_ptr<RemoteCache> remote;
+    std::unique_ptr<CompileCache> cache;
+    if (options.cache) {
+        cache = std::make_unique<CompileCache>(options.cache_dir, options.cache_backend, options.cache_limits,
+                                               options.cache_hardlinks);
+        scheduler.use_cache(cache.get());
         
-        run_build_commands(0, data);
-        
-        std::string gnuc_path = find_exec_path(member_data.toolset);
-        
-        std::string full_member_src_path = member_data.project_path + "/" + member_data.src_dir;
-        std::string full_member_out_path = data.project_path + "/" + data.out_dir + "/" + member_data.project_name;
+        if (!options.remote_cache.empty()) {
+            remote = std::make_unique<RemoteCache>(options.remote_cache, options.remote_cache_mode);
+            cache->use_remote(remote.get());
+        }
+    }
+    
+    bool ok = scheduler.run();
+    digests.save();
+    
+    if (!ok) {
+        std::cerr << "error: build failed!" << std::endl;
+        exit(1);
+    }
+    
+    const BuildStats &stats = scheduler.stats();
+    if (stats.actions > 0) {
+        std::printf(
+            "Finished %zu actions (user %.2fs, sys %.2fs, peak rss %ld MB)\n",
+            stats.actions, stats.user_time, stats.system_time, stats.max_rss_kb / 1024
+        );
+    }
+}
+
+void build_project_gnuc(const TOMLData &data, const BuildOptions &options) {
+    BuildPlan plan;
+    plan.sources = options.sources;
+    
+    std::string full_out_path = data.project_path + "/" + data.out_dir;
+    std::string snapshot_path = full_out_path + "/.weld_plan";
+    std::string settings = plan_settings(options);
+    
+    // Nothing the plan was resolved from changed, so neither manifests nor source dirs are read
+    if (!load_plan_snapshot(snapshot_path, data.project_path, settings, plan.graph)) {
+        preload_manifests({ data.project_path });
         
-        std::filesystem::create_directory(full_member_out_path);
-        std::filesystem::create_directory(full_member_out_path + "/genobjs");
+        ListingCache listings(full_out_path + "/.weld_listings");
+        plan.listings = &listings;
         
-        std::vector<std::filesystem::path> files
-            = get_args_with_extensions(full_member_src_path, member_data.cextensions);
-        exclude_files_and_folders(full_member_src_path, files, member_data.exclude);
+        plan_project_gnuc(plan, data, full_out_path);
+        save_plan_snapshot(snapshot_path, data.project_path, settings, plan.graph, plan.inputs);
+        listings.save();
+    }
+    
+    run_build_plan(plan, full_out_path, options);
+}
+
+void plan_workspace_gnuc(BuildPlan &plan, const TOMLData &data, const std::string &full_out_path) {
+    plan.inputs.watch(data.project_path + "/weld.toml");
+    
+    for (std::string member : data.members) {
+        plan.members.emplace(project_key(data.project_path + "/" + member), project_key(full_out_path));
+    }
+    
+    // The workspace commands wrap the whole build, not every single member
+    size_t stage0 = add_build_commands(plan.graph, 0, data);
+    plan.before.push_back(stage0);
+    
+    size_t stage1 = add_build_commands(plan.graph, 1, data);
+    size_t stage2 = add_build_commands(plan.graph, 2, data);
+    plan.graph.depend(stage2, stage1);
+    
+    std::vector<std::filesystem::path> member_paths;
+    for (const auto &member : data.members) member_paths.push_back(data.project_path + "/" + member);
+    preload_manifests(member_paths);
+    
+    for (const auto &member_path : member_paths) {
+        const TOMLData &member_data = load_manifest(member_path);
         
-        std::string out_name = member_data.project_name;
+        if (member_data.toolset != "gcc" && member_data.toolset != "g++") {
+            std::cerr << "error: invalid toolset in " + member_data.project_name << std::endl;
+            exit(1);
+        }
         
-        #ifdef __linux__
-            if (member_data.project_type == "SharedLib") {
-                member_data.cflags.push_back("-fPIC");
-                member_data.lflags.push_back("-fPIC");
-                member_data.lflags.push_back("-shared");
-                out_name = "lib" + member_data.project_name + ".so";
-            } else if (member_data.project_type == "StaticLib") {
-                out_name = "lib" + member_data.project_name + ".a";
-            } else {
-                if (member_data.project_type != "ConsoleApp") {
-                    std::cerr << "error: invalid project type!" << std::endl;
-                    exit(1);
-                }
-            }
-            
-            for (auto &file : files) {
-                std::filesystem::path out_file = file.filename(); out_file.replace_extension(".o");
-                std::cout << "Building ---> " + file.filename().string() + "\n";
-                pool.enqueue([=]() {
-                    Commands::run(
-                        gnuc_path,
-                        member_data.cflags,
-                        "-c", file,
-                        "-o", full_member_out_path + "/genobjs/" + out_file.string()
-                    );
-                    
-                    std::cout << "Finished ---> " << out_file.string() << std::endl;
-                });
-            }
-            
-            pool.get();
-            
-            run_build_commands(1, data);
-            
-            for (auto &file : files) {
-                file = std::filesystem::path(full_member_out_path + "/genobjs/").concat(file.filename().replace_extension(".o").string());
-            }
-            
-            if (member_data.project_type == "StaticLib") {
-                std::cout << "Creating ---> " << out_name << std::endl;
-                Commands::run(
-                    find_exec_path("ar"),
-                    "rcs",
-                    full_member_out_path + "/" + out_name,
-                    files
-                );
-                std::cout << "Finished Creating Static" << std::endl;
-            } else {
-                std::cout << "Linking ---> " << member_data.project_name << std::endl;
-                Commands::run(
-                    gnuc_path,
-                    files,
-                    member_data.lflags,
-                    "-o", full_member_out_path + "/" + out_name
-                );
-                std::cout << "Finished Linking" << std::endl;
-            }
-        #endif
+        ProjectNodes nodes = plan_project_gnuc(plan, member_data, full_out_path + "/" + member_data.project_name);
+        plan.graph.depend(stage1, nodes.done);
+    }
+}
+
+void build_workspace_gnuc(const TOMLData &data, const BuildOptions &options) {
+    std::string full_out_path = data.project_path + "/" + data.out_dir;
+    std::string snapshot_path = full_out_path + "/.weld_plan";
+    
+    std::filesystem::create_directory(full_out_path);
+    
+    BuildPlan plan;
+    plan.sources = options.sources;
+    std::string settings = plan_settings(options);
+    
+    if (!load_plan_snapshot(snapshot_path, data.project_path, settings, plan.graph)) {
+        ListingCache listings(full_out_path + "/.weld_listings");
+        plan.listings = &listings;
         
-        run_build_commands(2, data);
+        plan_workspace_gnuc(plan, data, full_out_path);
+        save_plan_snapshot(snapshot_path, data.project_path, settings, plan.graph, plan.inputs);
+        listings.save();
     }
+    
+    run_build_plan(plan, full_out_path, options);
 }
 
 void create_project(std::string toolset, std::string project_name) {
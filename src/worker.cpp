@@ -0,0 +1,141 @@
+#include "worker.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "distributed.hpp"
+#include "http.hpp"
+#include "process.hpp"
+
+// Compilers are looked up in the worker's PATH, requests can't name a program by path
+static bool is_compiler(const std::string &name) {
+    if (name.empty() || name.find('/') != std::string::npos) return false;
+
+    return name == "cc" || name == "c++"
+        || name.find("gcc") != std::string::npos
+        || name.find("g++") != std::string::npos
+        || name.find("clang") != std::string::npos;
+}
+
+// Runs the compiler like Process::capture, but kills it once the client hung up
+static int run_compiler(const std::vector<std::string> &argv, const std::filesystem::path &dir, int client, std::string &output) {
+    ChildProcess child;
+    std::string error;
+    if (!Process::start(argv, true, child, error, dir)) {
+        output = error;
+        return 127;
+    }
+
+    struct pollfd fds[3] = { { child.out_fd, POLLIN, 0 }, { child.err_fd, POLLIN, 0 }, { client, POLLRDHUP, 0 } };
+    char buffer[16 * 1024];
+
+    while (fds[0].fd >= 0 || fds[1].fd >= 0) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (fds[2].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+            kill(child.pid, SIGKILL);
+            fds[2].fd = -1;
+        }
+
+        for (int i = 0; i < 2; ++i) {
+            if (fds[i].fd < 0 || !fds[i].revents) continue;
+
+            ssize_t size = read(fds[i].fd, buffer, sizeof(buffer));
+            if (size > 0) {
+                output.append(buffer, size);
+            } else if (size == 0 || (errno != EAGAIN && errno != EINTR)) {
+                fds[i].fd = -1;
+            }
+        }
+    }
+
+    int status = 0;
+    while (waitpid(child.pid, &status, 0) < 0 && errno == EINTR) {}
+    Process::finish(child);
+    return Process::exit_code(status);
+}
+
+static void compile(const CompileRequest &request, const std::filesystem::path &dir, int client, CompileResult &result) {
+    std::filesystem::create_directories(dir);
+    std::filesystem::path source = dir / "source", object = dir / "object.o";
+
+    {
+        std::ofstream out(source, std::ios::binary | std::ios::trunc);
+        out << request.source;
+    }
+
+    // Runs inside `dir` with it mapped to ., so no worker path ends up in the object
+    std::vector<std::string> argv = request.argv;
+    argv.insert(argv.end(), { "-ffile-prefix-map=" + dir.string() + "=.", "source", "-o", "object.o" });
+
+    result.exit_code = run_compiler(argv, dir, client, result.diagnostics);
+
+    if (result.exit_code == 0) {
+        std::ifstream in(object, std::ios::binary);
+        std::stringstream content;
+        content << in.rdbuf();
+        result.object = content.str();
+    }
+
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+}
+
+int run_worker(const std::string &host, const std::string &port, size_t slots) {
+    int server = http_listen(host, port);
+    if (server < 0) return 1;
+
+    std::cout << "Working ---> " << slots << " slots on " << host << ":" << port << std::endl;
+
+    std::filesystem::path temp_dir = std::filesystem::temp_directory_path() / ("weld-worker-" + std::to_string(getpid()));
+    std::atomic<size_t> running = 0, next_id = 0;
+
+    // One spare thread answers status requests and turns away compiles while every slot is busy
+    http_serve(server, slots + 1, [&](const HttpRequest &request, HttpResponse &response) {
+        if (request.method == "GET" && request.path == "/status") {
+            response.status = 200;
+            response.body = "slots " + std::to_string(slots) + "\nrunning " + std::to_string(running.load()) + "\n";
+            return;
+        }
+
+        if (request.method != "POST" || request.path != "/compile") {
+            response.status = request.path == "/compile" || request.path == "/status" ? 405 : 404;
+            return;
+        }
+
+        CompileRequest compile_request;
+        if (!decode_compile_request(request.body, compile_request)
+            || compile_request.argv.empty()
+            || !is_compiler(compile_request.argv.front())
+            || !is_remote_argv(compile_request.argv)) {
+            response.status = 400;
+            return;
+        }
+
+        if (++running > slots) {
+            --running;
+            response.status = 503;
+            return;
+        }
+
+        CompileResult result;
+        compile(compile_request, temp_dir / std::to_string(next_id++), request.fd, result);
+        --running;
+
+        response.status = 200;
+        response.body = encode_compile_result(result);
+    });
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Runs compiles for other weld invocations (see distributed.hpp) until weld
+// is killed. Compile requests carry arbitrary compiler flags, so only
+// listen on networks whose machines are trusted.
+int run_worker(const std::string &host, const std::string &port, size_t slots);
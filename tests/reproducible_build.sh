@@ -0,0 +1,91 @@
+#!/bin/sh
+# Builds the example workspaces under two different roots and checks that the
+# objects, archives and binaries come out byte for byte the same, with neither
+# root left in them. Covers -ffile-prefix-map, `ar D` and the $ORIGIN rpaths.
+# Then builds the second tree again from the compile cache the first one
+# filled, where every compile and archive has to be a hit, so no path of the
+# checkout may end up in a cache key.
+#
+# usage: reproducible_build.sh <weld> <examples dir>
+set -eu
+
+weld=$1
+examples=$2
+
+root=$(mktemp -d)
+trap 'rm -rf "$root"' EXIT
+
+# Only the cache passes share a cache, and no pass uses a worker
+build() {
+    (cd "$1" && env -u WELD_CACHE -u WELD_CACHE_DIR -u WELD_REMOTE_CACHE -u WELD_WORKERS HOME="$2" "$weld" >/dev/null)
+}
+
+cached_build() {
+    (cd "$1" && env -u WELD_REMOTE_CACHE -u WELD_WORKERS WELD_CACHE=1 WELD_CACHE_DIR="$root/cache" HOME="$2" "$weld")
+}
+
+checkout() {
+    rm -rf "$root/$1"
+    mkdir -p "$root/$1"
+    cp -r "$examples/dep" "$examples/members" "$root/$1/"
+}
+
+# Tree a fills the cache, tree b is built without one
+checkout a
+cached_build "$root/a/dep/app" "$root/a" >/dev/null
+cached_build "$root/a/members" "$root/a" >/dev/null
+
+checkout b
+build "$root/b/dep/app" "$root/b"
+build "$root/b/members" "$root/b"
+
+cd "$root/a"
+outputs=$(find . -path '*/src' -prune -o -type f \( -name '*.o' -o -name '*.a' -o -name '*.so' -o -perm -u+x \) -print | sort)
+
+if [ -z "$outputs" ]; then
+    echo "error: the examples built nothing" >&2
+    exit 1
+fi
+
+status=0
+for output in $outputs; do
+    if ! cmp -s "$output" "$root/b/$output"; then
+        echo "error: $output differs between the two roots" >&2
+        status=1
+    fi
+
+    for tree in a b; do
+        if grep -q -F "$root" "$root/$tree/$output"; then
+            echo "error: $output in tree $tree contains an absolute path to it" >&2
+            status=1
+        fi
+    done
+done
+
+# A fresh checkout of b at its own root from a's cache
+checkout b
+log="$root/cached.log"
+cached_build "$root/b/dep/app" "$root/b" > "$log"
+cached_build "$root/b/members" "$root/b" >> "$log"
+
+finished=$(grep -c -E '^(Finished ---> |Finished Creating Static)' "$log" || true)
+if [ "$finished" -eq 0 ]; then
+    echo "error: the cached build of tree b compiled nothing" >&2
+    status=1
+fi
+
+misses=$(grep -E '^(Finished ---> |Finished Creating Static)' "$log" | grep -v -F ' (cached)' || true)
+if [ -n "$misses" ]; then
+    echo "error: tree b missed the cache tree a filled:" >&2
+    echo "$misses" >&2
+    status=1
+fi
+
+for output in $outputs; do
+    if ! cmp -s "$output" "$root/b/$output"; then
+        echo "error: $output restored from the cache differs from the one built in tree a" >&2
+        status=1
+    fi
+done
+
+exit $status
@@ -0,0 +1,74 @@
+#!/bin/sh
+# Builds a program with --token-fingerprints whose __LINE__ comes from a macro
+# in a header, moves the call down and checks it gets rebuilt, and that
+# editing a comment still rebuilds nothing.
+#
+# usage: token_fingerprints.sh <weld>
+set -eu
+
+weld=$1
+
+root=$(mktemp -d)
+trap 'rm -rf "$root"' EXIT
+
+mkdir -p "$root/src"
+cat > "$root/weld.toml" <<'TOML'
+[project]
+name = "where"
+type = "ConsoleApp"
+
+[files]
+cextensions = [".cpp"]
+
+[settings]
+toolset = "g++"
+
+src_dir = "src"
+out_dir = "out"
+
+[gnuc]
+cflags = ["-O2", "-std=c++20"]
+TOML
+
+# Lowercase, so only the __LINE__ in the header tells
+cat > "$root/src/where.h" <<'HEADER'
+#include <cstdio>
+#include <source_location>
+#define where() std::printf("line %d column %u\n", __LINE__, std::source_location::current().column())
+HEADER
+
+write_main() {
+    printf '#include "where.h"\n%bint main() {\n%swhere(); // %s\n}\n' "$1" "$2" "$3" > "$root/src/main.cpp"
+}
+
+build() {
+    (cd "$root" && env -u WELD_CACHE -u WELD_CACHE_DIR -u WELD_REMOTE_CACHE -u WELD_WORKERS HOME="$root" "$weld" --token-fingerprints)
+}
+
+status=0
+check() {
+    build > "$root/log"
+    output=$("$root/out/where")
+    if [ "$output" != "$1" ]; then
+        echo "error: $2: printed \`$output\` instead of \`$1\`" >&2
+        status=1
+    fi
+}
+
+write_main '' '    ' 'first'
+check 'line 3 column 5' "first build"
+
+write_main '\n\n' '    ' 'first'
+check 'line 5 column 5' "after adding blank lines"
+
+write_main '\n\n' '        ' 'first'
+check 'line 5 column 9' "after indenting the call"
+
+write_main '\n\n' '        ' 'second'
+build > "$root/log"
+if grep -q 'Building' "$root/log"; then
+    echo "error: editing a comment rebuilt main.cpp" >&2
+    status=1
+fi
+
+exit $status